@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_DEFAULT_BLOCK_SIZE 4096
+#define ARENA_ALIGN 16
+
+static inline size_t align_up(size_t n) {
+  return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void text_op_arena_init(text_op_arena *arena, size_t block_size) {
+  arena->head = NULL;
+  arena->used = 0;
+  arena->last = NULL;
+  arena->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK_SIZE;
+  arena->size = 0;
+}
+
+void text_op_arena_reset(text_op_arena *arena) {
+  if (arena->head) {
+    // Keep the current block. Its the most recent, so its probably the one thats big enough.
+    text_op_arena_block *b = arena->head->next;
+    while (b) {
+      text_op_arena_block *next = b->next;
+      free(b);
+      b = next;
+    }
+    arena->head->next = NULL;
+    arena->size = arena->head->capacity;
+  }
+  arena->used = 0;
+  arena->last = NULL;
+}
+
+void text_op_arena_destroy(text_op_arena *arena) {
+  text_op_arena_reset(arena);
+  free(arena->head);
+  arena->head = NULL;
+  arena->size = 0;
+}
+
+void *text_op_arena_alloc(text_op_arena *arena, size_t bytes) {
+  bytes = align_up(bytes ? bytes : 1);
+  
+  if (arena->head == NULL || arena->used + bytes > arena->head->capacity) {
+    size_t capacity = bytes > arena->block_size ? bytes : arena->block_size;
+    text_op_arena_block *b = malloc(sizeof(text_op_arena_block) + capacity);
+    b->next = arena->head;
+    b->capacity = capacity;
+    arena->head = b;
+    arena->used = 0;
+    arena->size += capacity;
+  }
+  
+  uint8_t *ptr = &arena->head->data[arena->used];
+  arena->used += bytes;
+  arena->last = ptr;
+  return ptr;
+}
+
+void *text_op_arena_realloc(text_op_arena *arena, void *ptr, size_t old_bytes, size_t new_bytes) {
+  if (ptr == NULL) {
+    return text_op_arena_alloc(arena, new_bytes);
+  }
+  
+  if (ptr == arena->last) {
+    // Try to grow the allocation in place.
+    size_t start = (uint8_t *)ptr - arena->head->data;
+    if (start + align_up(new_bytes) <= arena->head->capacity) {
+      arena->used = start + align_up(new_bytes);
+      return ptr;
+    }
+  }
+  
+  if (new_bytes <= old_bytes) {
+    return ptr;
+  }
+  
+  void *new_ptr = text_op_arena_alloc(arena, new_bytes);
+  memcpy(new_ptr, ptr, old_bytes);
+  return new_ptr;
+}
@@ -0,0 +1,51 @@
+// A tiny bump allocator for ops which don't live very long.
+//
+// Transform and compose normally malloc the component list and every long insert of the result
+// separately. If you're going to throw a whole batch of ops away again soon (eg, after applying or
+// forwarding them), build them in an arena instead using the *_arena functions in text.h. The
+// memory is carved out of a few big blocks and freed all at once when the arena is reset.
+
+#ifndef OT_arena_h
+#define OT_arena_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct text_op_arena_block {
+  struct text_op_arena_block *next;
+  size_t capacity;
+  uint8_t data[];
+} text_op_arena_block;
+
+typedef struct {
+  // The block we're currently allocating out of. Older (full) blocks hang off head->next.
+  text_op_arena_block *head;
+  // Bytes used in head.
+  size_t used;
+  // The most recent allocation. This can be grown in place by text_op_arena_realloc.
+  uint8_t *last;
+  // Size of new blocks. Bigger allocations get a block to themselves.
+  size_t block_size;
+  // The capacity of all the arena's blocks added together.
+  size_t size;
+} text_op_arena;
+
+// Initialize an empty arena. No memory is allocated until the arena is first used. Pass 0 for
+// block_size to use a sensible default.
+void text_op_arena_init(text_op_arena *arena, size_t block_size);
+
+// Free everything allocated in the arena. The arena keeps its current block around so it can be
+// reused without going back to malloc.
+void text_op_arena_reset(text_op_arena *arena);
+
+// Free the arena's memory. The arena must be initialized again before reuse.
+void text_op_arena_destroy(text_op_arena *arena);
+
+// Allocate bytes out of the arena. The memory is suitably aligned for any op structure.
+void *text_op_arena_alloc(text_op_arena *arena, size_t bytes);
+
+// Resize an allocation. If ptr was the last thing allocated and there's room in the block, it is
+// grown in place. Otherwise the data is copied somewhere new.
+void *text_op_arena_realloc(text_op_arena *arena, void *ptr, size_t old_bytes, size_t new_bytes);
+
+#endif
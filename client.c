@@ -0,0 +1,95 @@
+#include "client.h"
+
+static inline bool is_noop(const text_op *op) {
+  return op->components == NULL && op->content.type == TEXT_OP_NONE;
+}
+
+void ot_text_client_init(ot_text_client *client, size_t version) {
+  client->state = OT_CLIENT_SYNCED;
+  client->version = version;
+}
+
+void ot_text_client_destroy(ot_text_client *client) {
+  if (client->state != OT_CLIENT_SYNCED) {
+    text_op_free(&client->inflight);
+  }
+  if (client->state == OT_CLIENT_AWAITING_WITH_BUFFER) {
+    text_op_free(&client->buffer);
+  }
+}
+
+const text_op *ot_text_client_local_op(ot_text_client *client, text_op *op) {
+  if (is_noop(op)) {
+    return NULL;
+  }
+  
+  switch (client->state) {
+    case OT_CLIENT_SYNCED:
+      text_op_clone2(&client->inflight, op);
+      client->state = OT_CLIENT_AWAITING_CONFIRM;
+      return &client->inflight;
+    case OT_CLIENT_AWAITING_CONFIRM:
+      text_op_clone2(&client->buffer, op);
+      client->state = OT_CLIENT_AWAITING_WITH_BUFFER;
+      return NULL;
+    case OT_CLIENT_AWAITING_WITH_BUFFER: {
+      text_op buffer;
+      text_op_compose2(&buffer, &client->buffer, op);
+      text_op_free(&client->buffer);
+      client->buffer = buffer;
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+const text_op *ot_text_client_server_ack(ot_text_client *client) {
+  client->version++;
+  
+  switch (client->state) {
+    case OT_CLIENT_SYNCED:
+      // We weren't waiting for anything. This shouldn't happen.
+      return NULL;
+    case OT_CLIENT_AWAITING_CONFIRM:
+      text_op_free(&client->inflight);
+      client->state = OT_CLIENT_SYNCED;
+      return NULL;
+    case OT_CLIENT_AWAITING_WITH_BUFFER:
+      text_op_free(&client->inflight);
+      if (is_noop(&client->buffer)) {
+        // Remote ops cancelled out everything we buffered.
+        text_op_free(&client->buffer);
+        client->state = OT_CLIENT_SYNCED;
+        return NULL;
+      }
+      client->inflight = client->buffer;
+      client->state = OT_CLIENT_AWAITING_CONFIRM;
+      return &client->inflight;
+  }
+  return NULL;
+}
+
+void ot_text_client_server_op(ot_text_client *client, text_op *op, text_op *to_apply) {
+  client->version++;
+  
+  if (client->state == OT_CLIENT_SYNCED) {
+    text_op_clone2(to_apply, op);
+    return;
+  }
+  
+  // The server put op before our inflight op, so op goes on the right.
+  text_op inflight, op_;
+  text_op_transform_x(&inflight, &op_, &client->inflight, op);
+  text_op_free(&client->inflight);
+  client->inflight = inflight;
+  
+  if (client->state == OT_CLIENT_AWAITING_WITH_BUFFER) {
+    text_op buffer;
+    text_op_transform_x(&buffer, to_apply, &client->buffer, &op_);
+    text_op_free(&client->buffer);
+    text_op_free(&op_);
+    client->buffer = buffer;
+  } else {
+    *to_apply = op_;
+  }
+}
@@ -0,0 +1,58 @@
+// The client side of a collaboratively edited text document.
+//
+// This is the same state machine as the ShareJS client. A client is always in one of 3 states:
+// - Synced: the server has seen all our ops.
+// - Awaiting confirm: we've sent an op (the inflight op) and are waiting for the server to
+//   acknowledge it.
+// - Awaiting with buffer: we're waiting for the server, and the user has made more edits in the
+//   meantime. They're all composed together into a single buffered op, which is sent once the
+//   inflight op is acknowledged.
+//
+// So only one op is ever in flight, and no matter how fast the user types, a client sends at most
+// one op per round trip to the server.
+
+#ifndef OT_client_h
+#define OT_client_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "text.h"
+
+typedef enum {
+  OT_CLIENT_SYNCED,
+  OT_CLIENT_AWAITING_CONFIRM,
+  OT_CLIENT_AWAITING_WITH_BUFFER,
+} ot_client_state;
+
+typedef struct {
+  ot_client_state state;
+  
+  // The server version of the document we're editing. The inflight op was written against this
+  // version.
+  size_t version;
+  
+  // Only valid in the awaiting states.
+  text_op inflight;
+  // Only valid when awaiting with buffer.
+  text_op buffer;
+} ot_text_client;
+
+void ot_text_client_init(ot_text_client *client, size_t version);
+void ot_text_client_destroy(ot_text_client *client);
+
+// Tell the client about an edit the user made. The op should already be applied to the local
+// document. If the op should be sent to the server right away, this returns it (it was written
+// against client->version). Otherwise the op is buffered and this returns NULL.
+const text_op *ot_text_client_local_op(ot_text_client *client, text_op *op);
+
+// The server has acknowledged our inflight op. If there are buffered edits, they are now in flight
+// and this returns them so they can be sent. Otherwise returns NULL.
+const text_op *ot_text_client_server_ack(ot_text_client *client);
+
+// An op arrived from another client via the server. The op is transformed past our pending edits
+// and written into to_apply, which should then be applied to the local document and freed.
+void ot_text_client_server_op(ot_text_client *client, text_op *op, text_op *to_apply);
+
+#endif
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include "doc.h"
+
+#define MIN(x,y) ((x) > (y) ? (y) : (x))
+
+static inline size_t charge_hash(const ot_text_doc *doc, const void *ptr) {
+  return (size_t)(((uint64_t)(uintptr_t)ptr * 0x9e3779b97f4a7c15ull) >> 32)
+      & (doc->charges_capacity - 1);
+}
+
+static ot_text_doc_charge *find_charge(const ot_text_doc *doc, const void *ptr) {
+  size_t mask = doc->charges_capacity - 1;
+  for (size_t i = charge_hash(doc, ptr); ; i = (i + 1) & mask) {
+    if (doc->charges[i].ptr == NULL || doc->charges[i].ptr == ptr) {
+      return &doc->charges[i];
+    }
+  }
+}
+
+// Note that another op in the history holds onto ptr. Returns true if nothing did before.
+static bool charge_add(ot_text_doc *doc, const void *ptr) {
+  // Keep the table at most 3/4 full.
+  if ((doc->num_charges + 1) * 4 > doc->charges_capacity * 3) {
+    ot_text_doc_charge *old = doc->charges;
+    size_t old_capacity = doc->charges_capacity;
+    doc->charges_capacity = old_capacity ? old_capacity * 2 : 64;
+    doc->charges = calloc(doc->charges_capacity, sizeof(ot_text_doc_charge));
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old[i].ptr) {
+        *find_charge(doc, old[i].ptr) = old[i];
+      }
+    }
+    free(old);
+  }
+  
+  ot_text_doc_charge *charge = find_charge(doc, ptr);
+  if (charge->ptr) {
+    charge->refs++;
+    return false;
+  }
+  *charge = (ot_text_doc_charge){ptr, 1};
+  doc->num_charges++;
+  return true;
+}
+
+// The opposite of charge_add. Returns true if nothing in the history holds onto ptr anymore.
+static bool charge_remove(ot_text_doc *doc, const void *ptr) {
+  ot_text_doc_charge *charge = find_charge(doc, ptr);
+  if (--charge->refs) {
+    return false;
+  }
+  
+  // Shift later entries back into the hole if it's between them and where they hash to, so
+  // lookups never stop short at it.
+  size_t mask = doc->charges_capacity - 1;
+  size_t hole = charge - doc->charges;
+  for (size_t i = (hole + 1) & mask; doc->charges[i].ptr; i = (i + 1) & mask) {
+    size_t home = charge_hash(doc, doc->charges[i].ptr);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      doc->charges[hole] = doc->charges[i];
+      hole = i;
+    }
+  }
+  doc->charges[hole].ptr = NULL;
+  doc->num_charges--;
+  return true;
+}
+
+static size_t str_charge(ot_text_doc *doc, const str *s, bool add) {
+  const str_buf *buf = str_buffer(s);
+  if (buf == NULL) {
+    // Inline strings live in the op itself.
+    return 0;
+  }
+  return (add ? charge_add(doc, buf) : charge_remove(doc, buf)) ? str_buffer_size(buf) : 0;
+}
+
+// Add the op to the memory the history holds onto (or take it back out). Returns how many bytes
+// that adds (or frees). Clones share their components, so their inserts are only looked at the
+// first time a list of components is seen.
+static size_t op_charge(ot_text_doc *doc, const text_op *op, bool add) {
+  size_t size = sizeof(text_op);
+  if (op->components == NULL) {
+    if (op->content.type == TEXT_OP_INSERT) {
+      size += str_charge(doc, &op->content.str, add);
+    }
+  } else if (add ? charge_add(doc, op->components) : charge_remove(doc, op->components)) {
+    size += op->capacity * sizeof(text_op_component);
+    for (size_t i = 0; i < op->num_components; i++) {
+      if (op->components[i].type == TEXT_OP_INSERT) {
+        size += str_charge(doc, &op->components[i].str, add);
+      }
+    }
+  }
+  return size;
+}
+
+static inline text_op *history_at(const ot_text_doc *doc, size_t i) {
+  return &doc->history[(doc->history_start + i) % doc->history_capacity];
+}
+
+static void drop_oldest(ot_text_doc *doc) {
+  text_op *op = history_at(doc, 0);
+  doc->history_bytes -= op_charge(doc, op, false);
+  text_op_free(op);
+  doc->history_start = (doc->history_start + 1) % doc->history_capacity;
+  doc->history_len--;
+}
+
+static void push_history(ot_text_doc *doc, text_op op) {
+  // Charge the op first, so memory it shares with older ops stays charged as they're dropped.
+  doc->history_bytes += op_charge(doc, &op, true);
+  while (doc->history_len && doc->history_bytes > doc->max_history_bytes) {
+    drop_oldest(doc);
+  }
+  if (doc->history_bytes > doc->max_history_bytes) {
+    // The op doesn't fit at all. Nothing older than it is useful either.
+    doc->history_bytes -= op_charge(doc, &op, false);
+    text_op_free(&op);
+    return;
+  }
+  
+  if (doc->history_len == doc->history_capacity) {
+    // Grow the ring, unrolling it into the new space as we go.
+    size_t capacity = doc->history_capacity ? doc->history_capacity * 2 : 16;
+    text_op *history = malloc(sizeof(text_op) * capacity);
+    for (size_t i = 0; i < doc->history_len; i++) {
+      history[i] = *history_at(doc, i);
+    }
+    free(doc->history);
+    doc->history = history;
+    doc->history_start = 0;
+    doc->history_capacity = capacity;
+  }
+  
+  *history_at(doc, doc->history_len++) = op;
+}
+
+ot_text_doc *ot_text_doc_new(const uint8_t *content, size_t max_history_bytes) {
+  ot_text_doc *doc = malloc(sizeof(ot_text_doc));
+  doc->content = content ? rope_new_with_utf8(content) : rope_new();
+  doc->version = 0;
+  doc->history = NULL;
+  doc->history_start = doc->history_len = doc->history_capacity = 0;
+  doc->history_bytes = 0;
+  doc->max_history_bytes = max_history_bytes;
+  doc->charges = NULL;
+  doc->num_charges = doc->charges_capacity = 0;
+  return doc;
+}
+
+void ot_text_doc_free(ot_text_doc *doc) {
+  while (doc->history_len) {
+    drop_oldest(doc);
+  }
+  free(doc->history);
+  free(doc->charges);
+  rope_free(doc->content);
+  free(doc);
+}
+
+const text_op *ot_text_doc_op_at(const ot_text_doc *doc, size_t version) {
+  if (version >= doc->version || version < ot_text_doc_oldest_version(doc)) {
+    return NULL;
+  }
+  return history_at(doc, version - ot_text_doc_oldest_version(doc));
+}
+
+ssize_t ot_text_doc_submit(ot_text_doc *doc, text_op *op, size_t base_version, text_op *applied) {
+  if (base_version > doc->version || base_version < ot_text_doc_oldest_version(doc)) {
+    return -1;
+  }
+  
+  // Transform the op by everything which happened since base_version. The ops we need might wrap
+  // around the end of the ring, in which case there are two runs of them.
+  size_t missed = doc->version - base_version;
+  text_op op_;
+  if (missed == 0) {
+    text_op_clone2(&op_, op);
+  } else {
+    size_t first = (doc->history_start + doc->history_len - missed) % doc->history_capacity;
+    size_t run = MIN(missed, doc->history_capacity - first);
+    
+    // Submitted ops go on the left, like in ShareJS.
+    text_op_transform_many(&op_, op, &doc->history[first], run, true);
+    if (run < missed) {
+      text_op tmp = op_;
+      text_op_transform_many(&op_, &tmp, doc->history, missed - run, true);
+      text_op_free(&tmp);
+    }
+  }
+  
+  if (text_op_apply(doc->content, &op_)) {
+    text_op_free(&op_);
+    return -1;
+  }
+  doc->version++;
+  
+  if (applied) {
+    text_op_clone2(applied, &op_);
+  }
+  push_history(doc, op_);
+  
+  return doc->version;
+}
@@ -0,0 +1,74 @@
+// A document being edited on a server.
+//
+// This holds the document's content, its version and a history of the ops which got it there. When
+// a client submits an op it wrote against an older version, the op is transformed past everything
+// the client hadn't seen yet before it is applied. The history is kept within a memory budget, so
+// clients which fall too far behind have their ops rejected and need to resync.
+
+#ifndef OT_doc_h
+#define OT_doc_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "text.h"
+#include "rope.h"
+
+// How many ops in the history hold onto a block of memory (a string buffer or a list of
+// components).
+typedef struct {
+  const void *ptr;
+  size_t refs;
+} ot_text_doc_charge;
+
+typedef struct {
+  rope *content;
+  
+  // The number of ops which have been applied to the document.
+  size_t version;
+  
+  // Ring buffer of recent ops, oldest first. The last op in the history took the document to the
+  // current version.
+  text_op *history;
+  size_t history_start;
+  size_t history_len;
+  size_t history_capacity;
+  
+  // How much memory the ops in the history hold onto, and how much they're allowed. Insert
+  // buffers are charged in full even if the history only uses a slice of them, and memory shared
+  // between ops is only charged once. (Allocator overhead isn't counted.)
+  size_t history_bytes;
+  size_t max_history_bytes;
+  
+  // The blocks charged to history_bytes. A hash table keyed by address (open addressing,
+  // charges_capacity is a power of 2).
+  ot_text_doc_charge *charges;
+  size_t num_charges;
+  size_t charges_capacity;
+} ot_text_doc;
+
+// Create a new document with the specified content (which can be NULL) at version 0. The history
+// is trimmed to stay under max_history_bytes.
+ot_text_doc *ot_text_doc_new(const uint8_t *content, size_t max_history_bytes);
+
+void ot_text_doc_free(ot_text_doc *doc);
+
+// Submit an op written against base_version. The op is transformed up to the current version,
+// checked and applied. If applied is not NULL, it is set to the op as it was applied (which the
+// caller needs to free) so it can be sent on to other clients.
+//
+// Returns the new version on success. Fails (returning negative) if the op is invalid or if
+// base_version is in the future or older than the history goes back.
+ssize_t ot_text_doc_submit(ot_text_doc *doc, text_op *op, size_t base_version, text_op *applied);
+
+// The oldest version which ops can still be submitted against.
+static inline size_t ot_text_doc_oldest_version(const ot_text_doc *doc) {
+  return doc->version - doc->history_len;
+}
+
+// Get the op which took the document from version to version + 1, or NULL if it isn't in the
+// history anymore. This is useful for catching up clients which have fallen behind.
+const text_op *ot_text_doc_op_at(const ot_text_doc *doc, size_t version);
+
+#endif
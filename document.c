@@ -0,0 +1,356 @@
+#include <stdlib.h>
+#include <string.h>
+#include "document.h"
+#include "utf8.h"
+
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+text_document *text_document_new(const text_document_type *type, const uint8_t *content) {
+  return type->create(content);
+}
+
+void text_document_free(text_document *doc) {
+  doc->type->free(doc);
+}
+
+int text_document_check(const text_document *doc, const text_op *op) {
+  return text_op_check_length(text_document_char_count(doc), op);
+}
+
+int text_document_apply(text_document *doc, const text_op *op) {
+  if (text_document_check(doc, op)) {
+    return 1;
+  }
+  return doc->type->apply(doc, op);
+}
+
+// Find the end of the next num characters at pos. Documents which are all ASCII (their byte and
+// character counts match) don't need to be scanned.
+static inline uint8_t *skip_chars(uint8_t *pos, size_t num, bool ascii) {
+  return ascii ? pos + num : count_utf8_chars(pos, num);
+}
+
+
+// ***** Rope
+
+typedef struct {
+  text_document doc;
+  rope *r;
+} rope_document;
+
+static text_document *rope_create(const uint8_t *content) {
+  rope_document *d = malloc(sizeof(rope_document));
+  d->doc.type = &TEXT_DOCUMENT_ROPE;
+  d->r = content ? rope_new_with_utf8(content) : rope_new();
+  return &d->doc;
+}
+
+static void rope_doc_free(text_document *doc) {
+  rope_document *d = (rope_document *)doc;
+  rope_free(d->r);
+  free(d);
+}
+
+static size_t rope_doc_char_count(const text_document *doc) {
+  return rope_char_count(((const rope_document *)doc)->r);
+}
+
+static int rope_doc_apply(text_document *doc, const text_op *op) {
+  return text_op_apply(((rope_document *)doc)->r, (text_op *)op);
+}
+
+static uint8_t *rope_doc_create_cstr(const text_document *doc) {
+  return rope_create_cstr(((rope_document *)doc)->r);
+}
+
+const text_document_type TEXT_DOCUMENT_ROPE = {
+  "rope", rope_create, rope_doc_free, rope_doc_char_count, rope_doc_apply, rope_doc_create_cstr
+};
+
+
+// ***** Flat array
+
+typedef struct {
+  text_document doc;
+  
+  // The content, which is always \0 terminated.
+  uint8_t *bytes;
+  size_t num_bytes;
+  size_t num_chars;
+  size_t capacity;
+  
+  // Big ops are written out into the spare buffer, which is then swapped with bytes.
+  uint8_t *spare;
+  size_t spare_capacity;
+} flat_document;
+
+static text_document *flat_create(const uint8_t *content) {
+  flat_document *d = malloc(sizeof(flat_document));
+  d->doc.type = &TEXT_DOCUMENT_FLAT;
+  d->num_bytes = content ? strlen((char *)content) : 0;
+  d->num_chars = content ? strlen_utf8(content) : 0;
+  d->capacity = MAX(d->num_bytes + 1, 64);
+  d->bytes = malloc(d->capacity);
+  if (content) {
+    memcpy(d->bytes, content, d->num_bytes);
+  }
+  d->bytes[d->num_bytes] = '\0';
+  d->spare = NULL;
+  d->spare_capacity = 0;
+  return &d->doc;
+}
+
+static void flat_free(text_document *doc) {
+  flat_document *d = (flat_document *)doc;
+  free(d->bytes);
+  free(d->spare);
+  free(d);
+}
+
+static size_t flat_char_count(const text_document *doc) {
+  return ((const flat_document *)doc)->num_chars;
+}
+
+static uint8_t *flat_create_cstr(const text_document *doc) {
+  const flat_document *d = (const flat_document *)doc;
+  uint8_t *result = malloc(d->num_bytes + 1);
+  memcpy(result, d->bytes, d->num_bytes + 1);
+  return result;
+}
+
+static int flat_apply(text_document *doc, const text_op *op) {
+  flat_document *d = (flat_document *)doc;
+  bool ascii = d->num_bytes == d->num_chars;
+  
+  if (op->components == NULL) {
+    // A single edit. Just move the rest of the document along.
+    if (op->content.type == TEXT_OP_NONE) {
+      return 0;
+    }
+    size_t offset = skip_chars(d->bytes, op->skip, ascii) - d->bytes;
+  
+    if (op->content.type == TEXT_OP_INSERT) {
+      const str *s = &op->content.str;
+      size_t num_bytes = str_num_bytes(s);
+      if (d->num_bytes + num_bytes + 1 > d->capacity) {
+        d->capacity = MAX(d->capacity * 2, d->num_bytes + num_bytes + 1);
+        d->bytes = realloc(d->bytes, d->capacity);
+      }
+      uint8_t *pos = &d->bytes[offset];
+      memmove(pos + num_bytes, pos, d->num_bytes - offset + 1);
+      memcpy(pos, str_content(s), num_bytes);
+      d->num_bytes += num_bytes;
+      d->num_chars += str_num_chars(s);
+    } else {
+      uint8_t *pos = &d->bytes[offset];
+      uint8_t *end = skip_chars(pos, op->content.num, ascii);
+      memmove(pos, end, &d->bytes[d->num_bytes] - end + 1);
+      d->num_bytes -= end - pos;
+      d->num_chars -= op->content.num;
+    }
+    return 0;
+  }
+  
+  // Copy the document into the spare buffer with the op's changes, then swap the buffers over.
+  // That way the document is only moved once no matter how many edits the op makes.
+  size_t max_bytes = d->num_bytes + 1;
+  for (size_t i = 0; i < op->num_components; i++) {
+    if (op->components[i].type == TEXT_OP_INSERT) {
+      max_bytes += str_num_bytes(&op->components[i].str);
+    }
+  }
+  if (max_bytes > d->spare_capacity) {
+    d->spare_capacity = MAX(max_bytes, d->capacity);
+    free(d->spare);
+    d->spare = malloc(d->spare_capacity);
+  }
+  
+  uint8_t *src = d->bytes;
+  uint8_t *dest = d->spare;
+  size_t num_chars = d->num_chars;
+  for (size_t i = 0; i < op->num_components; i++) {
+    const text_op_component *c = &op->components[i];
+    switch (c->type) {
+      case TEXT_OP_SKIP: {
+        uint8_t *end = skip_chars(src, c->num, ascii);
+        memcpy(dest, src, end - src);
+        dest += end - src;
+        src = end;
+        break;
+      }
+      case TEXT_OP_INSERT:
+        memcpy(dest, str_content(&c->str), str_num_bytes(&c->str));
+        dest += str_num_bytes(&c->str);
+        num_chars += str_num_chars(&c->str);
+        break;
+      case TEXT_OP_DELETE:
+        src = skip_chars(src, c->num, ascii);
+        num_chars -= c->num;
+        break;
+      default: break;
+    }
+  }
+  // The rest of the document (and the \0).
+  size_t rest = &d->bytes[d->num_bytes] - src + 1;
+  memcpy(dest, src, rest);
+  
+  uint8_t *bytes = d->bytes;
+  size_t capacity = d->capacity;
+  d->bytes = d->spare;
+  d->capacity = d->spare_capacity;
+  d->spare = bytes;
+  d->spare_capacity = capacity;
+  d->num_bytes = dest + rest - 1 - d->bytes;
+  d->num_chars = num_chars;
+  return 0;
+}
+
+const text_document_type TEXT_DOCUMENT_FLAT = {
+  "flat", flat_create, flat_free, flat_char_count, flat_apply, flat_create_cstr
+};
+
+
+// ***** Gap buffer
+
+typedef struct {
+  text_document doc;
+  
+  // The document is bytes[0..gap_start] followed by bytes[gap_end..capacity]. bytes[capacity] is
+  // always \0, so the content after the gap is \0 terminated.
+  uint8_t *bytes;
+  size_t capacity;
+  size_t gap_start;
+  size_t gap_end;
+  
+  // The number of characters before the gap, and in the whole document.
+  size_t gap_pos;
+  size_t num_chars;
+} gap_document;
+
+static inline size_t gap_num_bytes(const gap_document *d) {
+  return d->capacity - (d->gap_end - d->gap_start);
+}
+
+static text_document *gap_create(const uint8_t *content) {
+  gap_document *d = malloc(sizeof(gap_document));
+  d->doc.type = &TEXT_DOCUMENT_GAP;
+  size_t num_bytes = content ? strlen((char *)content) : 0;
+  d->num_chars = content ? strlen_utf8(content) : 0;
+  d->capacity = MAX(num_bytes * 2, 64);
+  d->bytes = malloc(d->capacity + 1);
+  d->bytes[d->capacity] = '\0';
+  
+  // Start with the gap at the end of the document.
+  if (content) {
+    memcpy(d->bytes, content, num_bytes);
+  }
+  d->gap_start = num_bytes;
+  d->gap_end = d->capacity;
+  d->gap_pos = d->num_chars;
+  return &d->doc;
+}
+
+static void gap_free(text_document *doc) {
+  gap_document *d = (gap_document *)doc;
+  free(d->bytes);
+  free(d);
+}
+
+static size_t gap_char_count(const text_document *doc) {
+  return ((const gap_document *)doc)->num_chars;
+}
+
+static uint8_t *gap_create_cstr(const text_document *doc) {
+  const gap_document *d = (const gap_document *)doc;
+  size_t after = d->capacity - d->gap_end;
+  uint8_t *result = malloc(d->gap_start + after + 1);
+  memcpy(result, d->bytes, d->gap_start);
+  memcpy(&result[d->gap_start], &d->bytes[d->gap_end], after + 1);
+  return result;
+}
+
+// Move the gap to character position pos.
+static void gap_move(gap_document *d, size_t pos) {
+  bool ascii = gap_num_bytes(d) == d->num_chars;
+  if (pos > d->gap_pos) {
+    uint8_t *after = &d->bytes[d->gap_end];
+    size_t len = skip_chars(after, pos - d->gap_pos, ascii) - after;
+    memmove(&d->bytes[d->gap_start], after, len);
+    d->gap_start += len;
+    d->gap_end += len;
+  } else if (pos < d->gap_pos) {
+    size_t len;
+    if (ascii) {
+      len = d->gap_pos - pos;
+    } else {
+      // Walk backwards, counting the first byte of each character.
+      const uint8_t *p = &d->bytes[d->gap_start];
+      for (size_t n = d->gap_pos - pos; n; p--) {
+        if ((p[-1] & 0xc0) != 0x80) {
+          n--;
+        }
+      }
+      len = &d->bytes[d->gap_start] - p;
+    }
+    d->gap_start -= len;
+    d->gap_end -= len;
+    memmove(&d->bytes[d->gap_end], &d->bytes[d->gap_start], len);
+  }
+  d->gap_pos = pos;
+}
+
+static void gap_insert(gap_document *d, const str *s) {
+  size_t num_bytes = str_num_bytes(s);
+  if (d->gap_end - d->gap_start < num_bytes) {
+    // Grow the buffer, and move the content after the gap to the new end.
+    size_t after = d->capacity - d->gap_end;
+    size_t capacity = MAX(d->capacity * 2, gap_num_bytes(d) + num_bytes);
+    d->bytes = realloc(d->bytes, capacity + 1);
+    memmove(&d->bytes[capacity - after], &d->bytes[d->gap_end], after + 1);
+    d->capacity = capacity;
+    d->gap_end = capacity - after;
+  }
+  memcpy(&d->bytes[d->gap_start], str_content(s), num_bytes);
+  d->gap_start += num_bytes;
+  d->gap_pos += str_num_chars(s);
+  d->num_chars += str_num_chars(s);
+}
+
+static void gap_delete(gap_document *d, size_t num) {
+  bool ascii = gap_num_bytes(d) == d->num_chars;
+  uint8_t *after = &d->bytes[d->gap_end];
+  d->gap_end = skip_chars(after, num, ascii) - d->bytes;
+  d->num_chars -= num;
+}
+
+static int gap_apply(text_document *doc, const text_op *op) {
+  gap_document *d = (gap_document *)doc;
+  text_op_component local[2];
+  const text_op_component *components;
+  size_t num = text_op_components(op, local, &components);
+  
+  size_t pos = 0;
+  for (size_t i = 0; i < num; i++) {
+    const text_op_component *c = &components[i];
+    switch (c->type) {
+      case TEXT_OP_SKIP:
+        pos += c->num;
+        break;
+      case TEXT_OP_INSERT:
+        gap_move(d, pos);
+        gap_insert(d, &c->str);
+        pos += str_num_chars(&c->str);
+        break;
+      case TEXT_OP_DELETE:
+        gap_move(d, pos);
+        gap_delete(d, c->num);
+        break;
+      default: break;
+    }
+  }
+  return 0;
+}
+
+const text_document_type TEXT_DOCUMENT_GAP = {
+  "gap", gap_create, gap_free, gap_char_count, gap_apply, gap_create_cstr
+};
@@ -0,0 +1,70 @@
+// Documents that ops can be applied to.
+//
+// text_op_apply works on librope's rope, which is great for big documents. Most documents are
+// small though, and a few KB of text is faster to edit in one flat piece of memory. A
+// text_document is any of these backends behind a common interface:
+//
+// - TEXT_DOCUMENT_ROPE:  A rope. Edits are O(log n), so use this for big documents.
+// - TEXT_DOCUMENT_FLAT:  One flat array. Every op is applied in a single pass over the document.
+// - TEXT_DOCUMENT_GAP:   A gap buffer. Fast when edits are clustered together, like when typing.
+//
+// Other backends can be added by filling in a text_document_type. Each backend's document struct
+// starts with a text_document.
+
+#ifndef OT_document_h
+#define OT_document_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "text.h"
+
+typedef struct text_document_type text_document_type;
+
+typedef struct {
+  const text_document_type *type;
+} text_document;
+
+struct text_document_type {
+  const char *name;
+
+  // Create a document with the specified content. content can be NULL.
+  text_document *(*create)(const uint8_t *content);
+  void (*free)(text_document *doc);
+
+  // The length of the document in characters.
+  size_t (*char_count)(const text_document *doc);
+
+  // Apply the op, which has already been checked against the document. Returns 0 on success.
+  int (*apply)(text_document *doc, const text_op *op);
+
+  // Copy out the document's content as a \0 terminated string. The caller frees the result.
+  uint8_t *(*create_cstr)(const text_document *doc);
+};
+
+extern const text_document_type TEXT_DOCUMENT_ROPE;
+extern const text_document_type TEXT_DOCUMENT_FLAT;
+extern const text_document_type TEXT_DOCUMENT_GAP;
+
+// Create a new document of the specified type. content can be NULL.
+text_document *text_document_new(const text_document_type *type, const uint8_t *content);
+
+void text_document_free(text_document *doc);
+
+static inline size_t text_document_char_count(const text_document *doc) {
+  return doc->type->char_count(doc);
+}
+
+// Copy out the document's content. Free the result when you're done with it.
+static inline uint8_t *text_document_create_cstr(const text_document *doc) {
+  return doc->type->create_cstr(doc);
+}
+
+// Apply an op to the document, like text_op_apply. If the op can't be applied the document is left
+// unchanged. Returns 0 on success, nonzero on failure.
+int text_document_apply(text_document *doc, const text_op *op);
+
+// Check if an op could be applied to the document. Returns 0 on success, nonzero on failure.
+int text_document_check(const text_document *doc, const text_op *op);
+
+#endif
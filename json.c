@@ -0,0 +1,874 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "json.h"
+#include "varint.h"
+
+// **** Values
+
+static json_value *new_value(text_op_arena *arena, json_type type) {
+  json_value *v = text_op_arena_alloc(arena, sizeof(json_value));
+  memset(v, 0, sizeof(json_value));
+  v->type = type;
+  return v;
+}
+
+json_value *json_new_null(text_op_arena *arena) {
+  return new_value(arena, JSON_NULL);
+}
+
+json_value *json_new_bool(text_op_arena *arena, bool value) {
+  json_value *v = new_value(arena, JSON_BOOL);
+  v->boolean = value;
+  return v;
+}
+
+json_value *json_new_number(text_op_arena *arena, double value) {
+  json_value *v = new_value(arena, JSON_NUMBER);
+  v->number = value;
+  return v;
+}
+
+static json_value *new_string(text_op_arena *arena, const uint8_t *s, size_t num_bytes,
+    size_t num_chars) {
+  json_value *v = new_value(arena, JSON_STRING);
+  str_init3_arena(&v->string, s, num_bytes, num_chars, arena);
+  return v;
+}
+
+json_value *json_new_string(text_op_arena *arena, const uint8_t *value) {
+  return new_string(arena, value, strlen((const char *)value), strlen_utf8(value));
+}
+
+json_value *json_new_array(text_op_arena *arena) {
+  return new_value(arena, JSON_ARRAY);
+}
+
+json_value *json_new_object(text_op_arena *arena) {
+  return new_value(arena, JSON_OBJECT);
+}
+
+// Make room for one more item in an arena allocated array.
+static void *grow(text_op_arena *arena, void *items, size_t num, size_t *capacity, size_t size) {
+  if (num < *capacity) return items;
+  size_t new_capacity = *capacity ? *capacity * 2 : 4;
+  items = text_op_arena_realloc(arena, items, *capacity * size, new_capacity * size);
+  *capacity = new_capacity;
+  return items;
+}
+
+static void array_insert(text_op_arena *arena, json_value *array, size_t index,
+    json_value *item) {
+  array->items = grow(arena, array->items, array->num_items, &array->items_capacity,
+      sizeof(json_value *));
+  memmove(&array->items[index + 1], &array->items[index],
+      sizeof(json_value *) * (array->num_items - index));
+  array->items[index] = item;
+  array->num_items++;
+}
+
+static json_value *array_remove(json_value *array, size_t index) {
+  json_value *item = array->items[index];
+  array->num_items--;
+  memmove(&array->items[index], &array->items[index + 1],
+      sizeof(json_value *) * (array->num_items - index));
+  return item;
+}
+
+void json_array_append(text_op_arena *arena, json_value *array, json_value *item) {
+  array_insert(arena, array, array->num_items, item);
+}
+
+// Returns the index of the key in the object, or -1 if it isn't there.
+static ssize_t find_key(const json_value *object, const uint8_t *key, size_t key_len) {
+  for (size_t i = 0; i < object->num_members; i++) {
+    const json_member *m = &object->members[i];
+    if (m->key_len == key_len && memcmp(m->key, key, key_len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static uint8_t *copy_key(text_op_arena *arena, const uint8_t *key, size_t key_len) {
+  uint8_t *copy = text_op_arena_alloc(arena, key_len + 1);
+  memcpy(copy, key, key_len);
+  copy[key_len] = '\0';
+  return copy;
+}
+
+static void object_insert(text_op_arena *arena, json_value *object, size_t index,
+    json_member member) {
+  object->members = grow(arena, object->members, object->num_members,
+      &object->members_capacity, sizeof(json_member));
+  memmove(&object->members[index + 1], &object->members[index],
+      sizeof(json_member) * (object->num_members - index));
+  object->members[index] = member;
+  object->num_members++;
+}
+
+static json_member object_remove(json_value *object, size_t index) {
+  json_member member = object->members[index];
+  object->num_members--;
+  memmove(&object->members[index], &object->members[index + 1],
+      sizeof(json_member) * (object->num_members - index));
+  return member;
+}
+
+// Set key to value, returning the value it replaces (or NULL).
+static json_value *object_set(text_op_arena *arena, json_value *object, const uint8_t *key,
+    size_t key_len, json_value *value) {
+  ssize_t i = find_key(object, key, key_len);
+  if (i >= 0) {
+    json_value *old = object->members[i].value;
+    object->members[i].value = value;
+    return old;
+  } else {
+    json_member m = {copy_key(arena, key, key_len), key_len, value};
+    object_insert(arena, object, object->num_members, m);
+    return NULL;
+  }
+}
+
+void json_object_set(text_op_arena *arena, json_value *object, const uint8_t *key,
+    json_value *value) {
+  object_set(arena, object, key, strlen((const char *)key), value);
+}
+
+json_value *json_object_get(const json_value *object, const uint8_t *key) {
+  ssize_t i = find_key(object, key, strlen((const char *)key));
+  return i >= 0 ? object->members[i].value : NULL;
+}
+
+json_value *json_value_copy(text_op_arena *arena, const json_value *value) {
+  json_value *v = new_value(arena, value->type);
+  switch (value->type) {
+    case JSON_NULL:
+      break;
+    case JSON_BOOL:
+      v->boolean = value->boolean;
+      break;
+    case JSON_NUMBER:
+      v->number = value->number;
+      break;
+    case JSON_STRING:
+      str_init_with_copy_arena(&v->string, &value->string, arena);
+      break;
+    case JSON_ARRAY:
+      if (value->num_items) {
+        v->items = text_op_arena_alloc(arena, sizeof(json_value *) * value->num_items);
+        v->num_items = v->items_capacity = value->num_items;
+        for (size_t i = 0; i < value->num_items; i++) {
+          v->items[i] = json_value_copy(arena, value->items[i]);
+        }
+      }
+      break;
+    case JSON_OBJECT:
+      if (value->num_members) {
+        v->members = text_op_arena_alloc(arena, sizeof(json_member) * value->num_members);
+        v->num_members = v->members_capacity = value->num_members;
+        for (size_t i = 0; i < value->num_members; i++) {
+          const json_member *m = &value->members[i];
+          v->members[i] = (json_member){copy_key(arena, m->key, m->key_len), m->key_len,
+              json_value_copy(arena, m->value)};
+        }
+      }
+      break;
+  }
+  return v;
+}
+
+bool json_value_equal(const json_value *a, const json_value *b) {
+  if (a->type != b->type) return false;
+  switch (a->type) {
+    case JSON_NULL:
+      return true;
+    case JSON_BOOL:
+      return a->boolean == b->boolean;
+    case JSON_NUMBER:
+      return a->number == b->number;
+    case JSON_STRING:
+      return str_num_bytes(&a->string) == str_num_bytes(&b->string)
+          && memcmp(str_content(&a->string), str_content(&b->string),
+              str_num_bytes(&a->string)) == 0;
+    case JSON_ARRAY:
+      if (a->num_items != b->num_items) return false;
+      for (size_t i = 0; i < a->num_items; i++) {
+        if (!json_value_equal(a->items[i], b->items[i])) return false;
+      }
+      return true;
+    case JSON_OBJECT:
+      // Key order doesn't matter.
+      if (a->num_members != b->num_members) return false;
+      for (size_t i = 0; i < a->num_members; i++) {
+        const json_member *m = &a->members[i];
+        ssize_t j = find_key(b, m->key, m->key_len);
+        if (j < 0 || !json_value_equal(m->value, b->members[j].value)) return false;
+      }
+      return true;
+  }
+  return false;
+}
+
+// **** Ops
+
+static bool elem_equal(const json_path_elem *a, const json_path_elem *b) {
+  if (a->key == NULL || b->key == NULL) {
+    return a->key == b->key && a->index == b->index;
+  }
+  return a->key_len == b->key_len && memcmp(a->key, b->key, a->key_len) == 0;
+}
+
+static bool path_equal(const json_path_elem *a, size_t a_len, const json_path_elem *b,
+    size_t b_len) {
+  if (a_len != b_len) return false;
+  for (size_t i = 0; i < a_len; i++) {
+    if (!elem_equal(&a[i], &b[i])) return false;
+  }
+  return true;
+}
+
+static json_path_elem *copy_path(text_op_arena *arena, const json_path_elem *path,
+    size_t path_len) {
+  json_path_elem *copy = text_op_arena_alloc(arena, sizeof(json_path_elem) * (path_len + 1));
+  for (size_t i = 0; i < path_len; i++) {
+    copy[i] = path[i];
+    if (path[i].key) {
+      copy[i].key = copy_key(arena, path[i].key, path[i].key_len);
+    }
+  }
+  return copy;
+}
+
+// Copy a component into the arena. The path, value and text op all end up owned by the arena.
+static json_op_component copy_component(const json_op_component *c, text_op_arena *arena) {
+  json_op_component copy = *c;
+  copy.path = copy_path(arena, c->path, c->path_len);
+  if (c->type == JSON_OP_LIST_INSERT || c->type == JSON_OP_OBJECT_INSERT) {
+    copy.value = json_value_copy(arena, c->value);
+  } else if (c->type == JSON_OP_TEXT) {
+    text_op_clone_arena(&copy.text, (text_op *)&c->text, arena);
+  }
+  return copy;
+}
+
+static void append(json_op *op, const json_op_component *c) {
+  op->components = grow(&op->arena, op->components, op->num_components, &op->capacity,
+      sizeof(json_op_component));
+  op->components[op->num_components++] = copy_component(c, &op->arena);
+}
+
+void json_op_init(json_op *op) {
+  op->components = NULL;
+  op->num_components = op->capacity = 0;
+  text_op_arena_init(&op->arena, 0);
+}
+
+void json_op_free(json_op *op) {
+  // Everything lives in the arena.
+  text_op_arena_destroy(&op->arena);
+  op->components = NULL;
+  op->num_components = op->capacity = 0;
+}
+
+static void append_new(json_op *op, json_op_component_type type, const json_path_elem *path,
+    size_t path_len) {
+  json_op_component c = {type, (json_path_elem *)path, path_len};
+  append(op, &c);
+}
+
+void json_op_list_insert(json_op *op, const json_path_elem *path, size_t path_len,
+    const json_value *value) {
+  json_op_component c = {JSON_OP_LIST_INSERT, (json_path_elem *)path, path_len};
+  c.value = (json_value *)value;
+  append(op, &c);
+}
+
+void json_op_list_delete(json_op *op, const json_path_elem *path, size_t path_len) {
+  append_new(op, JSON_OP_LIST_DELETE, path, path_len);
+}
+
+void json_op_object_insert(json_op *op, const json_path_elem *path, size_t path_len,
+    const json_value *value) {
+  json_op_component c = {JSON_OP_OBJECT_INSERT, (json_path_elem *)path, path_len};
+  c.value = (json_value *)value;
+  append(op, &c);
+}
+
+void json_op_object_delete(json_op *op, const json_path_elem *path, size_t path_len) {
+  append_new(op, JSON_OP_OBJECT_DELETE, path, path_len);
+}
+
+void json_op_number_add(json_op *op, const json_path_elem *path, size_t path_len, double amount) {
+  json_op_component c = {JSON_OP_NUMBER_ADD, (json_path_elem *)path, path_len};
+  c.amount = amount;
+  append(op, &c);
+}
+
+void json_op_text(json_op *op, const json_path_elem *path, size_t path_len, text_op *edit) {
+  json_op_component c = {JSON_OP_TEXT, (json_path_elem *)path, path_len};
+  c.text = *edit;
+  append(op, &c);
+}
+
+void json_op_clone2(json_op *dest, const json_op *src) {
+  json_op_init(dest);
+  for (size_t i = 0; i < src->num_components; i++) {
+    append(dest, &src->components[i]);
+  }
+}
+
+// **** Transform
+
+static bool is_structural(json_op_component_type type) {
+  return type != JSON_OP_NUMBER_ADD && type != JSON_OP_TEXT;
+}
+
+// Transform component c (in place) by other, which was applied to the same document. The arena
+// holds anything c needs to allocate. Returns false if c doesn't make sense anymore and should be
+// dropped.
+static bool transform_component(json_op_component *c, const json_op_component *other,
+    bool isLefthand, text_op_arena *arena) {
+  if (other->type == JSON_OP_TEXT) {
+    if (c->type == JSON_OP_TEXT && path_equal(c->path, c->path_len, other->path, other->path_len)) {
+      text_op result;
+      text_op_transform_arena(&result, &c->text, (text_op *)&other->text, isLefthand, arena);
+      c->text = result;
+    }
+    return true;
+  } else if (!is_structural(other->type)) {
+    return true;
+  }
+  
+  // other inserts or removes the value at the end of its path. That only matters to c if c's path
+  // goes through the same container.
+  size_t k = other->path_len - 1;
+  if (c->path_len < other->path_len || !path_equal(c->path, k, other->path, k)) {
+    return true;
+  }
+  
+  json_path_elem *elem = &c->path[k];
+  const json_path_elem *other_elem = &other->path[k];
+  // c is a sibling of other, rather than an edit inside the value other touches.
+  bool sibling = c->path_len == other->path_len;
+  
+  switch (other->type) {
+    case JSON_OP_LIST_INSERT:
+      if (elem->key == NULL && other_elem->key == NULL) {
+        if (elem->index > other_elem->index || (elem->index == other_elem->index
+            && (!sibling || c->type != JSON_OP_LIST_INSERT || !isLefthand))) {
+          elem->index++;
+        }
+      }
+      return true;
+    case JSON_OP_LIST_DELETE:
+      if (elem->key == NULL && other_elem->key == NULL) {
+        if (elem->index > other_elem->index) {
+          elem->index--;
+        } else if (elem->index == other_elem->index) {
+          // Inserting where the item was still makes sense. Anything else touched the deleted item.
+          return sibling && c->type == JSON_OP_LIST_INSERT;
+        }
+      }
+      return true;
+    case JSON_OP_OBJECT_INSERT:
+      if (elem_equal(elem, other_elem)) {
+        // Edits to the value other replaced are lost. If both ops set the key, the left op wins.
+        return sibling && c->type == JSON_OP_OBJECT_INSERT && isLefthand;
+      }
+      return true;
+    case JSON_OP_OBJECT_DELETE:
+      if (elem_equal(elem, other_elem)) {
+        return sibling && c->type == JSON_OP_OBJECT_INSERT;
+      }
+      return true;
+    default:
+      return true;
+  }
+}
+
+void json_op_transform2(json_op *result, const json_op *op, const json_op *other,
+    bool isLefthand) {
+  json_op_init(result);
+  if (other->num_components == 0) {
+    json_op_clone2(result, op);
+    return;
+  }
+  
+  // Each component of op is moved past other, and other is moved past it in turn so it's ready
+  // for the next component. The intermediate copies of other live in a scratch arena.
+  text_op_arena scratch;
+  text_op_arena_init(&scratch, 0);
+  size_t num_others = other->num_components;
+  json_op_component *others = text_op_arena_alloc(&scratch,
+      sizeof(json_op_component) * num_others);
+  for (size_t i = 0; i < num_others; i++) {
+    others[i] = other->components[i];
+    others[i].path = copy_path(&scratch, other->components[i].path, other->components[i].path_len);
+  }
+  
+  for (size_t i = 0; i < op->num_components; i++) {
+    json_op_component c = copy_component(&op->components[i], &result->arena);
+    bool keep = true;
+    size_t n = 0;
+    for (size_t j = 0; j < num_others; j++) {
+      if (keep) {
+        // Transforming edits the path in place, so c needs to see other's old path.
+        json_op_component o = others[j];
+        o.path = copy_path(&scratch, o.path, o.path_len);
+        bool keep_other = transform_component(&others[j], &c, !isLefthand, &scratch);
+        keep = transform_component(&c, &o, isLefthand, &result->arena);
+        if (!keep_other) continue;
+      }
+      others[n++] = others[j];
+    }
+    num_others = n;
+    
+    if (keep) {
+      result->components = grow(&result->arena, result->components, result->num_components,
+          &result->capacity, sizeof(json_op_component));
+      result->components[result->num_components++] = c;
+    }
+  }
+  text_op_arena_destroy(&scratch);
+}
+
+// **** Compose
+
+void json_op_compose2(json_op *result, const json_op *op1, const json_op *op2) {
+  json_op_clone2(result, op1);
+  for (size_t i = 0; i < op2->num_components; i++) {
+    const json_op_component *c = &op2->components[i];
+    json_op_component *last = result->num_components
+        ? &result->components[result->num_components - 1] : NULL;
+    
+    // Edits to the same number or string one after another can be merged together.
+    if (last && last->type == c->type
+        && (c->type == JSON_OP_NUMBER_ADD || c->type == JSON_OP_TEXT)
+        && path_equal(last->path, last->path_len, c->path, c->path_len)) {
+      if (c->type == JSON_OP_NUMBER_ADD) {
+        last->amount += c->amount;
+      } else {
+        text_op composed;
+        text_op_compose_arena(&composed, &last->text, (text_op *)&c->text, &result->arena);
+        last->text = composed;
+      }
+    } else {
+      append(result, c);
+    }
+  }
+}
+
+// **** Apply
+
+// Each change made to the document is logged so it can be undone if a later component fails.
+typedef struct {
+  json_op_component_type type;
+  json_value *container;
+  size_t index;
+  // The value or member which was removed or replaced.
+  json_value *old_value;
+  json_member old_member;
+  double old_number;
+  str old_string;
+} undo_entry;
+
+typedef struct {
+  undo_entry *entries;
+  size_t num, capacity;
+} undo_log;
+
+static undo_entry *log_entry(undo_log *log, json_op_component_type type, json_value *container,
+    size_t index) {
+  if (log->num == log->capacity) {
+    log->capacity = log->capacity ? log->capacity * 2 : 8;
+    log->entries = realloc(log->entries, sizeof(undo_entry) * log->capacity);
+  }
+  undo_entry *e = &log->entries[log->num++];
+  memset(e, 0, sizeof(undo_entry));
+  e->type = type;
+  e->container = container;
+  e->index = index;
+  return e;
+}
+
+static void rollback(json_doc *doc, undo_log *log) {
+  for (size_t i = log->num; i-- > 0;) {
+    undo_entry *e = &log->entries[i];
+    switch (e->type) {
+      case JSON_OP_LIST_INSERT:
+        array_remove(e->container, e->index);
+        break;
+      case JSON_OP_LIST_DELETE:
+        array_insert(&doc->arena, e->container, e->index, e->old_value);
+        break;
+      case JSON_OP_OBJECT_INSERT:
+        if (e->old_value) {
+          e->container->members[e->index].value = e->old_value;
+        } else {
+          object_remove(e->container, e->index);
+        }
+        break;
+      case JSON_OP_OBJECT_DELETE:
+        object_insert(&doc->arena, e->container, e->index, e->old_member);
+        break;
+      case JSON_OP_NUMBER_ADD:
+        e->container->number = e->old_number;
+        break;
+      case JSON_OP_TEXT:
+        e->container->string = e->old_string;
+        break;
+    }
+  }
+}
+
+// Walk down the first path_len elements of the path. Returns NULL if the path isn't in the
+// document.
+static json_value *resolve(json_value *v, const json_path_elem *path, size_t path_len) {
+  for (size_t i = 0; i < path_len && v; i++) {
+    if (path[i].key) {
+      if (v->type != JSON_OBJECT) return NULL;
+      ssize_t j = find_key(v, path[i].key, path[i].key_len);
+      v = j >= 0 ? v->members[j].value : NULL;
+    } else {
+      if (v->type != JSON_ARRAY || path[i].index >= v->num_items) return NULL;
+      v = v->items[path[i].index];
+    }
+  }
+  return v;
+}
+
+static int apply_component(json_doc *doc, const json_op_component *c, undo_log *log) {
+  if (c->type == JSON_OP_NUMBER_ADD || c->type == JSON_OP_TEXT) {
+    json_value *v = resolve(doc->root, c->path, c->path_len);
+    if (c->type == JSON_OP_NUMBER_ADD) {
+      if (v == NULL || v->type != JSON_NUMBER) return 1;
+      log_entry(log, c->type, v, 0)->old_number = v->number;
+      v->number += c->amount;
+    } else {
+      if (v == NULL || v->type != JSON_STRING) return 1;
+      str result;
+      if (text_op_apply_str(&result, &v->string, &c->text, &doc->arena)) return 1;
+      log_entry(log, c->type, v, 0)->old_string = v->string;
+      v->string = result;
+    }
+    return 0;
+  }
+  
+  if (c->path_len == 0) return 1;
+  json_value *parent = resolve(doc->root, c->path, c->path_len - 1);
+  const json_path_elem *last = &c->path[c->path_len - 1];
+  if (parent == NULL) return 1;
+  
+  if (c->type == JSON_OP_LIST_INSERT || c->type == JSON_OP_LIST_DELETE) {
+    if (last->key || parent->type != JSON_ARRAY) return 1;
+    if (c->type == JSON_OP_LIST_INSERT) {
+      if (last->index > parent->num_items) return 1;
+      array_insert(&doc->arena, parent, last->index, json_value_copy(&doc->arena, c->value));
+      log_entry(log, c->type, parent, last->index);
+    } else {
+      if (last->index >= parent->num_items) return 1;
+      log_entry(log, c->type, parent, last->index)->old_value = array_remove(parent, last->index);
+    }
+  } else {
+    if (last->key == NULL || parent->type != JSON_OBJECT) return 1;
+    ssize_t i = find_key(parent, last->key, last->key_len);
+    if (c->type == JSON_OP_OBJECT_INSERT) {
+      json_value *value = json_value_copy(&doc->arena, c->value);
+      json_value *old = object_set(&doc->arena, parent, last->key, last->key_len, value);
+      log_entry(log, c->type, parent, i >= 0 ? i : parent->num_members - 1)->old_value = old;
+    } else {
+      if (i < 0) return 1;
+      log_entry(log, c->type, parent, i)->old_member = object_remove(parent, i);
+    }
+  }
+  return 0;
+}
+
+// How far past twice its compacted size the arena can grow before json_op_apply compacts it, so
+// small documents aren't copied over and over.
+#define JSON_DOC_COMPACT_SLACK (64 * 1024)
+
+int json_op_apply(json_doc *doc, const json_op *op) {
+  undo_log log = {NULL, 0, 0};
+  int result = 0;
+  for (size_t i = 0; i < op->num_components; i++) {
+    if (apply_component(doc, &op->components[i], &log)) {
+      rollback(doc, &log);
+      result = 1;
+      break;
+    }
+  }
+  free(log.entries);
+  
+  // Every text edit copies the whole string, so the arena fills up with old versions of strings
+  // being typed into. Only compact once the op is done - rollback needs the old values.
+  if (doc->arena.size > 2 * doc->compacted_size + JSON_DOC_COMPACT_SLACK) {
+    json_doc_compact(doc);
+  }
+  return result;
+}
+
+json_doc *json_doc_new(const json_value *root) {
+  json_doc *doc = malloc(sizeof(json_doc));
+  text_op_arena_init(&doc->arena, 0);
+  doc->root = root ? json_value_copy(&doc->arena, root) : json_new_object(&doc->arena);
+  doc->compacted_size = doc->arena.size;
+  return doc;
+}
+
+void json_doc_free(json_doc *doc) {
+  text_op_arena_destroy(&doc->arena);
+  free(doc);
+}
+
+void json_doc_compact(json_doc *doc) {
+  text_op_arena arena;
+  text_op_arena_init(&arena, 0);
+  doc->root = json_value_copy(&arena, doc->root);
+  text_op_arena_destroy(&doc->arena);
+  doc->arena = arena;
+  doc->compacted_size = arena.size;
+}
+
+// **** Encoding
+//
+// Ops are written as:
+// - A varint holding the number of components, then for each component:
+//   - 1 byte for the type
+//   - A varint path length, then each path element: a varint holding index << 1 for list
+//     indexes, or key_len << 1 | 1 followed by the key's bytes
+//   - Inserts are followed by their value, number adds by an 8 byte double and text edits by a
+//     v2 encoded text op.
+// Values are 1 byte for the type, then nothing (null), 1 byte (bool), 8 bytes (number), a varint
+// length and the bytes (string), a varint count then the items (array) or a varint count then
+// each key (length and bytes) followed by its value (object).
+
+// Nesting deeper than this is rejected when reading, so malicious input can't blow the stack.
+#define MAX_DEPTH 256
+
+static void write_varint(uint64_t value, text_write_fn write, void *user) {
+  uint8_t buf[VARINT_MAX_BYTES];
+  write(buf, varint_write(buf, value), user);
+}
+
+static void write_bytes(const uint8_t *bytes, size_t num, text_write_fn write, void *user) {
+  write_varint(num, write, user);
+  if (num) write((void *)bytes, num, user);
+}
+
+static void write_value(const json_value *v, text_write_fn write, void *user) {
+  uint8_t type = v->type;
+  write(&type, 1, user);
+  switch (v->type) {
+    case JSON_NULL:
+      break;
+    case JSON_BOOL: {
+      uint8_t b = v->boolean;
+      write(&b, 1, user);
+      break;
+    }
+    case JSON_NUMBER:
+      write((void *)&v->number, sizeof(double), user);
+      break;
+    case JSON_STRING:
+      write_bytes(str_content(&v->string), str_num_bytes(&v->string), write, user);
+      break;
+    case JSON_ARRAY:
+      write_varint(v->num_items, write, user);
+      for (size_t i = 0; i < v->num_items; i++) {
+        write_value(v->items[i], write, user);
+      }
+      break;
+    case JSON_OBJECT:
+      write_varint(v->num_members, write, user);
+      for (size_t i = 0; i < v->num_members; i++) {
+        write_bytes(v->members[i].key, v->members[i].key_len, write, user);
+        write_value(v->members[i].value, write, user);
+      }
+      break;
+  }
+}
+
+void json_op_to_bytes(const json_op *op, text_write_fn write, void *user) {
+  write_varint(op->num_components, write, user);
+  for (size_t i = 0; i < op->num_components; i++) {
+    const json_op_component *c = &op->components[i];
+    uint8_t type = c->type;
+    write(&type, 1, user);
+    write_varint(c->path_len, write, user);
+    for (size_t j = 0; j < c->path_len; j++) {
+      if (c->path[j].key) {
+        write_varint((uint64_t)c->path[j].key_len << 1 | 1, write, user);
+        write((void *)c->path[j].key, c->path[j].key_len, user);
+      } else {
+        write_varint((uint64_t)c->path[j].index << 1, write, user);
+      }
+    }
+    
+    switch (c->type) {
+      case JSON_OP_LIST_INSERT:
+      case JSON_OP_OBJECT_INSERT:
+        write_value(c->value, write, user);
+        break;
+      case JSON_OP_NUMBER_ADD:
+        write((void *)&c->amount, sizeof(double), user);
+        break;
+      case JSON_OP_TEXT:
+        text_op_to_bytes_v2((text_op *)&c->text, write, user);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+typedef struct {
+  const uint8_t *p, *end;
+  text_op_arena *arena;
+} reader;
+
+static bool read_varint(reader *r, uint64_t *out) {
+  size_t n = varint_read(r->p, r->end, out);
+  r->p += n;
+  return n != 0;
+}
+
+static bool read_size(reader *r, size_t *out) {
+  uint64_t value;
+  if (!read_varint(r, &value) || value > SIZE_MAX) return false;
+  *out = (size_t)value;
+  return true;
+}
+
+// Read a length prefixed run of bytes. The result points into the buffer.
+static const uint8_t *read_bytes(reader *r, size_t *num) {
+  if (!read_size(r, num) || *num > (size_t)(r->end - r->p)) return NULL;
+  const uint8_t *bytes = r->p;
+  r->p += *num;
+  return bytes;
+}
+
+static bool read_fixed(reader *r, void *out, size_t num) {
+  if ((size_t)(r->end - r->p) < num) return false;
+  memcpy(out, r->p, num);
+  r->p += num;
+  return true;
+}
+
+static json_value *read_value(reader *r, int depth) {
+  uint8_t type;
+  if (depth > MAX_DEPTH || !read_fixed(r, &type, 1)) return NULL;
+  
+  switch (type) {
+    case JSON_NULL:
+      return json_new_null(r->arena);
+    case JSON_BOOL: {
+      uint8_t b;
+      if (!read_fixed(r, &b, 1) || b > 1) return NULL;
+      return json_new_bool(r->arena, b);
+    }
+    case JSON_NUMBER: {
+      double number;
+      if (!read_fixed(r, &number, sizeof(double))) return NULL;
+      return json_new_number(r->arena, number);
+    }
+    case JSON_STRING: {
+      // Checked the same way as v2 text inserts, since the string can be edited by text ops.
+      size_t num_bytes;
+      const uint8_t *bytes = read_bytes(r, &num_bytes);
+      ssize_t num_chars = bytes ? utf8_validate(bytes, num_bytes) : -1;
+      return num_chars >= 0 ? new_string(r->arena, bytes, num_bytes, num_chars) : NULL;
+    }
+    case JSON_ARRAY: {
+      size_t num;
+      // Every item takes at least a byte, which bounds how much we'll allocate.
+      if (!read_size(r, &num) || num > (size_t)(r->end - r->p)) return NULL;
+      json_value *v = json_new_array(r->arena);
+      if (num) {
+        v->items = text_op_arena_alloc(r->arena, sizeof(json_value *) * num);
+        v->items_capacity = num;
+      }
+      for (size_t i = 0; i < num; i++) {
+        json_value *item = read_value(r, depth + 1);
+        if (item == NULL) return NULL;
+        v->items[v->num_items++] = item;
+      }
+      return v;
+    }
+    case JSON_OBJECT: {
+      size_t num;
+      if (!read_size(r, &num) || num > (size_t)(r->end - r->p)) return NULL;
+      json_value *v = json_new_object(r->arena);
+      for (size_t i = 0; i < num; i++) {
+        size_t key_len;
+        const uint8_t *key = read_bytes(r, &key_len);
+        if (key == NULL || utf8_validate(key, key_len) < 0) return NULL;
+        json_value *value = read_value(r, depth + 1);
+        if (value == NULL || object_set(r->arena, v, key, key_len, value)) return NULL;
+      }
+      return v;
+    }
+    default:
+      return NULL;
+  }
+}
+
+static bool read_component(reader *r, json_op_component *c) {
+  uint8_t type;
+  if (!read_fixed(r, &type, 1) || type < JSON_OP_LIST_INSERT || type > JSON_OP_TEXT) return false;
+  c->type = type;
+  
+  if (!read_size(r, &c->path_len) || c->path_len > (size_t)(r->end - r->p)) return false;
+  c->path = text_op_arena_alloc(r->arena, sizeof(json_path_elem) * (c->path_len + 1));
+  for (size_t i = 0; i < c->path_len; i++) {
+    uint64_t header;
+    if (!read_varint(r, &header)) return false;
+    if (header & 1) {
+      size_t key_len = (size_t)(header >> 1);
+      if (key_len > (size_t)(r->end - r->p)) return false;
+      c->path[i] = (json_path_elem){copy_key(r->arena, r->p, key_len), key_len, 0};
+      r->p += key_len;
+    } else {
+      c->path[i] = json_index((size_t)(header >> 1));
+    }
+  }
+  
+  switch (c->type) {
+    case JSON_OP_LIST_INSERT:
+    case JSON_OP_OBJECT_INSERT:
+      c->value = read_value(r, 0);
+      return c->value != NULL;
+    case JSON_OP_NUMBER_ADD:
+      return read_fixed(r, &c->amount, sizeof(double));
+    case JSON_OP_TEXT: {
+      ssize_t n = text_op_from_bytes_arena(&c->text, (void *)r->p, r->end - r->p, r->arena);
+      if (n < 0) return false;
+      r->p += n;
+      return true;
+    }
+    default:
+      return true;
+  }
+}
+
+ssize_t json_op_from_bytes(json_op *dest, const void *bytes, size_t num_bytes) {
+  json_op_init(dest);
+  reader r = {bytes, (const uint8_t *)bytes + num_bytes, &dest->arena};
+  size_t num;
+  if (!read_size(&r, &num) || num > num_bytes) goto fail;
+  
+  if (num) {
+    dest->components = text_op_arena_alloc(&dest->arena, sizeof(json_op_component) * num);
+    dest->capacity = num;
+  }
+  for (size_t i = 0; i < num; i++) {
+    if (!read_component(&r, &dest->components[i])) goto fail;
+    dest->num_components++;
+  }
+  return r.p - (const uint8_t *)bytes;
+
+fail:
+  json_op_free(dest);
+  return -1;
+}
@@ -0,0 +1,195 @@
+/*
+ * The JSON type. This mirrors json0 from ottypes: ops are lists of components, and each component
+ * edits the value at the end of its path:
+ *
+ * JSON_OP_LIST_INSERT:    Insert a value into a list. The path ends at the new item's index.
+ * JSON_OP_LIST_DELETE:    Remove the item at the end of the path from its list.
+ * JSON_OP_OBJECT_INSERT:  Set a key in an object, replacing its old value if it has one.
+ * JSON_OP_OBJECT_DELETE:  Remove a key from an object.
+ * JSON_OP_NUMBER_ADD:     Add to a number.
+ * JSON_OP_TEXT:           Edit a string with a text op (see text.h).
+ *
+ * Eg: [{["title"], TEXT, [5, {INSERT, 'hi'}]}, {["tags", 0], LIST_INSERT, "new"}]
+ *
+ * Values (both in documents and in ops) are trees allocated out of an arena. Each op owns an arena
+ * holding its paths, values and text ops, which is freed all at once by json_op_free.
+ */
+
+#ifndef OT_json_h
+#define OT_json_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "text.h"
+#include "arena.h"
+
+typedef enum {
+  JSON_NULL,
+  JSON_BOOL,
+  JSON_NUMBER,
+  JSON_STRING,
+  JSON_ARRAY,
+  JSON_OBJECT,
+} json_type;
+
+typedef struct json_value json_value;
+
+typedef struct {
+  uint8_t *key;
+  size_t key_len;
+  json_value *value;
+} json_member;
+
+struct json_value {
+  json_type type;
+  union {
+    bool boolean;
+    double number;
+    str string;
+    struct {
+      json_value **items;
+      size_t num_items;
+      size_t items_capacity;
+    };
+    struct {
+      json_member *members;
+      size_t num_members;
+      size_t members_capacity;
+    };
+  };
+};
+
+// Make values in the arena. Strings and keys are copied.
+json_value *json_new_null(text_op_arena *arena);
+json_value *json_new_bool(text_op_arena *arena, bool value);
+json_value *json_new_number(text_op_arena *arena, double value);
+json_value *json_new_string(text_op_arena *arena, const uint8_t *value);
+json_value *json_new_array(text_op_arena *arena);
+json_value *json_new_object(text_op_arena *arena);
+
+void json_array_append(text_op_arena *arena, json_value *array, json_value *item);
+// Set a key in the object, replacing any value it already had.
+void json_object_set(text_op_arena *arena, json_value *object, const uint8_t *key,
+    json_value *value);
+// Returns NULL if the key isn't there.
+json_value *json_object_get(const json_value *object, const uint8_t *key);
+
+// Make a deep copy of a value in the arena.
+json_value *json_value_copy(text_op_arena *arena, const json_value *value);
+bool json_value_equal(const json_value *a, const json_value *b);
+
+// One step along a path: an object key, or a list index if key is NULL. Keys don't need to be \0
+// terminated.
+typedef struct {
+  const uint8_t *key;
+  size_t key_len;
+  size_t index;
+} json_path_elem;
+
+static inline json_path_elem json_key(const char *key) {
+  return (json_path_elem){(const uint8_t *)key, strlen(key), 0};
+}
+
+static inline json_path_elem json_index(size_t index) {
+  return (json_path_elem){NULL, 0, index};
+}
+
+typedef enum {
+  JSON_OP_LIST_INSERT = 1,
+  JSON_OP_LIST_DELETE = 2,
+  JSON_OP_OBJECT_INSERT = 3,
+  JSON_OP_OBJECT_DELETE = 4,
+  JSON_OP_NUMBER_ADD = 5,
+  JSON_OP_TEXT = 6,
+} json_op_component_type;
+
+typedef struct {
+  json_op_component_type type;
+  json_path_elem *path;
+  size_t path_len;
+  union {
+    // If type is LIST_INSERT or OBJECT_INSERT
+    json_value *value;
+    // If type is NUMBER_ADD
+    double amount;
+    // If type is TEXT
+    text_op text;
+  };
+} json_op_component;
+
+typedef struct {
+  json_op_component *components;
+  size_t num_components;
+  size_t capacity;
+  text_op_arena arena;
+} json_op;
+
+// A document being edited. Values replaced or removed by ops (including the old version of every
+// edited string) stay in the arena until the document is compacted. json_op_apply compacts the
+// document itself once the arena has grown to twice its size after the last compaction.
+typedef struct {
+  json_value *root;
+  text_op_arena arena;
+  // The arena's size right after the document was last compacted (or created).
+  size_t compacted_size;
+} json_doc;
+
+// Make an empty op. Fill it in using the functions below, which copy their arguments into the op.
+void json_op_init(json_op *op);
+void json_op_free(json_op *op);
+
+void json_op_list_insert(json_op *op, const json_path_elem *path, size_t path_len,
+    const json_value *value);
+void json_op_list_delete(json_op *op, const json_path_elem *path, size_t path_len);
+void json_op_object_insert(json_op *op, const json_path_elem *path, size_t path_len,
+    const json_value *value);
+void json_op_object_delete(json_op *op, const json_path_elem *path, size_t path_len);
+void json_op_number_add(json_op *op, const json_path_elem *path, size_t path_len, double amount);
+void json_op_text(json_op *op, const json_path_elem *path, size_t path_len, text_op *edit);
+
+void json_op_clone2(json_op *dest, const json_op *src);
+
+// Transform an op by another op. isLefthand breaks ties when both ops insert into the same place
+// in a list or set the same key.
+void json_op_transform2(json_op *result, const json_op *op, const json_op *other,
+    bool isLefthand);
+
+// Compose 2 ops together. Applying the result has the same effect as applying op1 then op2.
+void json_op_compose2(json_op *result, const json_op *op1, const json_op *op2);
+
+// Write the op out in a compact binary encoding. Text edits use the v2 text encoding.
+void json_op_to_bytes(const json_op *op, text_write_fn write, void *user);
+
+// Returns bytes read on success, negative on failure.
+ssize_t json_op_from_bytes(json_op *dest, const void *bytes, size_t num_bytes);
+
+// Make a new document holding a copy of root (which can be NULL for an empty object).
+json_doc *json_doc_new(const json_value *root);
+void json_doc_free(json_doc *doc);
+
+// Copy the document into a fresh arena, dropping values which aren't in it anymore. Pointers into
+// the document are invalidated.
+void json_doc_compact(json_doc *doc);
+
+// Apply an op to the document. The op is checked as it goes - if it doesn't fit the document,
+// the document is left unchanged. returns 0 on success, nonzero on failure. This might compact the
+// document, so don't hold onto pointers into it across calls.
+int json_op_apply(json_doc *doc, const json_op *op);
+
+static inline json_op json_op_transform(const json_op *op, const json_op *other, bool isLefthand) {
+  json_op result;
+  json_op_transform2(&result, op, other, isLefthand);
+  return result;
+}
+
+static inline json_op json_op_compose(const json_op *op1, const json_op *op2) {
+  json_op result;
+  json_op_compose2(&result, op1, op2);
+  return result;
+}
+
+#endif
@@ -0,0 +1,550 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "rich.h"
+
+// Most ops are only a few components long, so they start with a small block.
+#define OP_BLOCK_SIZE 512
+
+// Attribute sets up to this size are merged on the stack.
+#define MAX_LOCAL_ATTRS 16
+
+static const rich_attrs NO_ATTRS = {NULL, 0};
+
+// **** Attributes
+
+static int attr_cmp(const void *a, const void *b) {
+  return strcmp((const char *)((const rich_attr *)a)->key, (const char *)((const rich_attr *)b)->key);
+}
+
+static bool value_equal(const uint8_t *a, const uint8_t *b) {
+  return a == b || (a && b && strcmp((const char *)a, (const char *)b) == 0);
+}
+
+bool rich_attrs_equal(const rich_attrs *a, const rich_attrs *b) {
+  if (a->num_attrs != b->num_attrs) return false;
+  for (size_t i = 0; i < a->num_attrs; i++) {
+    if (strcmp((const char *)a->attrs[i].key, (const char *)b->attrs[i].key) != 0
+        || !value_equal(a->attrs[i].value, b->attrs[i].value)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static const uint8_t *copy_cstr(text_op_arena *arena, const uint8_t *s) {
+  size_t len = strlen((const char *)s) + 1;
+  uint8_t *copy = text_op_arena_alloc(arena, len);
+  memcpy(copy, s, len);
+  return copy;
+}
+
+// Copy a set of attributes into the arena, sorting them if they came from outside.
+static rich_attrs copy_attrs(text_op_arena *arena, const rich_attr *attrs, size_t num, bool sort) {
+  if (num == 0) return NO_ATTRS;
+  rich_attr *copy = text_op_arena_alloc(arena, sizeof(rich_attr) * num);
+  for (size_t i = 0; i < num; i++) {
+    copy[i].key = copy_cstr(arena, attrs[i].key);
+    copy[i].value = attrs[i].value ? copy_cstr(arena, attrs[i].value) : NULL;
+  }
+  if (sort) {
+    qsort(copy, num, sizeof(rich_attr), attr_cmp);
+  }
+  return (rich_attrs){copy, num};
+}
+
+// Combine two sets of attribute changes. Where both set an attribute, b wins. If remove_nulls is
+// set, attributes which end up removed are left out rather than kept as removals. out needs room
+// for both sets. Returns the number of attributes written.
+static size_t compose_attrs(const rich_attrs *a, const rich_attrs *b, bool remove_nulls,
+    rich_attr *out) {
+  size_t i = 0, j = 0, n = 0;
+  while (i < a->num_attrs || j < b->num_attrs) {
+    int cmp = i == a->num_attrs ? 1 : j == b->num_attrs ? -1
+        : strcmp((const char *)a->attrs[i].key, (const char *)b->attrs[j].key);
+    rich_attr attr = cmp < 0 ? a->attrs[i] : b->attrs[j];
+    if (cmp <= 0) i++;
+    if (cmp >= 0) j++;
+    if (attr.value || !remove_nulls) {
+      out[n++] = attr;
+    }
+  }
+  return n;
+}
+
+// Drop the changes in a which b makes too. Returns the number of attributes written to out.
+static size_t transform_attrs(const rich_attrs *a, const rich_attrs *b, rich_attr *out) {
+  size_t j = 0, n = 0;
+  for (size_t i = 0; i < a->num_attrs; i++) {
+    int cmp = 1;
+    while (j < b->num_attrs
+        && (cmp = strcmp((const char *)b->attrs[j].key, (const char *)a->attrs[i].key)) < 0) {
+      j++;
+    }
+    if (j == b->num_attrs || cmp != 0) {
+      out[n++] = a->attrs[i];
+    }
+  }
+  return n;
+}
+
+// Scratch space for merging attributes, on the stack when it fits.
+typedef struct {
+  rich_attr local[MAX_LOCAL_ATTRS];
+  rich_attr *attrs;
+} attr_buf;
+
+static rich_attr *attr_buf_init(attr_buf *buf, size_t capacity) {
+  buf->attrs = capacity <= MAX_LOCAL_ATTRS ? buf->local : malloc(sizeof(rich_attr) * capacity);
+  return buf->attrs;
+}
+
+static void attr_buf_free(attr_buf *buf) {
+  if (buf->attrs != buf->local) {
+    free(buf->attrs);
+  }
+}
+
+// **** Ops
+
+static size_t component_length(const rich_op_component *c) {
+  return c->type == TEXT_OP_INSERT ? str_num_chars(&c->str) : c->num;
+}
+
+// Append a component to the op, merging it into the last one if they match. Its string and
+// attributes are copied into the op's arena, so c can point into another op.
+static void append(rich_op *op, const rich_op_component *c) {
+  if (component_length(c) == 0) return;
+  const rich_attrs *attrs = c->type == TEXT_OP_DELETE ? &NO_ATTRS : &c->attrs;
+  
+  if (op->num_components) {
+    rich_op_component *last = &op->components[op->num_components - 1];
+    if (last->type == c->type && rich_attrs_equal(&last->attrs, attrs)) {
+      if (c->type == TEXT_OP_INSERT) {
+        str_append_arena(&last->str, &c->str, &op->arena);
+      } else {
+        last->num += c->num;
+      }
+      return;
+    }
+  }
+  
+  if (op->num_components == op->capacity) {
+    size_t capacity = op->capacity ? op->capacity * 2 : 4;
+    op->components = text_op_arena_realloc(&op->arena, op->components,
+        sizeof(rich_op_component) * op->capacity, sizeof(rich_op_component) * capacity);
+    op->capacity = capacity;
+  }
+  rich_op_component *copy = &op->components[op->num_components++];
+  copy->type = c->type;
+  if (c->type == TEXT_OP_INSERT) {
+    str_init_with_copy_arena(&copy->str, &c->str, &op->arena);
+  } else {
+    copy->num = c->num;
+  }
+  copy->attrs = copy_attrs(&op->arena, attrs->attrs, attrs->num_attrs, false);
+}
+
+// Trailing skips which don't change any attributes do nothing.
+static void trim(rich_op *op) {
+  while (op->num_components) {
+    rich_op_component *last = &op->components[op->num_components - 1];
+    if (last->type != TEXT_OP_SKIP || last->attrs.num_attrs) break;
+    op->num_components--;
+  }
+}
+
+void rich_op_init(rich_op *op) {
+  op->components = NULL;
+  op->num_components = op->capacity = 0;
+  text_op_arena_init(&op->arena, OP_BLOCK_SIZE);
+}
+
+void rich_op_free(rich_op *op) {
+  text_op_arena_destroy(&op->arena);
+  op->components = NULL;
+  op->num_components = op->capacity = 0;
+}
+
+static void append_new(rich_op *op, rich_op_component *c, const rich_attrs *attrs) {
+  c->attrs = attrs ? copy_attrs(&op->arena, attrs->attrs, attrs->num_attrs, true) : NO_ATTRS;
+  append(op, c);
+}
+
+void rich_op_skip(rich_op *op, size_t num, const rich_attrs *attrs) {
+  rich_op_component c = {TEXT_OP_SKIP};
+  c.num = num;
+  append_new(op, &c, attrs);
+}
+
+void rich_op_insert(rich_op *op, const uint8_t *s, const rich_attrs *attrs) {
+  rich_op_component c = {TEXT_OP_INSERT};
+  str_init_view(&c.str, s, strlen((const char *)s), strlen_utf8(s));
+  append_new(op, &c, attrs);
+}
+
+void rich_op_delete(rich_op *op, size_t num) {
+  rich_op_component c = {TEXT_OP_DELETE};
+  c.num = num;
+  append(op, &c);
+}
+
+void rich_op_text(const rich_op *op, text_op *dest) {
+  text_op_builder builder;
+  text_op_builder_init(&builder, op->num_components);
+  for (size_t i = 0; i < op->num_components; i++) {
+    const rich_op_component *c = &op->components[i];
+    switch (c->type) {
+      case TEXT_OP_SKIP:
+        text_op_builder_skip(&builder, c->num);
+        break;
+      case TEXT_OP_INSERT: {
+        str s;
+        str_init_with_copy(&s, &c->str);
+        text_op_builder_insert(&builder, &s);
+        break;
+      }
+      case TEXT_OP_DELETE:
+        text_op_builder_delete(&builder, c->num);
+        break;
+      default:
+        break;
+    }
+  }
+  text_op_builder_finish(&builder, dest);
+}
+
+// Walks through an op's components, taking them apart as needed. Past the end of the op there's
+// an endless skip.
+typedef struct {
+  const rich_op *op;
+  size_t idx;
+  // How far into the current component we are, in characters and (for inserts) bytes.
+  size_t offset;
+  size_t byte_offset;
+} op_iter;
+
+static const rich_op_component *peek(const op_iter *iter) {
+  return iter->idx < iter->op->num_components ? &iter->op->components[iter->idx] : NULL;
+}
+
+static size_t remaining(const op_iter *iter) {
+  const rich_op_component *c = peek(iter);
+  return c ? component_length(c) - iter->offset : SIZE_MAX;
+}
+
+// Take up to max_len characters from the current component. Inserts which get cut up are sliced
+// out of the original string.
+static rich_op_component take(op_iter *iter, size_t max_len) {
+  const rich_op_component *c = peek(iter);
+  if (c == NULL) {
+    rich_op_component skip = {TEXT_OP_SKIP};
+    skip.num = max_len;
+    return skip;
+  }
+  
+  rich_op_component part = *c;
+  size_t len = component_length(c);
+  size_t n = len - iter->offset < max_len ? len - iter->offset : max_len;
+  if (c->type == TEXT_OP_INSERT) {
+    if (n < len) {
+      const uint8_t *start = str_content(&c->str) + iter->byte_offset;
+      size_t num_bytes = str_num_bytes(&c->str) == len ? n
+          : (size_t)(count_utf8_chars(start, n) - start);
+      str_init_slice(&part.str, &c->str, iter->byte_offset, num_bytes, n);
+      iter->byte_offset += num_bytes;
+    }
+  } else {
+    part.num = n;
+  }
+  
+  iter->offset += n;
+  if (iter->offset == len) {
+    iter->idx++;
+    iter->offset = iter->byte_offset = 0;
+  }
+  return part;
+}
+
+void rich_op_transform2(rich_op *result, const rich_op *op, const rich_op *other,
+    bool isLefthand) {
+  rich_op_init(result);
+  op_iter a = {op}, b = {other};
+  
+  while (a.idx < op->num_components) {
+    const rich_op_component *c = peek(&a), *o = peek(&b);
+    if (c->type == TEXT_OP_INSERT && (isLefthand || o == NULL || o->type != TEXT_OP_INSERT)) {
+      // Inserts are always taken whole here.
+      append(result, c);
+      a.idx++;
+    } else if (o && o->type == TEXT_OP_INSERT) {
+      rich_op_component skip = {TEXT_OP_SKIP};
+      skip.num = component_length(o);
+      append(result, &skip);
+      b.idx++;
+    } else {
+      size_t n = remaining(&a) < remaining(&b) ? remaining(&a) : remaining(&b);
+      rich_op_component part = take(&a, n);
+      take(&b, n);
+      if (o && o->type == TEXT_OP_DELETE) {
+        // The other op already deleted these characters.
+        continue;
+      }
+      if (part.type == TEXT_OP_SKIP && !isLefthand && part.attrs.num_attrs && o
+          && o->attrs.num_attrs) {
+        // Both ops format the same text. The left op's attributes win.
+        attr_buf buf;
+        rich_attr *attrs = attr_buf_init(&buf, part.attrs.num_attrs);
+        part.attrs.num_attrs = transform_attrs(&part.attrs, &o->attrs, attrs);
+        part.attrs.attrs = attrs;
+        append(result, &part);
+        attr_buf_free(&buf);
+      } else {
+        append(result, &part);
+      }
+    }
+  }
+  trim(result);
+}
+
+void rich_op_compose2(rich_op *result, const rich_op *op1, const rich_op *op2) {
+  rich_op_init(result);
+  op_iter a = {op1}, b = {op2};
+  
+  while (a.idx < op1->num_components || b.idx < op2->num_components) {
+    const rich_op_component *x = peek(&a), *y = peek(&b);
+    if (y && y->type == TEXT_OP_INSERT) {
+      rich_op_component part = take(&b, SIZE_MAX);
+      append(result, &part);
+    } else if (x && (x->type == TEXT_OP_DELETE || y == NULL)) {
+      rich_op_component part = take(&a, SIZE_MAX);
+      append(result, &part);
+    } else {
+      size_t n = remaining(&a) < remaining(&b) ? remaining(&a) : remaining(&b);
+      rich_op_component p1 = take(&a, n), p2 = take(&b, n);
+      if (p2.type == TEXT_OP_DELETE) {
+        // Deleting something op1 inserted cancels out.
+        if (p1.type == TEXT_OP_SKIP) {
+          append(result, &p2);
+        }
+      } else if (p2.attrs.num_attrs) {
+        // Formatting applied on top of op1's. Text op1 inserts just gets the final attributes.
+        attr_buf buf;
+        rich_attr *attrs = attr_buf_init(&buf, p1.attrs.num_attrs + p2.attrs.num_attrs);
+        p1.attrs.num_attrs = compose_attrs(&p1.attrs, &p2.attrs, p1.type == TEXT_OP_INSERT, attrs);
+        p1.attrs.attrs = attrs;
+        append(result, &p1);
+        attr_buf_free(&buf);
+      } else {
+        append(result, &p1);
+      }
+    }
+  }
+  trim(result);
+}
+
+// **** Documents
+
+static uint64_t hash_cstr(uint64_t h, const uint8_t *s) {
+  for (; *s; s++) {
+    h = (h ^ *s) * 0x100000001b3ull;
+  }
+  return (h ^ 0xff) * 0x100000001b3ull;
+}
+
+// FNV-1a over the keys and values. Removals (NULL values) hash differently from empty strings.
+static uint64_t attrs_hash(const rich_attr *attrs, size_t num) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < num; i++) {
+    h = hash_cstr(h, attrs[i].key);
+    h = attrs[i].value ? hash_cstr(h, attrs[i].value) : (h ^ 0xfe) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+// Find the slot in the formats table holding attrs, or the empty slot it would go in.
+static const rich_attrs **find_format(const rich_attrs **formats, size_t capacity,
+    const rich_attrs *attrs) {
+  size_t mask = capacity - 1;
+  for (size_t i = attrs_hash(attrs->attrs, attrs->num_attrs) & mask; ; i = (i + 1) & mask) {
+    if (formats[i] == NULL || rich_attrs_equal(formats[i], attrs)) {
+      return &formats[i];
+    }
+  }
+}
+
+// Find the stored copy of a set of attributes, adding it if this is the first time its been seen.
+static const rich_attrs *intern(rich_doc *doc, const rich_attr *attrs, size_t num) {
+  // Keep the table at most 3/4 full.
+  if ((doc->num_formats + 1) * 4 > doc->formats_capacity * 3) {
+    size_t capacity = doc->formats_capacity ? doc->formats_capacity * 2 : 16;
+    const rich_attrs **formats = calloc(capacity, sizeof(rich_attrs *));
+    for (size_t i = 0; i < doc->formats_capacity; i++) {
+      if (doc->formats[i]) {
+        *find_format(formats, capacity, doc->formats[i]) = doc->formats[i];
+      }
+    }
+    free(doc->formats);
+    doc->formats = formats;
+    doc->formats_capacity = capacity;
+  }
+  
+  rich_attrs key = {attrs, num};
+  const rich_attrs **slot = find_format(doc->formats, doc->formats_capacity, &key);
+  if (*slot == NULL) {
+    rich_attrs *format = text_op_arena_alloc(&doc->arena, sizeof(rich_attrs));
+    *format = copy_attrs(&doc->arena, attrs, num, false);
+    *slot = format;
+    doc->num_formats++;
+  }
+  return *slot;
+}
+
+typedef struct {
+  rich_span *spans;
+  size_t num_spans;
+  size_t capacity;
+} span_list;
+
+static void push_span(span_list *list, size_t num, const rich_attrs *attrs) {
+  if (num == 0) return;
+  if (list->num_spans && list->spans[list->num_spans - 1].attrs == attrs) {
+    list->spans[list->num_spans - 1].num += num;
+    return;
+  }
+  if (list->num_spans == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 8;
+    list->spans = realloc(list->spans, sizeof(rich_span) * list->capacity);
+  }
+  list->spans[list->num_spans++] = (rich_span){num, attrs};
+}
+
+rich_doc *rich_doc_new(const uint8_t *content) {
+  rich_doc *doc = malloc(sizeof(rich_doc));
+  doc->text = content ? rope_new_with_utf8(content) : rope_new();
+  doc->spans = NULL;
+  doc->num_spans = doc->spans_capacity = 0;
+  doc->formats = NULL;
+  doc->num_formats = doc->formats_capacity = 0;
+  text_op_arena_init(&doc->arena, 0);
+  
+  span_list list = {NULL, 0, 0};
+  push_span(&list, rope_char_count(doc->text), intern(doc, NULL, 0));
+  doc->spans = list.spans;
+  doc->num_spans = list.num_spans;
+  doc->spans_capacity = list.capacity;
+  return doc;
+}
+
+void rich_doc_compact(rich_doc *doc) {
+  // Intern every span's attributes again into a fresh arena and table, then drop the old ones.
+  text_op_arena old_arena = doc->arena;
+  const rich_attrs **old_formats = doc->formats;
+  text_op_arena_init(&doc->arena, 0);
+  doc->formats = NULL;
+  doc->num_formats = doc->formats_capacity = 0;
+  for (size_t i = 0; i < doc->num_spans; i++) {
+    const rich_attrs *attrs = doc->spans[i].attrs;
+    doc->spans[i].attrs = intern(doc, attrs->attrs, attrs->num_attrs);
+  }
+  free(old_formats);
+  text_op_arena_destroy(&old_arena);
+}
+
+void rich_doc_free(rich_doc *doc) {
+  rope_free(doc->text);
+  free(doc->spans);
+  free(doc->formats);
+  text_op_arena_destroy(&doc->arena);
+  free(doc);
+}
+
+const rich_attrs *rich_doc_attrs_at(const rich_doc *doc, size_t pos) {
+  for (size_t i = 0; i < doc->num_spans; i++) {
+    if (pos < doc->spans[i].num) {
+      return doc->spans[i].attrs;
+    }
+    pos -= doc->spans[i].num;
+  }
+  return NULL;
+}
+
+int rich_op_check(const rich_doc *doc, const rich_op *op) {
+  // Count down rather than adding lengths up, which could wrap around.
+  size_t remaining = rope_char_count(doc->text);
+  for (size_t i = 0; i < op->num_components; i++) {
+    const rich_op_component *c = &op->components[i];
+    if (c->type != TEXT_OP_INSERT) {
+      if (c->num > remaining) {
+        return 1;
+      }
+      remaining -= c->num;
+    }
+  }
+  return 0;
+}
+
+int rich_op_apply(rich_doc *doc, const rich_op *op) {
+  if (rich_op_check(doc, op)) {
+    return 1;
+  }
+  
+  text_op text;
+  rich_op_text(op, &text);
+  int result = text_op_apply(doc->text, &text);
+  text_op_free(&text);
+  if (result) {
+    return result;
+  }
+  
+  // Rebuild the spans in one pass. idx and offset track where we are in the old spans.
+  span_list list = {NULL, 0, 0};
+  size_t idx = 0, offset = 0;
+  for (size_t i = 0; i < op->num_components; i++) {
+    const rich_op_component *c = &op->components[i];
+    if (c->type == TEXT_OP_INSERT) {
+      attr_buf buf;
+      rich_attr *attrs = attr_buf_init(&buf, c->attrs.num_attrs);
+      size_t num = compose_attrs(&NO_ATTRS, &c->attrs, true, attrs);
+      push_span(&list, str_num_chars(&c->str), intern(doc, attrs, num));
+      attr_buf_free(&buf);
+      continue;
+    }
+    
+    for (size_t n = c->num; n > 0 && idx < doc->num_spans;) {
+      const rich_span *span = &doc->spans[idx];
+      size_t len = span->num - offset < n ? span->num - offset : n;
+      if (c->type == TEXT_OP_SKIP && c->attrs.num_attrs) {
+        attr_buf buf;
+        rich_attr *attrs = attr_buf_init(&buf, span->attrs->num_attrs + c->attrs.num_attrs);
+        size_t num = compose_attrs(span->attrs, &c->attrs, true, attrs);
+        push_span(&list, len, intern(doc, attrs, num));
+        attr_buf_free(&buf);
+      } else if (c->type == TEXT_OP_SKIP) {
+        push_span(&list, len, span->attrs);
+      }
+      n -= len;
+      offset += len;
+      if (offset == span->num) {
+        idx++;
+        offset = 0;
+      }
+    }
+  }
+  for (; idx < doc->num_spans; idx++) {
+    push_span(&list, doc->spans[idx].num - offset, doc->spans[idx].attrs);
+    offset = 0;
+  }
+  
+  free(doc->spans);
+  doc->spans = list.spans;
+  doc->num_spans = list.num_spans;
+  doc->spans_capacity = list.capacity;
+  
+  // Each span uses one format, so most formats are garbage once there are a lot more of them
+  // than spans. Compacting then keeps the table and arena in proportion to the document.
+  if (doc->num_formats > 2 * doc->num_spans + 16) {
+    rich_doc_compact(doc);
+  }
+  return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * Rich text. Ops work like text ops (see text.h) - they skip over, insert and delete characters -
+ * but inserts carry formatting attributes, and skips can change the attributes of the text they
+ * pass over:
+ *
+ * {SKIP, N, attrs}:    Skip N characters, setting attrs on them (attrs is usually empty)
+ * {INSERT, 'str', attrs}: Insert 'str' formatted with attrs
+ * {DELETE, N}:         Delete N characters
+ *
+ * Eg: [3, {SKIP, 5, bold=true}, {INSERT, 'hi', link=example.com}, {DELETE, 2}]
+ *
+ * Attributes belong to whole components, so making a paragraph bold is one span rather than a
+ * change to every character. In a skip, an attribute with a NULL value removes the attribute.
+ *
+ * Like json ops, each rich op owns an arena holding its components, strings and attributes.
+ */
+
+#ifndef OT_rich_h
+#define OT_rich_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "text.h"
+#include "arena.h"
+#include "rope.h"
+
+// Keys and values are \0 terminated strings.
+typedef struct {
+  const uint8_t *key;
+  const uint8_t *value;
+} rich_attr;
+
+typedef struct {
+  const rich_attr *attrs; // Sorted by key.
+  size_t num_attrs;
+} rich_attrs;
+
+typedef struct {
+  text_op_component_type type;
+  union {
+    // If type is SKIP or DELETE
+    size_t num;
+    // If type is INSERT
+    str str;
+  };
+  // Empty for deletes.
+  rich_attrs attrs;
+} rich_op_component;
+
+typedef struct {
+  rich_op_component *components;
+  size_t num_components;
+  size_t capacity;
+  text_op_arena arena;
+} rich_op;
+
+// A run of characters which all have the same attributes.
+typedef struct {
+  size_t num;
+  const rich_attrs *attrs;
+} rich_span;
+
+typedef struct {
+  rope *text;
+
+  // The formatting of the text, as runs in document order. Neighbouring spans always have
+  // different attributes.
+  rich_span *spans;
+  size_t num_spans;
+  size_t spans_capacity;
+
+  // Every distinct set of attributes in the document is stored once, so spans can be compared
+  // by pointer. These live in the arena, and are found through a hash table (open addressing,
+  // formats_capacity is a power of 2). Sets no span uses anymore are dropped by compacting.
+  const rich_attrs **formats;
+  size_t num_formats;
+  size_t formats_capacity;
+  text_op_arena arena;
+} rich_doc;
+
+bool rich_attrs_equal(const rich_attrs *a, const rich_attrs *b);
+
+// Make an empty op, then fill it in from start to end with the functions below. attrs can be
+// NULL, and doesn't need to be sorted. Everything is copied into the op.
+void rich_op_init(rich_op *op);
+void rich_op_free(rich_op *op);
+
+void rich_op_skip(rich_op *op, size_t num, const rich_attrs *attrs);
+void rich_op_insert(rich_op *op, const uint8_t *s, const rich_attrs *attrs);
+void rich_op_delete(rich_op *op, size_t num);
+
+// The op's edits to the plain text, with the formatting dropped.
+void rich_op_text(const rich_op *op, text_op *dest);
+
+// Transform an op by another op. Where both ops set the same attribute, the left op wins.
+void rich_op_transform2(rich_op *result, const rich_op *op, const rich_op *other,
+    bool isLefthand);
+
+// Compose 2 ops together. Applying the result has the same effect as applying op1 then op2.
+void rich_op_compose2(rich_op *result, const rich_op *op1, const rich_op *op2);
+
+// Make a new document. content can be NULL. It starts out with no formatting.
+rich_doc *rich_doc_new(const uint8_t *content);
+void rich_doc_free(rich_doc *doc);
+
+// Copy the formatting into a fresh arena, dropping attribute sets no span uses anymore. This
+// happens automatically as ops are applied, once the unused sets start to pile up.
+void rich_doc_compact(rich_doc *doc);
+
+// The attributes of the character at pos, or NULL if pos isn't in the document.
+const rich_attrs *rich_doc_attrs_at(const rich_doc *doc, size_t pos);
+
+// Check if an op could be applied to the document. Returns 0 on success, nonzero on failure.
+int rich_op_check(const rich_doc *doc, const rich_op *op);
+
+// Apply an op to the document's text and formatting. returns 0 on success, nonzero (leaving the
+// document alone) if the op doesn't fit the document.
+int rich_op_apply(rich_doc *doc, const rich_op *op);
+
+static inline rich_op rich_op_transform(const rich_op *op, const rich_op *other, bool isLefthand) {
+  rich_op result;
+  rich_op_transform2(&result, op, other, isLefthand);
+  return result;
+}
+
+static inline rich_op rich_op_compose(const rich_op *op1, const rich_op *op2) {
+  rich_op result;
+  rich_op_compose2(&result, op1, op2);
+  return result;
+}
+
+#endif
@@ -0,0 +1,399 @@
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+#include "utf8.h"
+
+#define MIN(x,y) ((x) > (y) ? (y) : (x))
+
+// The text is cut into chunks of up to this many bytes, which are kept in order in a treap (a
+// binary tree balanced by giving each node a random priority, which is higher than its
+// children's). Nodes never change once they're in a snapshot. Instead edits copy the nodes on the
+// path down to the chunks they change, and share everything else.
+#define CHUNK_MAX 512
+
+typedef struct node node;
+struct node {
+  size_t refcount;
+  uint32_t priority;
+  uint16_t chunk_bytes;
+  uint16_t chunk_chars;
+  node *left, *right;
+  // The length of the whole subtree rooted here.
+  size_t num_chars;
+  size_t num_bytes;
+  uint8_t chunk[]; // \0 terminated, so count_utf8_chars can scan it.
+};
+
+struct text_snapshot {
+  size_t refcount;
+  size_t version;
+  node *root; // NULL if the document is empty.
+};
+
+// Priorities only need to be well mixed. This runs a counter through the splitmix64 finalizer,
+// which is thread safe and makes the tree's shape the same every run.
+static uint32_t next_priority() {
+  static uint64_t counter = 0;
+  uint64_t x = __atomic_add_fetch(&counter, 0x9e3779b97f4a7c15ull, __ATOMIC_RELAXED);
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return (uint32_t)(x ^ (x >> 31));
+}
+
+static inline size_t chars_of(const node *n) {
+  return n ? n->num_chars : 0;
+}
+
+static inline size_t bytes_of(const node *n) {
+  return n ? n->num_bytes : 0;
+}
+
+static node *alloc_node(size_t chunk_bytes, size_t chunk_chars, uint32_t priority) {
+  node *n = malloc(sizeof(node) + chunk_bytes + 1);
+  n->refcount = 1;
+  n->priority = priority;
+  n->chunk_bytes = chunk_bytes;
+  n->chunk_chars = chunk_chars;
+  n->left = n->right = NULL;
+  n->num_chars = chunk_chars;
+  n->num_bytes = chunk_bytes;
+  n->chunk[chunk_bytes] = '\0';
+  return n;
+}
+
+static node *new_leaf(const uint8_t *bytes, size_t num_bytes, size_t num_chars) {
+  node *n = alloc_node(num_bytes, num_chars, next_priority());
+  memcpy(n->chunk, bytes, num_bytes);
+  return n;
+}
+
+static inline node *retain(node *n) {
+  if (n) {
+    __atomic_add_fetch(&n->refcount, 1, __ATOMIC_RELAXED);
+  }
+  return n;
+}
+
+static void release(node *n) {
+  while (n && __atomic_sub_fetch(&n->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    release(n->left);
+    node *right = n->right;
+    free(n);
+    n = right;
+  }
+}
+
+// A node nothing else refers to isn't in any snapshot yet, so it can be changed in place.
+static inline bool is_unique(const node *n) {
+  return __atomic_load_n(&n->refcount, __ATOMIC_ACQUIRE) == 1;
+}
+
+// Take a reference to one of n's children, ready to give n new children with set_children.
+static inline node *take_child(node *n, node **child) {
+  if (is_unique(n)) {
+    node *c = *child;
+    *child = NULL;
+    return c;
+  }
+  return retain(*child);
+}
+
+// Give n new children, copying it first if it's shared. Takes ownership of n, left and right.
+static node *set_children(node *n, node *left, node *right) {
+  if (is_unique(n)) {
+    release(n->left);
+    release(n->right);
+  } else {
+    node *copy = alloc_node(n->chunk_bytes, n->chunk_chars, n->priority);
+    memcpy(copy->chunk, n->chunk, n->chunk_bytes);
+    release(n);
+    n = copy;
+  }
+  n->left = left;
+  n->right = right;
+  n->num_chars = chars_of(left) + n->chunk_chars + chars_of(right);
+  n->num_bytes = bytes_of(left) + n->chunk_bytes + bytes_of(right);
+  return n;
+}
+
+// Where the character at offset starts in n's chunk.
+static inline size_t chunk_offset(const node *n, size_t offset) {
+  return n->chunk_bytes == n->chunk_chars ? offset : count_utf8_chars(n->chunk, offset) - n->chunk;
+}
+
+// Concatenate 2 trees. Takes ownership of both.
+static node *merge(node *a, node *b) {
+  if (a == NULL) {
+    return b;
+  } else if (b == NULL) {
+    return a;
+  } else if (a->priority > b->priority) {
+    node *left = take_child(a, &a->left), *right = take_child(a, &a->right);
+    return set_children(a, left, merge(right, b));
+  } else {
+    node *left = take_child(b, &b->left), *right = take_child(b, &b->right);
+    return set_children(b, merge(a, left), right);
+  }
+}
+
+// Split a tree into its first pos characters and the rest. Takes ownership of n.
+static void split(node *n, size_t pos, node **l, node **r) {
+  if (n == NULL || pos == 0) {
+    *l = NULL;
+    *r = n;
+    return;
+  } else if (pos >= n->num_chars) {
+    *l = n;
+    *r = NULL;
+    return;
+  }
+  
+  size_t left_chars = chars_of(n->left);
+  node *left = take_child(n, &n->left), *right = take_child(n, &n->right);
+  if (pos <= left_chars) {
+    split(left, pos, l, &left);
+    *r = set_children(n, left, right);
+  } else if (pos >= left_chars + n->chunk_chars) {
+    split(right, pos - left_chars - n->chunk_chars, &right, r);
+    *l = set_children(n, left, right);
+  } else {
+    // The split is in the middle of n's chunk, so it's cut in two.
+    size_t offset = pos - left_chars;
+    size_t bytes = chunk_offset(n, offset);
+    node *a = new_leaf(n->chunk, bytes, offset);
+    node *b = new_leaf(n->chunk + bytes, n->chunk_bytes - bytes, n->chunk_chars - offset);
+    release(n);
+    *l = merge(left, a);
+    *r = merge(b, right);
+  }
+}
+
+static const node *first_node(const node *n) {
+  while (n->left) {
+    n = n->left;
+  }
+  return n;
+}
+
+static const node *last_node(const node *n) {
+  while (n->right) {
+    n = n->right;
+  }
+  return n;
+}
+
+// Concatenate 2 trees like merge, but if the chunks either side of the join fit in one chunk
+// they're fused together. Otherwise every edit in the middle of a chunk would cut it up, and the
+// document would end up in smaller and smaller pieces.
+static node *join(node *a, node *b) {
+  if (a && b) {
+    const node *last = last_node(a), *first = first_node(b);
+    size_t last_chars = last->chunk_chars, first_chars = first->chunk_chars;
+    if (last->chunk_bytes + first->chunk_bytes <= CHUNK_MAX) {
+      node *fused = alloc_node(last->chunk_bytes + first->chunk_bytes, last_chars + first_chars,
+          next_priority());
+      memcpy(fused->chunk, last->chunk, last->chunk_bytes);
+      memcpy(fused->chunk + last->chunk_bytes, first->chunk, first->chunk_bytes);
+      
+      node *rest;
+      split(a, a->num_chars - last_chars, &a, &rest);
+      release(rest);
+      split(b, first_chars, &rest, &b);
+      release(rest);
+      return merge(merge(a, fused), b);
+    }
+  }
+  return merge(a, b);
+}
+
+// Make a tree holding the specified text.
+static node *build(const uint8_t *bytes, size_t num_bytes, size_t num_chars) {
+  node *result = NULL;
+  while (num_bytes > CHUNK_MAX) {
+    // Don't cut a character in half.
+    size_t len = CHUNK_MAX;
+    while ((bytes[len] & 0xc0) == 0x80) {
+      len--;
+    }
+    size_t chars = 0;
+    for (size_t i = 0; i < len; i++) {
+      chars += (bytes[i] & 0xc0) != 0x80;
+    }
+    result = merge(result, new_leaf(bytes, len, chars));
+    bytes += len;
+    num_bytes -= len;
+    num_chars -= chars;
+  }
+  if (num_bytes) {
+    result = merge(result, new_leaf(bytes, num_bytes, num_chars));
+  }
+  return result;
+}
+
+static text_snapshot *snapshot_new(node *root, size_t version) {
+  text_snapshot *s = malloc(sizeof(text_snapshot));
+  s->refcount = 1;
+  s->version = version;
+  s->root = root;
+  return s;
+}
+
+text_snapshot *text_snapshot_new(const uint8_t *content) {
+  node *root = content ? build(content, strlen((const char *)content), strlen_utf8(content)) : NULL;
+  return snapshot_new(root, 0);
+}
+
+text_snapshot *text_snapshot_retain(text_snapshot *s) {
+  __atomic_add_fetch(&s->refcount, 1, __ATOMIC_RELAXED);
+  return s;
+}
+
+void text_snapshot_release(text_snapshot *s) {
+  if (__atomic_sub_fetch(&s->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    release(s->root);
+    free(s);
+  }
+}
+
+size_t text_snapshot_char_count(const text_snapshot *s) {
+  return chars_of(s->root);
+}
+
+size_t text_snapshot_byte_count(const text_snapshot *s) {
+  return bytes_of(s->root);
+}
+
+size_t text_snapshot_version(const text_snapshot *s) {
+  return s->version;
+}
+
+text_snapshot *text_snapshot_apply(const text_snapshot *s, const text_op *op) {
+  if (text_op_check_length(chars_of(s->root), op)) {
+    return NULL;
+  }
+  
+  text_op_component local[2];
+  const text_op_component *components;
+  size_t n = text_op_components(op, local, &components);
+  
+  // Nodes made while applying the op aren't shared yet, so only the first edit in each part of
+  // the document needs to copy nodes.
+  node *root = retain(s->root);
+  size_t pos = 0;
+  for (size_t i = 0; i < n; i++) {
+    const text_op_component *c = &components[i];
+    node *l, *m, *r;
+    switch (c->type) {
+      case TEXT_OP_SKIP:
+        pos += c->num;
+        break;
+      case TEXT_OP_INSERT:
+        split(root, pos, &l, &r);
+        m = build(str_content(&c->str), str_num_bytes(&c->str), str_num_chars(&c->str));
+        root = join(join(l, m), r);
+        pos += str_num_chars(&c->str);
+        break;
+      case TEXT_OP_DELETE:
+        split(root, pos, &l, &r);
+        split(r, c->num, &m, &r);
+        release(m);
+        root = join(l, r);
+        break;
+      default:
+        break;
+    }
+  }
+  return snapshot_new(root, s->version + 1);
+}
+
+static uint8_t *write_node(const node *n, uint8_t *dest) {
+  while (n) {
+    dest = write_node(n->left, dest);
+    memcpy(dest, n->chunk, n->chunk_bytes);
+    dest += n->chunk_bytes;
+    n = n->right;
+  }
+  return dest;
+}
+
+size_t text_snapshot_write_cstr(const text_snapshot *s, uint8_t *dest) {
+  uint8_t *end = write_node(s->root, dest);
+  *end = '\0';
+  return end - dest + 1;
+}
+
+uint8_t *text_snapshot_create_cstr(const text_snapshot *s) {
+  uint8_t *dest = malloc(bytes_of(s->root) + 1);
+  text_snapshot_write_cstr(s, dest);
+  return dest;
+}
+
+// Read num characters from pos in n's subtree. The range must be inside the subtree.
+static void read_node(const node *n, size_t pos, size_t num, text_write_fn write, void *user) {
+  while (num > 0) {
+    size_t left_chars = chars_of(n->left);
+    if (pos < left_chars) {
+      size_t len = MIN(num, left_chars - pos);
+      read_node(n->left, pos, len, write, user);
+      pos += len;
+      num -= len;
+      if (num == 0) {
+        return;
+      }
+    }
+    
+    size_t offset = pos - left_chars;
+    if (offset < n->chunk_chars) {
+      size_t len = MIN(num, n->chunk_chars - offset);
+      size_t start = chunk_offset(n, offset);
+      write((void *)(n->chunk + start), chunk_offset(n, offset + len) - start, user);
+      offset += len;
+      num -= len;
+    }
+    
+    pos = offset - n->chunk_chars;
+    n = n->right;
+  }
+}
+
+void text_snapshot_read(const text_snapshot *s, size_t pos, size_t num, text_write_fn write,
+    void *user) {
+  size_t len = chars_of(s->root);
+  if (pos < len) {
+    read_node(s->root, pos, MIN(num, len - pos), write, user);
+  }
+}
+
+void text_snapshot_head_init(text_snapshot_head *head, const uint8_t *content) {
+  head->current = text_snapshot_new(content);
+  pthread_mutex_init(&head->lock, NULL);
+}
+
+void text_snapshot_head_destroy(text_snapshot_head *head) {
+  text_snapshot_release(head->current);
+  pthread_mutex_destroy(&head->lock);
+}
+
+text_snapshot *text_snapshot_head_get(text_snapshot_head *head) {
+  pthread_mutex_lock(&head->lock);
+  text_snapshot *s = text_snapshot_retain(head->current);
+  pthread_mutex_unlock(&head->lock);
+  return s;
+}
+
+int text_snapshot_head_apply(text_snapshot_head *head, const text_op *op) {
+  // Only the writer changes current, so it can be read without the lock.
+  text_snapshot *next = text_snapshot_apply(head->current, op);
+  if (next == NULL) {
+    return 1;
+  }
+  
+  pthread_mutex_lock(&head->lock);
+  text_snapshot *prev = head->current;
+  head->current = next;
+  pthread_mutex_unlock(&head->lock);
+  
+  // Freeing the old version's nodes can take a moment, so it's done outside the lock.
+  text_snapshot_release(prev);
+  return 0;
+}
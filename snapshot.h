@@ -0,0 +1,71 @@
+// Immutable snapshots of a text document.
+//
+// text_op_apply edits a rope in place, so nothing else can read the rope while an op is being
+// applied. A text_snapshot is a version of a document which never changes. Applying an op to a
+// snapshot makes a new snapshot, which shares all of the text the op didn't touch with the old
+// one. Only the O(log n) pieces of the document around each edit are copied.
+//
+// Snapshots are reference counted, and can be read and released from any thread. A
+// text_snapshot_head holds the latest version of a document: one thread applies ops to it while
+// any number of readers take snapshots of it, without waiting for each other.
+
+#ifndef OT_snapshot_h
+#define OT_snapshot_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "text.h"
+
+// Defined in snapshot.c.
+typedef struct text_snapshot text_snapshot;
+
+// Make a snapshot at version 0 with the specified content, which can be NULL.
+text_snapshot *text_snapshot_new(const uint8_t *content);
+
+// Take another reference to the snapshot. Returns s.
+text_snapshot *text_snapshot_retain(text_snapshot *s);
+void text_snapshot_release(text_snapshot *s);
+
+size_t text_snapshot_char_count(const text_snapshot *s);
+size_t text_snapshot_byte_count(const text_snapshot *s);
+
+// The number of ops which have been applied to get to this snapshot.
+size_t text_snapshot_version(const text_snapshot *s);
+
+// Apply an op to a snapshot, returning the new version. s is left alone. Returns NULL if the op
+// doesn't fit the document.
+text_snapshot *text_snapshot_apply(const text_snapshot *s, const text_op *op);
+
+// Copy the snapshot's content out into dest, which needs room for text_snapshot_byte_count + 1
+// bytes. The content is \0 terminated. Returns the number of bytes written, including the \0.
+size_t text_snapshot_write_cstr(const text_snapshot *s, uint8_t *dest);
+
+// Copy out the snapshot's content. Free the result when you're done with it.
+uint8_t *text_snapshot_create_cstr(const text_snapshot *s);
+
+// Read num characters starting at pos, which are passed to write a piece at a time in order. The
+// range is clamped to the end of the document.
+void text_snapshot_read(const text_snapshot *s, size_t pos, size_t num, text_write_fn write,
+    void *user);
+
+// The latest version of a document.
+typedef struct {
+  text_snapshot *current;
+  // Only held while current is swapped out or retained, never while an op is applied.
+  pthread_mutex_t lock;
+} text_snapshot_head;
+
+void text_snapshot_head_init(text_snapshot_head *head, const uint8_t *content);
+void text_snapshot_head_destroy(text_snapshot_head *head);
+
+// Get the current version. Release it when you're done with it.
+text_snapshot *text_snapshot_head_get(text_snapshot_head *head);
+
+// Apply an op to the current version. Snapshots readers already have are left alone. Only one
+// thread can apply ops at a time. Returns 0 on success, nonzero (leaving the document unchanged)
+// if the op doesn't fit.
+int text_snapshot_head_apply(text_snapshot_head *head, const text_op *op);
+
+#endif
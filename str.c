@@ -3,10 +3,37 @@
 #include "str.h"
 #include "utf8.h"
 
+struct str_buf {
+  size_t refcount;
+  size_t size; // The whole allocation, including this header.
+  uint8_t data[];
+};
+
+// Allocate a buffer with room for num_bytes and a \0.
+static str_buf *buf_new(size_t num_bytes) {
+  str_buf *buf = malloc(sizeof(str_buf) + num_bytes + 1);
+  buf->refcount = 1;
+  buf->size = sizeof(str_buf) + num_bytes + 1;
+  return buf;
+}
+
+size_t str_buffer_size(const str_buf *buf) {
+  return buf->size;
+}
+
+// Strings (and the ops holding them) can be shared between threads, so the reference count
+// is updated atomically.
+static void buf_release(str_buf *buf) {
+  if (__atomic_sub_fetch(&buf->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(buf);
+  }
+}
+
 // Initialize an empty string at s.
 void str_init(str *s) {
-  s->mem = NULL;
   s->chars[0] = '\0';
+  s->inline_chars = 0;
+  s->inline_bytes = 0;
 }
 
 // Initialize a string with the specified content.
@@ -19,25 +46,47 @@ void str_init2(str *s, const uint8_t *content) {
 // Initialize a string with the specified content, occupying the specified
 // number of bytes & characters.
 void str_init3(str *s, const uint8_t *content, size_t num_bytes, size_t num_chars) {
-  if (num_bytes < sizeof(s->chars)) {
+  str_init3_arena(s, content, num_bytes, num_chars, NULL);
+}
+
+void str_init3_arena(str *s, const uint8_t *content, size_t num_bytes, size_t num_chars,
+    text_op_arena *arena) {
+  if (num_bytes <= STR_MAX_INLINE) {
     // Inlined.
-    s->mem = NULL;
     memcpy(s->chars, content, num_bytes);
     s->chars[num_bytes] = '\0';
+    s->inline_chars = num_chars;
+    s->inline_bytes = num_bytes;
   } else {
-    s->mem = (uint8_t *)malloc(num_bytes + 1); // We'll put a \0 on it.
+    // We'll put a \0 on it.
+    if (arena) {
+      s->mem = text_op_arena_alloc(arena, num_bytes + 1);
+      s->buf = NULL;
+    } else {
+      s->buf = buf_new(num_bytes);
+      s->mem = s->buf->data;
+    }
     memcpy(s->mem, content, num_bytes);
     s->mem[num_bytes] = '\0';
     s->num_bytes = num_bytes;
     s->num_chars = num_chars;
+    s->heap_tag = STR_HEAP;
   }
 }
 
 void str_init_with_copy(str *dest, const str *src) {
-  if (src->mem) {
-    str_init3(dest, src->mem, src->num_bytes, src->num_chars);
-  } else {
+  str_init_with_copy_arena(dest, src, NULL);
+}
+
+void str_init_with_copy_arena(str *dest, const str *src, text_op_arena *arena) {
+  if (str_is_inline(src)) {
+    *dest = *src;
+  } else if (src->buf && !arena && src->num_bytes > STR_MAX_INLINE) {
+    // Share the buffer. (Short slices are copied inline instead.)
     *dest = *src;
+    __atomic_add_fetch(&dest->buf->refcount, 1, __ATOMIC_RELAXED);
+  } else {
+    str_init3_arena(dest, src->mem, src->num_bytes, src->num_chars, arena);
   }
 }
 
@@ -50,49 +99,145 @@ void str_init_with_substring(str *s, str *other, size_t start, size_t length) {
     length = other_len - start;
   }
   
-  uint8_t *range_start = count_utf8_chars(str_content(other), start);
-  uint8_t *range_end = count_utf8_chars(range_start, length);
+  const uint8_t *content = str_content(other);
+  const uint8_t *range_start, *range_end;
+  if (str_num_bytes(other) == other_len) {
+    // Its all ASCII. No need to count anything.
+    range_start = content + start;
+    range_end = range_start + length;
+  } else {
+    range_start = count_utf8_chars(content, start);
+    range_end = count_utf8_chars(range_start, length);
+  }
   
-  str_init3(s, range_start, range_end - range_start, length);
+  str slice;
+  str_init_slice(&slice, other, range_start - content, range_end - range_start, length);
+  str_init_with_copy(s, &slice);
 }
 
 void str_destroy(str *s) {
-  if (s->mem) {
-    free(s->mem);
+  if (!str_is_inline(s) && s->buf) {
+    buf_release(s->buf);
   }
 }
 
-static void _append(str *s, const uint8_t *other, size_t other_bytes, size_t other_chars) {
-  if (s->mem) {
-    s->mem = realloc(s->mem, s->num_bytes + other_bytes + 1);
+static void _append(str *s, const uint8_t *other, size_t other_bytes, size_t other_chars,
+    text_op_arena *arena) {
+  if (!str_is_inline(s)) {
+    size_t new_size = s->num_bytes + other_bytes + 1;
+    if (arena) {
+      s->mem = text_op_arena_realloc(arena, s->mem, s->num_bytes + 1, new_size);
+    } else if (s->buf && __atomic_load_n(&s->buf->refcount, __ATOMIC_ACQUIRE) == 1
+        && s->mem == s->buf->data) {
+      // Nobody else is looking at the buffer. Grow it in place.
+      s->buf = realloc(s->buf, sizeof(str_buf) + new_size);
+      s->buf->size = sizeof(str_buf) + new_size;
+      s->mem = s->buf->data;
+    } else {
+      // The buffer is shared (or we're a slice of it, or a view). Copy the string out first.
+      str_buf *buf = buf_new(new_size - 1);
+      memcpy(buf->data, s->mem, s->num_bytes);
+      if (s->buf) {
+        buf_release(s->buf);
+      }
+      s->buf = buf;
+      s->mem = buf->data;
+    }
     memcpy(&s->mem[s->num_bytes], other, other_bytes);
     s->num_bytes += other_bytes;
     s->num_chars += other_chars;
     s->mem[s->num_bytes] = '\0';
   } else {
-    size_t my_bytes = str_num_bytes(s);
-    if (my_bytes + other_bytes >= sizeof(s->chars)) {
+    size_t my_bytes = s->inline_bytes;
+    size_t my_chars = s->inline_chars;
+    if (my_bytes + other_bytes > STR_MAX_INLINE) {
       // Expand.
-      size_t my_chars = strlen_utf8(s->chars);
-      uint8_t *mem = (uint8_t *)malloc(my_bytes + other_bytes + 1);
+      str_buf *buf = NULL;
+      uint8_t *mem;
+      if (arena) {
+        mem = text_op_arena_alloc(arena, my_bytes + other_bytes + 1);
+      } else {
+        buf = buf_new(my_bytes + other_bytes);
+        mem = buf->data;
+      }
       memcpy(mem, s->chars, my_bytes);
       memcpy(&mem[my_bytes], other, other_bytes);
       s->mem = mem;
+      s->buf = buf;
       s->num_bytes = my_bytes + other_bytes;
       s->num_chars = my_chars + other_chars;
+      s->heap_tag = STR_HEAP;
       mem[s->num_bytes] = '\0';
     } else {
       // Append inline.
       memcpy(&s->chars[my_bytes], other, other_bytes);
       s->chars[my_bytes + other_bytes] = '\0';
+      s->inline_bytes = my_bytes + other_bytes;
+      s->inline_chars = my_chars + other_chars;
     }
   }
 }
 
 void str_append(str *s, const str *other) {
-  _append(s, str_content(other), str_num_bytes(other), str_num_chars(other));
+  str_append_arena(s, other, NULL);
+}
+
+void str_append_arena(str *s, const str *other, text_op_arena *arena) {
+  _append(s, str_content(other), str_num_bytes(other), str_num_chars(other), arena);
 }
 
 void str_append2(str *s, const uint8_t *other) {
-  _append(s, other, strlen((char *)other), strlen_utf8(other));
-}
\ No newline at end of file
+  _append(s, other, strlen((char *)other), strlen_utf8(other), NULL);
+}
+
+// A 4 byte character takes 3 more bytes than an ascii one, so strings with fewer extra bytes than
+// that are entirely in the BMP, where characters and UTF-16 units are the same thing.
+static inline bool str_is_bmp(const str *s) {
+  return str_num_bytes(s) - str_num_chars(s) < 3;
+}
+
+size_t str_num_utf16(const str *s) {
+  return str_is_bmp(s) ? str_num_chars(s) : count_utf16_units(str_content(s), str_num_bytes(s));
+}
+
+static inline size_t lead_byte_size(uint8_t b) {
+  return b < 0x80 ? 1 : b < 0xe0 ? 2 : b < 0xf0 ? 3 : 4;
+}
+
+size_t str_chars_to_utf16(const str *s, size_t chars) {
+  if (chars >= str_num_chars(s)) {
+    return str_num_utf16(s);
+  } else if (str_is_bmp(s)) {
+    return chars;
+  }
+  
+  const uint8_t *content = str_content(s);
+  size_t units = 0;
+  for (size_t i = 0; chars > 0; chars--) {
+    size_t size = lead_byte_size(content[i]);
+    units += size == 4 ? 2 : 1;
+    i += size;
+  }
+  return units;
+}
+
+size_t str_utf16_to_chars(const str *s, size_t units) {
+  if (str_is_bmp(s)) {
+    size_t num_chars = str_num_chars(s);
+    return units < num_chars ? units : num_chars;
+  }
+  
+  const uint8_t *content = str_content(s);
+  size_t num_bytes = str_num_bytes(s);
+  size_t chars = 0;
+  for (size_t i = 0; i < num_bytes; chars++) {
+    size_t size = lead_byte_size(content[i]);
+    size_t len = size == 4 ? 2 : 1;
+    if (len > units) {
+      break;
+    }
+    units -= len;
+    i += size;
+  }
+  return chars;
+}
@@ -1,5 +1,9 @@
-// This is a tiny utf-8 string library. If strings are less than 12 characters (or 24 chars
-// in 64 bit mode), they are inlined in the struct.
+// This is a tiny utf-8 string library. Strings up to 29 bytes (or 17 bytes in 32 bit mode) are
+// inlined in the struct. Either way, the string's length in bytes and characters is stored
+// alongside it, so asking for the length never needs to scan the string.
+//
+// Longer strings live in a reference counted buffer. Copies and substrings of them share the
+// buffer instead of copying the characters.
 //
 // This data format is ideal for small strings (<100 bytes in size). If the strings are
 // larger, consider using ropes.
@@ -12,23 +16,59 @@
 #include <stdbool.h>
 #include <string.h>
 #include "utf8.h"
+#include "arena.h"
+
+// On 64 bit machines the character count of a heap string shares a word with heap_tag, leaving it
+// 56 bits. A 24 bit count would wrap at 16M characters, so 32 bit machines give it a whole word
+// and the struct grows by one.
+#if SIZE_MAX > UINT32_MAX
+#define STR_WORDS 4
+#else
+#define STR_WORDS 5
+#endif
 
-// It might make sense to increase this sometimes for performance.
-#define STR_MAX_INLINE (sizeof(size_t) * 2)
-
-typedef struct {
-  uint8_t *mem; // NULL if the string is inline.
-  union {
-    // If the string takes up more than a few bytes
-    struct {
-      size_t num_bytes;
-      size_t num_chars;
-    };
-    // Inline characters
-    uint8_t chars[STR_MAX_INLINE];
+// The longest string (in bytes) which is stored inline. The last 2 bytes of the struct hold the
+// inline string's lengths, and we need a byte for the \0.
+#define STR_MAX_INLINE (sizeof(size_t) * STR_WORDS - 3)
+
+// The value in the last byte of a string which isn't inline. Inline strings store their length
+// in bytes there, so this can never be mistaken for one of them.
+#define STR_HEAP 0xff
+
+// A reference counted block of characters. Defined in str.c.
+typedef struct str_buf str_buf;
+
+typedef union {
+  // If the string takes up more than a few bytes (or is a view)
+  struct {
+    uint8_t *mem; // The first character. This might be partway into buf.
+    str_buf *buf; // The buffer holding mem, or NULL for views and arena strings.
+    size_t num_bytes;
+#if SIZE_MAX > UINT32_MAX
+    // Bitfields are laid out so heap_tag ends up in the last byte of the struct on both big and
+    // little endian machines.
+    size_t num_chars : sizeof(size_t) * 8 - 8;
+    size_t heap_tag : 8; // Always STR_HEAP.
+#else
+    size_t num_chars;
+    uint8_t heap_padding[sizeof(size_t) - 1];
+    uint8_t heap_tag; // Always STR_HEAP.
+#endif
+  };
+  // Inline characters
+  struct {
+    uint8_t chars[STR_MAX_INLINE + 1]; // \0 terminated.
+    uint8_t inline_chars;
+    uint8_t inline_bytes; // Shares the last byte with heap_tag.
   };
 } str;
 
+_Static_assert(sizeof(str) == sizeof(size_t) * STR_WORDS, "heap_tag must share inline_bytes");
+
+static inline bool str_is_inline(const str *s) {
+  return s->inline_bytes != STR_HEAP;
+}
+
 // Initialize an empty string at s.
 void str_init(str *s);
 
@@ -45,24 +85,89 @@ void str_init_with_copy(str *dest, const str *src);
 // Initialize a string with a substring of another string.
 void str_init_with_substring(str *s, str *other, size_t start, size_t length);
 
+// Point s at existing memory without copying it. The content doesn't need to be \0 terminated,
+// so only use the string with functions which respect its length (copy and append). Views are
+// never owned - don't call str_destroy on them.
+static inline void str_init_view(str *s, const uint8_t *content, size_t num_bytes, size_t num_chars) {
+  s->mem = (uint8_t *)content;
+  s->buf = NULL;
+  s->num_bytes = num_bytes;
+  s->num_chars = num_chars;
+  s->heap_tag = STR_HEAP;
+}
+
+// Make s a view of part of other, starting byte_offset bytes in. Like other views it isn't
+// owned, but if other is reference counted then so is the view - copying it with
+// str_init_with_copy shares other's buffer rather than copying the characters.
+static inline void str_init_slice(str *s, const str *other, size_t byte_offset, size_t num_bytes,
+    size_t num_chars) {
+  if (str_is_inline(other)) {
+    str_init_view(s, other->chars + byte_offset, num_bytes, num_chars);
+  } else {
+    *s = *other;
+    s->mem += byte_offset;
+    s->num_bytes = num_bytes;
+    s->num_chars = num_chars;
+  }
+}
+
+// Variants of the functions above which allocate out of an arena instead of the heap. If arena is
+// NULL these behave exactly like the normal versions. Strings allocated in an arena are freed when
+// the arena is reset, so they must not be passed to str_destroy.
+void str_init3_arena(str *s, const uint8_t *content, size_t num_bytes, size_t num_chars,
+    text_op_arena *arena);
+void str_init_with_copy_arena(str *dest, const str *src, text_op_arena *arena);
+void str_append_arena(str *s, const str *other, text_op_arena *arena);
+
 void str_destroy(str *s);
 
+// The reference counted buffer holding the string's characters, or NULL if it doesn't have one
+// (inline strings, views and arena strings). Slices and copies of a string share its buffer, so
+// this is how to tell if two strings are holding onto the same memory.
+static inline const str_buf *str_buffer(const str *s) {
+  return str_is_inline(s) ? NULL : s->buf;
+}
+
+// How much memory a buffer takes up, in bytes.
+size_t str_buffer_size(const str_buf *buf);
+
 // Get the number of characters in a string
 static inline size_t str_num_chars(const str *s) {
-  return s->mem ? s->num_chars : strlen_utf8(s->chars);
+  return str_is_inline(s) ? s->inline_chars : s->num_chars;
 }
 
 // Get the number of bytes in a string
 static inline size_t str_num_bytes(const str *s) {
-  return s->mem ? s->num_bytes : strlen((const char *)s->chars);
+  return str_is_inline(s) ? s->inline_bytes : s->num_bytes;
+}
+
+static inline bool str_is_empty(const str *s) {
+  return str_num_bytes(s) == 0;
 }
 
+// Get the length of a string in UTF-16 code units (which is what javascript strings count).
+size_t str_num_utf16(const str *s);
+
+// Convert offsets into a string between characters and UTF-16 code units. Offsets past the end
+// of the string are clamped to its length. A UTF-16 offset in the middle of a surrogate pair is
+// rounded down to the start of the character.
+size_t str_chars_to_utf16(const str *s, size_t chars);
+size_t str_utf16_to_chars(const str *s, size_t units);
+
 // Append other to s.
 void str_append(str *s, const str *other);
 void str_append2(str *s, const uint8_t *other);
 
+// The string's characters. Slices of a longer string aren't \0 terminated - see
+// str_is_terminated.
 static inline const uint8_t *str_content(const str *s) {
-  return s->mem ? s->mem : s->chars;
+  return str_is_inline(s) ? s->chars : s->mem;
+}
+
+// Check if the string is followed by a \0 and can be used as a C string. Views are assumed
+// to be (views decoded out of serialized ops always are).
+static inline bool str_is_terminated(const str *s) {
+  return str_is_inline(s) || s->buf == NULL || s->mem[s->num_bytes] == '\0';
 }
 
 
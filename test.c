@@ -4,8 +4,17 @@
 #include <stdlib.h>
 #include <sys/time.h>
 #include <assert.h>
+#include <pthread.h>
 #include "text.h"
 #include "str.h"
+#include "doc.h"
+#include "client.h"
+#include "utf8.h"
+#include "document.h"
+#include "undo.h"
+#include "json.h"
+#include "rich.h"
+#include "snapshot.h"
 
 void sanity() {
   text_op_component insert = {TEXT_OP_INSERT};
@@ -25,6 +34,47 @@ void sanity() {
   rope_free(doc);
 }
 
+void small_strings() {
+  // The longest string which fits inline, and one byte more.
+  uint8_t content[STR_MAX_INLINE + 2];
+  memset(content, 'a', sizeof(content));
+  content[STR_MAX_INLINE] = '\0';
+  
+  str s;
+  str_init2(&s, content);
+  assert(str_is_inline(&s));
+  assert(str_num_bytes(&s) == STR_MAX_INLINE);
+  assert(str_num_chars(&s) == STR_MAX_INLINE);
+  
+  // Appending a 2 byte character moves it onto the heap.
+  str_append2(&s, (uint8_t *)"½");
+  assert(!str_is_inline(&s));
+  assert(str_num_bytes(&s) == STR_MAX_INLINE + 2);
+  assert(str_num_chars(&s) == STR_MAX_INLINE + 1);
+  
+  str sub;
+  str_init_with_substring(&sub, &s, STR_MAX_INLINE - 2, 5);
+  assert(str_is_inline(&sub));
+  assert(str_num_chars(&sub) == 3);
+  assert(str_num_bytes(&sub) == 4);
+  assert(strcmp((char *)str_content(&sub), "aa½") == 0);
+  
+  // Inline strings keep their lengths up to date as they grow.
+  str_append2(&sub, (uint8_t *)"Δδ");
+  assert(str_is_inline(&sub));
+  assert(str_num_chars(&sub) == 5);
+  assert(str_num_bytes(&sub) == 8);
+  assert(strcmp((char *)str_content(&sub), "aa½Δδ") == 0);
+  
+  str empty;
+  str_init(&empty);
+  assert(str_is_empty(&empty));
+  assert(str_num_chars(&empty) == 0);
+  
+  str_destroy(&s);
+  str_destroy(&sub);
+}
+
 void left_hand_inserts() {
   text_op ins1 = text_op_insert(100, (uint8_t *)"abc");
   text_op ins2 = text_op_insert(100, (uint8_t *)"def");
@@ -48,14 +98,23 @@ static const char *UCHARS[] = {
 //  "𐆐", "𐆔", "𐆘", "𐆚", // Ancient roman symbols (U+10190 – U+101CF)
 };
 
+// Characters from a few different scripts, for testing the utf8 code.
+static const char *MIXED_UCHARS[] = {
+  "a", "b", "c", " ", "\n", // ASCII
+  "©", "¥", "½", // The Latin-1 suppliment (U+80 - U+ff)
+  "Ύ", "Δ", "δ", "Ϡ", // Greek (U+0370 - U+03FF)
+  "←", "↯", "↻", "⇈", // Arrows (U+2190 – U+21FF)
+  "𐆐", "𐆔", "𐆘", "𐆚", // Ancient roman symbols (U+10190 – U+101CF)
+};
+
 // s is the size of the buffer, including the \0. This function might use
 // fewer bytes than that.
-void random_string(uint8_t *buffer, size_t s) {
+void random_string_from(uint8_t *buffer, size_t s, const char *chars[], size_t num_chars) {
   if (s == 0) { return; }
   uint8_t *pos = buffer;
   
   while(1) {
-    uint8_t *c = (uint8_t *)UCHARS[random() % (sizeof(UCHARS) / sizeof(UCHARS[0]))];
+    uint8_t *c = (uint8_t *)chars[random() % num_chars];
     
     size_t bytes = strlen((char *)c);
     
@@ -72,11 +131,16 @@ void random_string(uint8_t *buffer, size_t s) {
   *pos = '\0';
 }
 
+void random_string(uint8_t *buffer, size_t s) {
+  random_string_from(buffer, s, UCHARS, sizeof(UCHARS) / sizeof(UCHARS[0]));
+}
+
 static float rand_float() {
   return (float)random() / INT32_MAX;
 }
 
-text_op random_op(rope *doc) {
+// Make a random op which applies to doc, inserting characters from chars.
+text_op random_op_from(rope *doc, const char *chars[], size_t num_chars) {
   uint8_t buffer[100];
   
   size_t remaining_chars = rope_char_count(doc);
@@ -100,7 +164,7 @@ text_op random_op(rope *doc) {
       // Insert.
       size_t l = 1 + random() % 9;
       l *= l; // random number from 1 to 10, squared. Small inserts are much more frequent than large ones.
-      random_string(buffer, l);
+      random_string_from(buffer, l, chars, num_chars);
       components[num_components].type = TEXT_OP_INSERT;
       str_init2(&components[num_components].str, buffer);
       num_components++;
@@ -118,6 +182,10 @@ text_op random_op(rope *doc) {
   return text_op_from_components(components, num_components);
 }
 
+text_op random_op(rope *doc) {
+  return random_op_from(doc, UCHARS, sizeof(UCHARS) / sizeof(UCHARS[0]));
+}
+
 void random_op_test() {
   srandom(2);
   rope *doc = rope_new();
@@ -254,219 +322,3094 @@ void serialize_deserialze() {
   free(buf.bytes);
 }
 
-static void test_cursor(text_op *op, bool is_own,
-                    size_t start, size_t end, size_t e_start, size_t e_end) {
-  text_cursor result = text_op_transform_cursor(text_cursor_make(start, end), op, is_own);
-  assert(result.start == e_start);
-  assert(result.end == e_end);
+// Check two ops are identical by comparing their serialized bytes.
+static bool ops_equal(text_op *a, text_op *b) {
+  buffer buf_a = {}, buf_b = {};
+  text_op_to_bytes(a, append, &buf_a);
+  text_op_to_bytes(b, append, &buf_b);
+  bool equal = buf_a.num == buf_b.num && memcmp(buf_a.bytes, buf_b.bytes, buf_a.num) == 0;
+  free(buf_a.bytes);
+  free(buf_b.bytes);
+  return equal;
 }
 
-void transform_cursor() {
-  text_op ins = text_op_insert(10, (uint8_t *)"oh hi");
-  text_op del = text_op_delete(25, 20);
-  text_op op = text_op_compose(&ins, &del);
-  // The op skips 10, inserts 5 characters, skips another 10 then deletes 20 characters.
+void arena_ops() {
+  srandom(7);
+  rope *doc = rope_new_with_utf8((uint8_t *)"Some text which is longer than a small string.");
   
-#define C(s, e) text_cursor_make(s, e)
-  // A cursor at the start of the inserted text shouldn't move.
-  test_cursor(&op, false, 10, 10, 10, 10);
-  test_cursor(&op, false, 10, 11, 10, 16);
+  text_op_arena arena;
+  text_op_arena_init(&arena, 256); // Small blocks so we run off the end of them a lot.
   
-  // Unless its your cursor.
-  test_cursor(&ins, true, 10, 11, 15, 15);
+  for (int i = 0; i < 10000; i++) {
+    text_op op1 = random_op(doc);
+    text_op op2 = random_op(doc);
+    
+    text_op op1_ = text_op_transform(&op1, &op2, true);
+    text_op op2_ = text_op_transform(&op2, &op1, false);
+    text_op op12 = text_op_compose(&op1, &op2_);
+    
+    text_op a_op1_, a_op2_, a_op12;
+    text_op_transform_arena(&a_op1_, &op1, &op2, true, &arena);
+    text_op_transform_arena(&a_op2_, &op2, &op1, false, &arena);
+    text_op_compose_arena(&a_op12, &op1, &a_op2_, &arena);
+    
+    assert(ops_equal(&op1_, &a_op1_));
+    assert(ops_equal(&op2_, &a_op2_));
+    assert(ops_equal(&op12, &a_op12));
+    
+    // Round trip through bytes into the arena as well.
+    buffer buf = {};
+    text_op_to_bytes(&op12, append, &buf);
+    text_op a_copy;
+    assert(text_op_from_bytes_arena(&a_copy, buf.bytes, buf.num, &arena) == buf.num);
+    assert(ops_equal(&op12, &a_copy));
+    free(buf.bytes);
+    
+    text_op_apply(doc, &op12);
+    
+    text_op_free(&op1);
+    text_op_free(&op2);
+    text_op_free(&op1_);
+    text_op_free(&op2_);
+    text_op_free(&op12);
+    
+    if (i % 10 == 0) {
+      text_op_arena_reset(&arena);
+    }
+  }
   
-  // Any character inside the deleted region should move to the start of the region.
-  test_cursor(&del, false, 25, 40, 25, 25);
-  test_cursor(&del, false, 35, 50, 25, 30);
-  test_cursor(&del, false, 45, 60, 25, 40);
+  text_op_arena_destroy(&arena);
+  rope_free(doc);
+}
 
-  test_cursor(&del, true, 25, 40, 25, 25);
-  test_cursor(&del, true, 35, 50, 25, 25);
-  test_cursor(&del, true, 45, 60, 25, 25);
+void view_ops() {
+  srandom(9);
+  rope *doc = rope_new_with_utf8((uint8_t *)"Hi there!! OMG strings rock.");
+  
+  buffer buf = {};
+  for (int i = 0; i < 10000; i++) {
+    text_op op = random_op(doc);
+    text_op other = random_op(doc);
+    
+    buf.num = 0;
+    text_op_to_bytes(&op, append, &buf);
+    
+    text_op_view view;
+    assert(text_op_view_init(&view, buf.bytes, buf.num) == buf.num);
+    // Truncated ops are rejected.
+    assert(text_op_view_init(&view, buf.bytes, buf.num - 1) < 0);
+    assert(text_op_view_init(&view, buf.bytes, buf.num) == buf.num);
+    
+    // Reading the view gives back the op.
+    text_op copy;
+    text_op_from_view(&copy, &view);
+    assert(ops_equal(&op, &copy));
+    text_op_free(&copy);
+    
+    assert(text_op_view_check(doc, &view) == text_op_check(doc, &op));
+    
+    // Transforming by the view is the same as transforming by the op.
+    text_op expected = text_op_transform(&other, &op, i % 2);
+    text_op actual;
+    text_op_transform_view2(&actual, &other, &view, i % 2);
+    assert(ops_equal(&expected, &actual));
+    text_op_free(&expected);
+    text_op_free(&actual);
+    
+    size_t len = rope_char_count(doc);
+    for (int c = 0; c < 10; c++) {
+      text_cursor cursor = text_cursor_make(random() % (len + 1), random() % (len + 1));
+      for (int own = 0; own < 2; own++) {
+        text_cursor e = text_op_transform_cursor(cursor, &op, own);
+        text_cursor a = text_op_view_transform_cursor(cursor, &view, own);
+        assert(e.start == a.start && e.end == a.end);
+      }
+    }
+    
+    rope *doc2 = rope_copy(doc);
+    text_op_apply(doc, &op);
+    assert(text_op_view_apply(doc2, &view) == 0);
+    
+    uint8_t *doc_str = rope_create_cstr(doc);
+    uint8_t *doc2_str = rope_create_cstr(doc2);
+    assert(strcmp((char *)doc_str, (char *)doc2_str) == 0);
+    
+    free(doc_str);
+    free(doc2_str);
+    rope_free(doc2);
+    text_op_free(&op);
+    text_op_free(&other);
+  }
+  rope_free(doc);
+  free(buf.bytes);
+}
 
-  // Cursors before the deleted region are uneffected
-  test_cursor(&del, false, 10, 25, 10, 25);
+void serialize_v2() {
+  srandom(11);
+  rope *doc = rope_new_with_utf8((uint8_t *)"Hi there!! OMG strings rock.");
   
-  // Cursors past the end of the deleted region get pulled back.
-  test_cursor(&del, false, 55, 60, 35, 40);
+  buffer buf = {}, v1_buf = {};
+  size_t v1_total = 0, v2_total = 0;
+  for (int i = 0; i < 10000; i++) {
+    text_op op = random_op(doc);
+    
+    buf.num = 0;
+    text_op_to_bytes_v2(&op, append, &buf);
+    v1_buf.num = 0;
+    text_op_to_bytes(&op, append, &v1_buf);
+    v2_total += buf.num;
+    v1_total += v1_buf.num;
+    
+    text_op op_copy;
+    assert(text_op_from_bytes(&op_copy, buf.bytes, buf.num) == buf.num);
+    assert(ops_equal(&op, &op_copy));
+    text_op_free(&op_copy);
+    
+    // Every truncated prefix is rejected.
+    for (size_t len = 1; len < buf.num; len++) {
+      text_op_view view;
+      assert(text_op_view_init(&view, buf.bytes, len) < 0);
+    }
+    
+    text_op_view view;
+    assert(text_op_view_init(&view, buf.bytes, buf.num) == buf.num);
+    rope *doc2 = rope_copy(doc);
+    text_op_apply(doc, &op);
+    assert(text_op_view_apply(doc2, &view) == 0);
+    
+    uint8_t *doc_str = rope_create_cstr(doc);
+    uint8_t *doc2_str = rope_create_cstr(doc2);
+    assert(strcmp((char *)doc_str, (char *)doc2_str) == 0);
+    
+    free(doc_str);
+    free(doc2_str);
+    rope_free(doc2);
+    text_op_free(&op);
+  }
+  assert(v2_total < v1_total);
   
-  // Your cursor always teleports to the end of the last insert or the deletion site.
-  test_cursor(&ins, true,   0, 50, 15, 15);
-  test_cursor(&ins, true, 100, 50, 15, 15);
-  test_cursor(&del, true,   0, 50, 25, 25);
-  test_cursor(&del, true, 100, 50, 25, 25);
-
-  // More complicated cases
-  test_cursor(&op, false, 0, 5, 0, 5);
-  test_cursor(&op, false, 100, 5, 85, 5);
-  test_cursor(&op, false, 10, 5, 10, 5);
-  test_cursor(&op, false, 11, 5, 16, 5);
-
-  test_cursor(&op, false, 20, 5, 25, 5);
-  test_cursor(&op, false, 30, 5, 25, 5);
-  test_cursor(&op, false, 40, 5, 25, 5);
-  test_cursor(&op, false, 41, 5, 26, 5);
-
-  test_cursor(&op, true, 0, 100, 25, 25);
-#undef C
+  // Lengths above 4GB survive the trip.
+  size_t big = (size_t)1 << (sizeof(size_t) > 4 ? 40 : 30);
+  text_op_component c[3] = {{TEXT_OP_SKIP}, {TEXT_OP_INSERT}, {TEXT_OP_DELETE}};
+  c[0].num = big;
+  str_init2(&c[1].str, (uint8_t *)"\xc2\xa9 a fairly long insert");
+  c[2].num = big + 1;
+  text_op op = text_op_from_components(c, 3);
+  buf.num = 0;
+  text_op_to_bytes_v2(&op, append, &buf);
+  text_op op_copy;
+  assert(text_op_from_bytes(&op_copy, buf.bytes, buf.num) == buf.num);
+  assert(op_copy.components[0].num == big);
+  assert(str_num_chars(&op_copy.components[1].str) == 22);
+  assert(op_copy.components[2].num == big + 1);
+  text_op_free(&op);
+  text_op_free(&op_copy);
+  
+  // The 10th byte of a varint only holds the top bit. Anything more would be silently dropped.
+  uint8_t overlong[] = {0x82, 0xfd, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02, 0x00};
+  assert(text_op_from_bytes(&op_copy, overlong, sizeof(overlong)) < 0);
+  text_op_view view;
+  assert(text_op_view_init(&view, overlong, sizeof(overlong)) < 0);
+  
+  rope_free(doc);
+  free(buf.bytes);
+  free(v1_buf.bytes);
+}
 
-  text_op_free(&ins);
-  text_op_free(&del);
+// Parse an op out of a JSON string and check it matches expected (which is also JSON).
+static void check_json_op(const char *json, const char *expected) {
+  text_op op;
+  assert(text_op_from_json(&op, json, strlen(json)) == strlen(json));
+  buffer buf = {};
+  text_op_to_json(&op, append, &buf);
+  assert(buf.num == strlen(expected) && memcmp(buf.bytes, expected, buf.num) == 0);
+  free(buf.bytes);
   text_op_free(&op);
 }
 
-void benchmark_string() {
-  printf("Benchmarking string copy\n");
-  
-//  long iterations = 2000000000;
-  long iterations = 20000000;
+void json_text_ops() {
+  srandom(13);
+  rope *doc = rope_new_with_utf8((uint8_t *)"Hi there!! OMG strings rock.");
   
-  str s1;
-  str_init2(&s1, (uint8_t *)"Hi there this string is longer than 16 bytes");
+  buffer buf = {};
+  for (int i = 0; i < 10000; i++) {
+    text_op op = random_op(doc);
+    buf.num = 0;
+    text_op_to_json(&op, append, &buf);
+    text_op op_copy;
+    assert(text_op_from_json(&op_copy, buf.bytes, buf.num) == buf.num);
+    assert(ops_equal(&op, &op_copy));
+    text_op_free(&op_copy);
+    
+    // Every truncated prefix is rejected.
+    for (size_t len = 0; len < buf.num; len++) {
+      assert(text_op_from_json(&op_copy, buf.bytes, len) < 0);
+    }
+    
+    text_op_apply(doc, &op);
+    text_op_free(&op);
+  }
+  rope_free(doc);
+  free(buf.bytes);
   
-  struct timeval start, end;
+  check_json_op("[]", "[]");
+  check_json_op(" [ 3 , \"hi\" , { d : 5 } , 10 ]", "[3,\"hi\",{\"d\":5}]");
+  check_json_op("[{\"d\":2},1,1,\"a\",\"b\"]", "[{\"d\":2},2,\"ab\"]");
+  // Escapes are decoded, and only the ones JSON needs are written back out.
+  check_json_op("[\"\\\"\\\\\\/\\b\\f\\n\\r\\t\\u0001\\u00e9\\u20ac\\ud83d\\ude00\"]",
+      "[\"\\\"\\\\/\\b\\f\\n\\r\\t\\u0001\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\"]");
   
-  gettimeofday(&start, NULL);
+  text_op op;
+  const char *json = "[\"\\u00e9\\ud83d\\ude00x\"]";
+  assert(text_op_from_json(&op, json, strlen(json)) == strlen(json));
+  assert(op.content.type == TEXT_OP_INSERT && str_num_chars(&op.content.str) == 3);
+  text_op_free(&op);
   
-  for (long i = 0; i < iterations; i++) {
-    str s2;
-    str_init_with_copy(&s2, &s1);
-    str_destroy(&s2);
+  // A long string with escapes all the way through, after a long run without any.
+  buffer long_json = {};
+  append((void *)"[\"", 2, &long_json);
+  for (int i = 0; i < 300; i++) {
+    append((void *)"x", 1, &long_json);
   }
+  for (int i = 0; i < 500; i++) {
+    append((void *)"ab\\n\\u00e9", 10, &long_json);
+  }
+  append((void *)"\"]", 2, &long_json);
+  assert(text_op_from_json(&op, long_json.bytes, long_json.num) == long_json.num);
+  assert(str_num_chars(&op.content.str) == 2300 && str_num_bytes(&op.content.str) == 2800);
+  text_op_free(&op);
+  free(long_json.bytes);
   
-  gettimeofday(&end, NULL);
-  
-  double elapsedTime = end.tv_sec - start.tv_sec;
-  elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
-  printf("did %ld iterations in %f ms: %f Miter/sec\n",
-         iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000);
+  const char *bad[] = {
+    "", "3", "[", "[,]", "[3,]", "[-1]", "[1.5]", "[\"a]", "[\"\n\"]", "[\"\\x\"]",
+    "[\"\\ud83d\"]", "[\"\\ude00\"]", "[\"\\ud83dx\"]", "[\"\\u12g4\"]", "[\"\xff\"]",
+    "[\"\xc3\"]", "[\"a\\u0000b\"]", "[\"\xed\xa0\x80\"]", "[\"\xe0\x80\x80\"]", "[{}]",
+    "[{\"e\":1}]", "[{\"d\":}]", "[{\"d\":1]", "[99999999999999999999999]",
+    // Counts which would wrap around when they're added up.
+    "[18446744073709551615]", "[2,{\"d\":18446744073709551615}]",
+    "[1,\"x\",18446744073709551614,{\"d\":1}]", "[9223372036854775807,1]",
+  };
+  for (int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    assert(text_op_from_json(&op, bad[i], strlen(bad[i])) < 0);
+  }
+  const char *biggest = "[9223372036854775806,{\"d\":1}]";
+  assert(text_op_from_json(&op, biggest, strlen(biggest)) == strlen(biggest));
+  text_op_free(&op);
 }
 
-void benchmark_apply() {
-  printf("Benchmarking apply...\n");
+void apply_checks() {
+  rope *doc = rope_new_with_utf8((uint8_t *)"Hi there");
   
-  long iterations = 20000000;
+  // The second edit runs off the end of the document. Nothing should be applied.
+  text_op_component c[] = {
+    {TEXT_OP_SKIP, .num = 2}, {TEXT_OP_INSERT}, {TEXT_OP_SKIP, .num = 3}, {TEXT_OP_DELETE, .num = 10},
+  };
+  str_init2(&c[1].str, (uint8_t *)"abc");
+  text_op op = text_op_from_components(c, 4);
+  assert(text_op_apply(doc, &op) != 0);
   
-  struct timeval start, end;
+  buffer buf = {};
+  text_op_to_bytes_v2(&op, append, &buf);
+  text_op_view view;
+  assert(text_op_view_init(&view, buf.bytes, buf.num) > 0);
+  assert(text_op_view_apply(doc, &view) != 0);
   
-  // Make the test stable
-  srandom(1234);
+  text_op del = text_op_delete(5, 4);
+  assert(text_op_apply(doc, &del) != 0);
   
-  int doclens[] = {100, 1000, 10000, 100000, 1000000};
+  uint8_t *str = rope_create_cstr(doc);
+  assert(strcmp((char *)str, "Hi there") == 0);
 
-  for (int dl = 0; dl < sizeof(doclens) / sizeof(doclens[0]); dl++) {
-    int doclen = doclens[dl];
-    
-    rope *doc = rope_new();
-    for (int i = 0; i < doclen; i++) {
-      rope_insert(doc, 0, (uint8_t *)"a");
+  // Lengths which wrap around when they're added up.
+  text_op_component wrap1[] = {{TEXT_OP_SKIP, .num = 2}, {TEXT_OP_DELETE, .num = SIZE_MAX}};
+  text_op_component wrap2[] = {
+    {TEXT_OP_INSERT}, {TEXT_OP_SKIP, .num = SIZE_MAX - 1}, {TEXT_OP_DELETE, .num = 1},
+  };
+  str_init2(&wrap2[0].str, (uint8_t *)"x");
+  text_op wrap[] = {text_op_from_components(wrap1, 2), text_op_from_components(wrap2, 3)};
+  const text_document_type *types[] = {&TEXT_DOCUMENT_ROPE, &TEXT_DOCUMENT_FLAT, &TEXT_DOCUMENT_GAP};
+  for (int i = 0; i < 2; i++) {
+    assert(text_op_apply(doc, &wrap[i]) != 0);
+    for (int t = 0; t < 3; t++) {
+      text_document *d = text_document_new(types[t], (uint8_t *)"hello");
+      assert(text_document_apply(d, &wrap[i]) != 0);
+      assert(text_document_char_count(d) == 5);
+      text_document_free(d);
     }
+    text_op_free(&wrap[i]);
+  }
 
-    text_op ops[1000];
-    for (int i = 0; i < 1000; i++) {
-      text_op_component c[2] = {{TEXT_OP_SKIP}};
-      c[0].num = random() % doclen + 1;
-      
-      if (i % 2) {
-        c[1].type = TEXT_OP_INSERT;
-        str_init2(&c[1].str, (uint8_t *)"x");
+  free(str);
+  free(buf.bytes);
+  text_op_free(&op);
+  text_op_free(&del);
+  rope_free(doc);
+}
+
+// A random single insert or delete in a document len characters long.
+static text_op random_small_op(size_t len) {
+  if (len == 0 || random() % 2) {
+    uint8_t buffer[10];
+    random_string_from(buffer, 5 + random() % 5, MIXED_UCHARS,
+        sizeof(MIXED_UCHARS) / sizeof(MIXED_UCHARS[0]));
+    return text_op_insert(random() % (len + 1), buffer);
+  } else {
+    size_t pos = random() % len;
+    return text_op_delete(pos, 1 + random() % (len - pos));
+  }
+}
+
+void op_builder() {
+  srandom(61);
+  
+  for (int i = 0; i < 1000; i++) {
+    // Random components, including empty ones and runs of the same type.
+    text_op_component c[20];
+    text_op_builder builder;
+    text_op_builder_init(&builder, i % 3 ? 20 : 0);
+    size_t n = random() % 20;
+    for (int j = 0; j < n; j++) {
+      c[j].type = (text_op_component_type[]){TEXT_OP_SKIP, TEXT_OP_INSERT, TEXT_OP_DELETE}[random() % 3];
+      if (c[j].type == TEXT_OP_INSERT) {
+        uint8_t buffer[60];
+        random_string_from(buffer, 1 + random() % 59, MIXED_UCHARS,
+            sizeof(MIXED_UCHARS) / sizeof(MIXED_UCHARS[0]));
+        str_init2(&c[j].str, buffer);
+        str s;
+        str_init2(&s, buffer);
+        text_op_builder_insert(&builder, &s);
       } else {
-        c[1].type = TEXT_OP_DELETE;
-        c[1].num = 1;
+        c[j].num = random() % 5;
+        if (c[j].type == TEXT_OP_SKIP) {
+          text_op_builder_skip(&builder, c[j].num);
+        } else {
+          text_op_builder_delete(&builder, c[j].num);
+        }
       }
-      text_op_from_components2(&ops[i], c, 2);
     }
     
-    for (int t = 0; t < 1; t++) {
-      printf("doclen %d run %d\n", doclen, t);
-      gettimeofday(&start, NULL);
-      
-      for (long i = 0; i < iterations; i++) {
-        text_op_apply(doc, &ops[i % 1000]);
+    text_op expected = text_op_from_components(c, n);
+    text_op actual;
+    text_op_builder_finish(&builder, &actual);
+    assert(ops_equal(&expected, &actual));
+    assert((expected.components == NULL) == (actual.components == NULL));
+    text_op_free(&expected);
+    text_op_free(&actual);
+  }
+}
+
+void small_ops() {
+  srandom(59);
+  
+  for (int i = 0; i < 10000; i++) {
+    rope *doc = rope_new_with_utf8((uint8_t *)"Hi there¥½ Δ𐆐!");
+    size_t len = rope_char_count(doc);
+    text_op a = random_small_op(len);
+    text_op b = random_small_op(len);
+    
+    // Transforming gives the same result as the general code (which views always use), and the
+    // results converge.
+    text_op a_, b_;
+    for (int left = 0; left < 2; left++) {
+      text_op_transform2(&a_, &a, &b, left);
+      buffer buf = {};
+      text_op_to_bytes(&b, append, &buf);
+      text_op_view view;
+      assert(text_op_view_init(&view, buf.bytes, buf.num) == buf.num);
+      text_op expected;
+      text_op_transform_view2(&expected, &a, &view, left);
+      assert(ops_equal(&a_, &expected));
+      text_op_free(&expected);
+      free(buf.bytes);
+      if (!left) {
+        text_op_free(&a_);
       }
-      
-      gettimeofday(&end, NULL);
-      
-      double elapsedTime = end.tv_sec - start.tv_sec;
-      elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
-      printf("%ld iterations in %f ms: %f Miter/sec\n",
-             iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000);
     }
+    text_op_transform2(&b_, &b, &a, false);
+    rope *doc_a = rope_copy(doc), *doc_b = rope_copy(doc);
+    assert(text_op_apply(doc_a, &a) == 0 && text_op_apply(doc_a, &b_) == 0);
+    assert(text_op_apply(doc_b, &b) == 0 && text_op_apply(doc_b, &a_) == 0);
+    uint8_t *str_a = rope_create_cstr(doc_a), *str_b = rope_create_cstr(doc_b);
+    assert(strcmp((char *)str_a, (char *)str_b) == 0);
+    free(str_a);
+    free(str_b);
     
-    for (unsigned int i = 0; i < 1000; i++) {
-      text_op_free(&ops[i]);
-    }
+    // Composing a with an edit near it has the same effect as applying them one after the other.
+    rope_free(doc_a);
+    doc_a = rope_copy(doc);
+    text_op_apply(doc_a, &a);
+    text_op next = random_small_op(rope_char_count(doc_a));
+    text_op_apply(doc_a, &next);
+    text_op composed = text_op_compose(&a, &next);
+    text_op_apply(doc, &composed);
+    str_a = rope_create_cstr(doc_a);
+    str_b = rope_create_cstr(doc);
+    assert(strcmp((char *)str_a, (char *)str_b) == 0);
+    free(str_a);
+    free(str_b);
+    
+    text_op_free(&a);
+    text_op_free(&b);
+    text_op_free(&a_);
+    text_op_free(&b_);
+    text_op_free(&next);
+    text_op_free(&composed);
     rope_free(doc);
+    rope_free(doc_a);
+    rope_free(doc_b);
   }
-}
-
-void benchmark_transform() {
-  printf("Benchmarking transform...\n");
   
-  long iterations = 200000000;
-  
-  struct timeval start, end;
+  // Typing and backspacing compose without turning into big ops.
+  text_op typed = text_op_insert(5, (uint8_t *)"a");
+  size_t end = 6;
+  for (int i = 0; i < 40; i++) {
+    text_op key = i % 4 == 3 ? text_op_delete(--end, 1) : text_op_insert(end++, (uint8_t *)"b");
+    text_op composed = text_op_compose(&typed, &key);
+    assert(composed.components == NULL);
+    text_op_free(&typed);
+    text_op_free(&key);
+    typed = composed;
+  }
+  text_op_free(&typed);
   
-  // Make the test stable
-  srandom(1234);
+  text_op backspaces = text_op_delete(20, 1);
+  for (int i = 19; i > 10; i--) {
+    text_op key = text_op_delete(i, 1);
+    text_op composed = text_op_compose(&backspaces, &key);
+    assert(composed.components == NULL && composed.skip == i && composed.content.num == 21 - i);
+    text_op_free(&backspaces);
+    text_op_free(&key);
+    backspaces = composed;
+  }
+  text_op_free(&backspaces);
+}
+
+void transform_x() {
+  srandom(13);
+  rope *doc = rope_new_with_utf8((uint8_t *)"Hi there!! OMG strings rock.");
   
-  int doclen = 10000;
+  for (int i = 0; i < 100000; i++) {
+    text_op a = random_op(doc);
+    text_op b = random_op(doc);
+    
+    text_op a_ = text_op_transform(&a, &b, true);
+    text_op b_ = text_op_transform(&b, &a, false);
+    
+    text_op x_a, x_b;
+    text_op_transform_x(&x_a, &x_b, &a, &b);
+    assert(ops_equal(&a_, &x_a));
+    assert(ops_equal(&b_, &x_b));
+    
+    text_op_apply(doc, &a);
+    
+    text_op_free(&a);
+    text_op_free(&b);
+    text_op_free(&a_);
+    text_op_free(&b_);
+    text_op_free(&x_a);
+    text_op_free(&x_b);
+  }
+  rope_free(doc);
+}
+
+void transform_many() {
+  srandom(17);
   
-  text_op ops[1000];
   for (int i = 0; i < 1000; i++) {
-    text_op_component c[2] = {{TEXT_OP_SKIP}};
-    c[0].num = random() % doclen + 1;
+    rope *doc = rope_new_with_utf8((uint8_t *)"Hi there!! OMG strings rock.");
+    text_op op = random_op(doc);
+    
+    // A run of ops which happened concurrently with op.
+    size_t n = random() % 20;
+    text_op others[20];
+    for (int j = 0; j < n; j++) {
+      others[j] = random_op(doc);
+      text_op_apply(doc, &others[j]);
+    }
+    
+    for (int left = 0; left < 2; left++) {
+      text_op expected = text_op_clone(&op);
+      for (int j = 0; j < n; j++) {
+        text_op next = text_op_transform(&expected, &others[j], left);
+        text_op_free(&expected);
+        expected = next;
+      }
+      
+      text_op actual;
+      text_op_transform_many(&actual, &op, others, n, left);
+      assert(ops_equal(&expected, &actual));
+      assert(text_op_check(doc, &actual) == 0);
+      
+      text_op_free(&expected);
+      text_op_free(&actual);
+    }
+    
+    for (int j = 0; j < n; j++) {
+      text_op_free(&others[j]);
+    }
+    text_op_free(&op);
+    rope_free(doc);
+  }
+}
+
+void compose_many() {
+  srandom(19);
+  
+  for (int i = 0; i < 100; i++) {
+    rope *doc = rope_new_with_utf8((uint8_t *)"Hi there!! OMG strings rock.");
+    rope *start = rope_copy(doc);
+    
+    size_t n = random() % 600;
+    text_op *ops = malloc(sizeof(text_op) * n);
+    for (int j = 0; j < n; j++) {
+      ops[j] = random_op(doc);
+      text_op_apply(doc, &ops[j]);
+    }
+    
+    text_op composed, composed_threaded;
+    text_op_compose_many(&composed, ops, n);
+    // Silly thread counts are capped.
+    text_op_compose_many_threaded(&composed_threaded, ops, n, i % 2 ? 4 : SIZE_MAX);
+    assert(ops_equal(&composed, &composed_threaded));
+    
+    assert(text_op_check(start, &composed) == 0);
+    text_op_apply(start, &composed);
+    uint8_t *expected = rope_create_cstr(doc);
+    uint8_t *actual = rope_create_cstr(start);
+    assert(strcmp((char *)expected, (char *)actual) == 0);
+    
+    free(expected);
+    free(actual);
+    text_op_free(&composed);
+    text_op_free(&composed_threaded);
+    for (int j = 0; j < n; j++) {
+      text_op_free(&ops[j]);
+    }
+    free(ops);
+    rope_free(doc);
+    rope_free(start);
+  }
+}
+
+// A history of typing. Mostly single character inserts, with the odd delete, moving around the
+// document now and then. doclen is the starting length of the document.
+static text_op *typing_history(size_t n, size_t doclen) {
+  text_op *ops = malloc(sizeof(text_op) * n);
+  size_t pos = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (random() % 50 == 0) {
+      pos = random() % doclen;
+    }
+    if (random() % 10 == 0 && pos > 0) {
+      ops[i] = text_op_delete(--pos, 1);
+      doclen--;
+    } else {
+      ops[i] = text_op_insert(pos++, (uint8_t *)"x");
+      doclen++;
+    }
+  }
+  return ops;
+}
+
+void apply_many() {
+  srandom(31);
+  
+  for (int i = 0; i < 100; i++) {
+    rope *doc = rope_new_with_utf8((uint8_t *)"Hi there!! OMG strings rock.");
+    rope *start = rope_copy(doc);
+    
+    // Alternate between random ops all over the document and a history of typing.
+    size_t n = random() % 300;
+    text_op *ops;
+    if (i % 2) {
+      ops = malloc(sizeof(text_op) * n);
+      for (int j = 0; j < n; j++) {
+        ops[j] = random_op(doc);
+        text_op_apply(doc, &ops[j]);
+      }
+    } else {
+      ops = typing_history(n, rope_char_count(doc));
+      for (int j = 0; j < n; j++) {
+        assert(text_op_apply(doc, &ops[j]) == 0);
+      }
+    }
+    
+    assert(text_op_apply_many(start, ops, n) == 0);
+    uint8_t *expected = rope_create_cstr(doc);
+    uint8_t *actual = rope_create_cstr(start);
+    assert(strcmp((char *)expected, (char *)actual) == 0);
+    
+    // If one of the ops can't be applied, none of them are.
+    if (n > 0) {
+      text_op_free(&ops[n - 1]);
+      ops[n - 1] = text_op_delete(0, 1000000);
+      rope *fresh = rope_new_with_utf8((uint8_t *)"Hi there!! OMG strings rock.");
+      assert(text_op_apply_many(fresh, ops, n) != 0);
+      uint8_t *after = rope_create_cstr(fresh);
+      assert(strcmp("Hi there!! OMG strings rock.", (char *)after) == 0);
+      free(after);
+      rope_free(fresh);
+    }
+    
+    free(expected);
+    free(actual);
+    for (int j = 0; j < n; j++) {
+      text_op_free(&ops[j]);
+    }
+    free(ops);
+    rope_free(doc);
+    rope_free(start);
+  }
+}
+
+void sliced_paste() {
+  srandom(29);
+  
+  // A big paste of mixed text, followed by an edit which punches lots of holes in it.
+  size_t size = 20000;
+  uint8_t *content = malloc(size);
+  random_string_from(content, size, MIXED_UCHARS, sizeof(MIXED_UCHARS) / sizeof(MIXED_UCHARS[0]));
+  size_t len = strlen_utf8(content);
+  text_op paste = text_op_insert(3, content);
+  
+  size_t max_components = len / 20 * 2 + 2;
+  text_op_component *c = malloc(sizeof(text_op_component) * max_components);
+  size_t n = 0;
+  for (size_t pos = 0; pos + 21 < len; pos += 21) {
+    c[n++] = (text_op_component){TEXT_OP_SKIP, .num = pos == 0 ? 23 : 20};
+    c[n++] = (text_op_component){TEXT_OP_DELETE, .num = 1};
+  }
+  text_op edit = text_op_from_components(c, n);
+  
+  rope *doc = rope_new_with_utf8((uint8_t *)"Hi there");
+  rope *expected = rope_copy(doc);
+  text_op_apply(expected, &paste);
+  text_op_apply(expected, &edit);
+  
+  text_op composed = text_op_compose(&paste, &edit);
+  text_op_apply(doc, &composed);
+  uint8_t *expected_str = rope_create_cstr(expected);
+  uint8_t *actual_str = rope_create_cstr(doc);
+  assert(strcmp((char *)expected_str, (char *)actual_str) == 0);
+  
+  // Transforming the paste doesn't copy it. The pieces of it which move past the edit point
+  // straight into the paste's string.
+  text_op transformed = text_op_transform(&edit, &paste, false);
+  text_op transformed_paste = text_op_transform(&paste, &edit, true);
+  assert(transformed_paste.content.str.buf == paste.content.str.buf);
+  
+  // Cutting the end off the paste leaves a slice of it, which isn't \0 terminated. Check it
+  // still serializes and applies properly.
+  text_op piece_edit = text_op_delete(103, len - 100);
+  text_op piece = text_op_compose(&paste, &piece_edit);
+  assert(piece.content.str.buf == paste.content.str.buf);
+  assert(!str_is_terminated(&piece.content.str));
+  assert(str_num_chars(&piece.content.str) == 100);
+  
+  buffer buf = {};
+  text_op_to_bytes(&piece, append, &buf);
+  text_op copy;
+  assert(text_op_from_bytes(&copy, buf.bytes, buf.num) == buf.num);
+  assert(ops_equal(&piece, &copy));
+  
+  rope *piece_doc = rope_new_with_utf8((uint8_t *)"Hi there");
+  text_op_apply(piece_doc, &piece);
+  assert(rope_char_count(piece_doc) == 108);
+  
+  text_op_free(&paste);
+  text_op_free(&edit);
+  text_op_free(&composed);
+  text_op_free(&transformed);
+  text_op_free(&transformed_paste);
+  text_op_free(&piece_edit);
+  text_op_free(&piece);
+  text_op_free(&copy);
+  free(buf.bytes);
+  free(expected_str);
+  free(actual_str);
+  free(content);
+  free(c);
+  rope_free(doc);
+  rope_free(expected);
+  rope_free(piece_doc);
+}
+
+void document_backends() {
+  srandom(37);
+  
+  const text_document_type *types[] = {&TEXT_DOCUMENT_ROPE, &TEXT_DOCUMENT_FLAT, &TEXT_DOCUMENT_GAP};
+  const size_t num_types = sizeof(types) / sizeof(types[0]);
+  
+  for (int i = 0; i < 100; i++) {
+    uint8_t content[200];
+    random_string_from(content, 1 + random() % 200, MIXED_UCHARS,
+        sizeof(MIXED_UCHARS) / sizeof(MIXED_UCHARS[0]));
+    rope *expected = rope_new_with_utf8(content);
+    text_document *docs[num_types];
+    for (int t = 0; t < num_types; t++) {
+      docs[t] = text_document_new(types[t], content);
+    }
+    
+    for (int j = 0; j < 50; j++) {
+      // Mix single edits (some of them non-ASCII) in with bigger random ops, and composed ops
+      // with inserts which are slices of longer strings.
+      text_op op;
+      if (j % 3 == 0) {
+        op = text_op_insert(random() % (rope_char_count(expected) + 1), (uint8_t *)"½¥𐆐x");
+      } else if (j % 3 == 1) {
+        op = random_op(expected);
+      } else {
+        rope *tmp = rope_copy(expected);
+        text_op a = random_op(tmp);
+        text_op_apply(tmp, &a);
+        text_op b = random_op(tmp);
+        op = text_op_compose(&a, &b);
+        text_op_free(&a);
+        text_op_free(&b);
+        rope_free(tmp);
+      }
+      assert(text_op_apply(expected, &op) == 0);
+      uint8_t *expected_str = rope_create_cstr(expected);
+      
+      for (int t = 0; t < num_types; t++) {
+        assert(text_document_apply(docs[t], &op) == 0);
+        assert(text_document_char_count(docs[t]) == rope_char_count(expected));
+        uint8_t *actual_str = text_document_create_cstr(docs[t]);
+        assert(strcmp((char *)expected_str, (char *)actual_str) == 0);
+        free(actual_str);
+      }
+      free(expected_str);
+      text_op_free(&op);
+    }
+    
+    // Invalid ops are rejected and leave the document alone.
+    text_op bad = text_op_delete(1, rope_char_count(expected) + 1);
+    uint8_t *expected_str = rope_create_cstr(expected);
+    for (int t = 0; t < num_types; t++) {
+      assert(text_document_check(docs[t], &bad) != 0);
+      assert(text_document_apply(docs[t], &bad) != 0);
+      uint8_t *actual_str = text_document_create_cstr(docs[t]);
+      assert(strcmp((char *)expected_str, (char *)actual_str) == 0);
+      free(actual_str);
+      text_document_free(docs[t]);
+    }
+    free(expected_str);
+    text_op_free(&bad);
+    rope_free(expected);
+  }
+}
+
+void invert_ops() {
+  srandom(41);
+  
+  for (int i = 0; i < 1000; i++) {
+    uint8_t content[200];
+    random_string_from(content, 1 + random() % 200, MIXED_UCHARS,
+        sizeof(MIXED_UCHARS) / sizeof(MIXED_UCHARS[0]));
+    rope *doc = rope_new_with_utf8(content);
+    
+    // Ops which delete lots of text at once (spanning several rope nodes).
+    text_op op;
+    if (i % 2) {
+      op = random_op(doc);
+    } else {
+      rope *tmp = rope_copy(doc);
+      text_op a = random_op(tmp);
+      text_op_apply(tmp, &a);
+      text_op b = random_op(tmp);
+      op = text_op_compose(&a, &b);
+      text_op_free(&a);
+      text_op_free(&b);
+      rope_free(tmp);
+    }
+    
+    text_op expected_inverse = text_op_invert(&op, doc);
+    text_op inverse;
+    assert(text_op_apply_invertible(doc, &op, &inverse) == 0);
+    assert(ops_equal(&inverse, &expected_inverse));
+    
+    assert(text_op_apply(doc, &inverse) == 0);
+    uint8_t *result = rope_create_cstr(doc);
+    assert(strcmp((char *)content, (char *)result) == 0);
+    free(result);
+    
+    text_op_free(&op);
+    text_op_free(&inverse);
+    text_op_free(&expected_inverse);
+    rope_free(doc);
+  }
+  
+  // Invalid ops aren't applied.
+  rope *doc = rope_new_with_utf8((uint8_t *)"hi");
+  text_op bad = text_op_delete(1, 5);
+  text_op inverse;
+  assert(text_op_apply_invertible(doc, &bad, &inverse) != 0);
+  assert(rope_char_count(doc) == 2);
+  rope_free(doc);
+}
+
+void undo_stack() {
+  srandom(43);
+  
+  for (int i = 0; i < 100; i++) {
+    const uint8_t *start = (uint8_t *)"Hi there!! OMG strings rock.";
+    rope *doc = rope_new_with_utf8(start);
+    
+    // A small stack, so old entries get composed together.
+    ot_text_undo undo;
+    ot_text_undo_init(&undo, 1 + i % 8);
+    size_t n = random() % 30;
+    for (int j = 0; j < n; j++) {
+      text_op op = random_op(doc);
+      text_op inverse;
+      assert(text_op_apply_invertible(doc, &op, &inverse) == 0);
+      ot_text_undo_push(&undo, &inverse);
+      text_op_free(&op);
+    }
+    uint8_t *edited = rope_create_cstr(doc);
+    
+    // Undoing everything gets back to where we started, and redoing it all gets back again.
+    text_op applied;
+    while (ot_text_undo_undo(&undo, doc, &applied) == 0) {
+      text_op_free(&applied);
+    }
+    uint8_t *str = rope_create_cstr(doc);
+    assert(strcmp((char *)start, (char *)str) == 0);
+    free(str);
+    
+    while (ot_text_undo_redo(&undo, doc, &applied) == 0) {
+      text_op_free(&applied);
+    }
+    str = rope_create_cstr(doc);
+    assert(strcmp((char *)edited, (char *)str) == 0);
+    free(str);
+    free(edited);
+    
+    // Edits from someone else stay put when we undo ours.
+    text_op mine = text_op_insert(0, (uint8_t *)"mine ");
+    text_op inverse;
+    assert(text_op_apply_invertible(doc, &mine, &inverse) == 0);
+    ot_text_undo_push(&undo, &inverse);
+    text_op_free(&mine);
+    
+    size_t len = rope_char_count(doc);
+    text_op theirs = text_op_insert(len, (uint8_t *)" theirs");
+    assert(text_op_apply(doc, &theirs) == 0);
+    ot_text_undo_remote_op(&undo, &theirs);
+    text_op_free(&theirs);
+    
+    assert(ot_text_undo_undo(&undo, doc, &applied) == 0);
+    text_op_free(&applied);
+    str = rope_create_cstr(doc);
+    size_t str_len = strlen((char *)str);
+    assert(strncmp((char *)str, "mine ", 5) != 0);
+    assert(str_len >= 7 && strcmp((char *)str + str_len - 7, " theirs") == 0);
+    free(str);
+    
+    ot_text_undo_destroy(&undo);
+    rope_free(doc);
+  }
+  
+  // If the document changes behind the stack's back, the edit can't be undone. It stays on the
+  // stack rather than being lost.
+  rope *doc = rope_new_with_utf8((uint8_t *)"Hi there");
+  ot_text_undo undo;
+  ot_text_undo_init(&undo, 4);
+  text_op mine = text_op_insert(8, (uint8_t *)" you");
+  text_op inverse, applied;
+  assert(text_op_apply_invertible(doc, &mine, &inverse) == 0);
+  ot_text_undo_push(&undo, &inverse);
+  text_op_free(&mine);
+  
+  text_op drift = text_op_delete(0, 10);
+  assert(text_op_apply(doc, &drift) == 0);
+  text_op_free(&drift);
+  assert(ot_text_undo_undo(&undo, doc, &applied) < 0);
+  assert(undo.num_undo == 1 && undo.num_redo == 0);
+  assert(rope_char_count(doc) == 2);
+  
+  // Once the document is back in step, the edit can be undone.
+  text_op fix = text_op_insert(0, (uint8_t *)"Hi there y");
+  assert(text_op_apply(doc, &fix) == 0);
+  text_op_free(&fix);
+  assert(ot_text_undo_undo(&undo, doc, &applied) == 0);
+  text_op_free(&applied);
+  uint8_t *str = rope_create_cstr(doc);
+  assert(strcmp((char *)str, "Hi there") == 0);
+  free(str);
+  assert(ot_text_undo_undo(&undo, doc, &applied) == 1);
+  
+  ot_text_undo_destroy(&undo);
+  rope_free(doc);
+}
+
+typedef struct {
+  text_op op;
+  rope *doc;
+} clone_job;
+
+static void *apply_and_free_clone(void *job_) {
+  clone_job *job = job_;
+  text_op_apply(job->doc, &job->op);
+  text_op_free(&job->op);
+  return NULL;
+}
+
+void shared_clones() {
+  uint8_t long_str[100];
+  memset(long_str, 'x', sizeof(long_str) - 1);
+  long_str[sizeof(long_str) - 1] = '\0';
+  
+  text_op_component c[] = {
+    {TEXT_OP_SKIP, .num = 3}, {TEXT_OP_INSERT}, {TEXT_OP_SKIP, .num = 2}, {TEXT_OP_DELETE, .num = 4},
+  };
+  str_init2(&c[1].str, long_str);
+  text_op op = text_op_from_components(c, 4);
+  
+  rope *doc = rope_new_with_utf8((uint8_t *)"Hi there!! OMG strings rock.");
+  rope *expected = rope_copy(doc);
+  text_op_apply(expected, &op);
+  uint8_t *expected_str = rope_create_cstr(expected);
+  
+  // Clones share the original's components.
+  text_op clone = text_op_clone(&op);
+  assert(clone.components == op.components);
+  
+  // Until one of them needs to change.
+  text_op mutable = text_op_clone(&op);
+  text_op_make_mutable(&mutable);
+  assert(mutable.components != op.components);
+  assert(ops_equal(&mutable, &op));
+  mutable.components[0].num = 4;
+  assert(op.components[0].num == 3);
+  text_op_free(&mutable);
+  
+  // Making an op which isn't shared mutable doesn't copy anything.
+  text_op_make_mutable(&clone);
+  text_op_free(&op);
+  text_op_component *components = clone.components;
+  text_op_make_mutable(&clone);
+  assert(clone.components == components);
+  
+  // Hand clones out to a bunch of threads, and let them race to free them.
+  const int num_threads = 8;
+  clone_job jobs[num_threads];
+  pthread_t threads[num_threads];
+  for (int i = 0; i < num_threads; i++) {
+    jobs[i].op = text_op_clone(&clone);
+    jobs[i].doc = rope_copy(doc);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i], NULL, apply_and_free_clone, &jobs[i]);
+  }
+  text_op_free(&clone);
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+    uint8_t *str = rope_create_cstr(jobs[i].doc);
+    assert(strcmp((char *)str, (char *)expected_str) == 0);
+    free(str);
+    rope_free(jobs[i].doc);
+  }
+  
+  // Ops in an arena can't be shared. Cloning them makes a real copy.
+  text_op_arena arena;
+  text_op_arena_init(&arena, 0);
+  text_op arena_op;
+  // [3, "hi", 1, {DELETE 1}] in the v1 encoding.
+  uint8_t bytes[] = {1, 3, 0, 0, 0, 3, 'h', 'i', 0, 1, 1, 0, 0, 0, 4, 1, 0, 0, 0, 0};
+  assert(text_op_from_bytes_arena(&arena_op, bytes, sizeof(bytes), &arena) == sizeof(bytes));
+  text_op arena_clone = text_op_clone(&arena_op);
+  assert(arena_clone.components != arena_op.components);
+  text_op_arena_destroy(&arena);
+  rope *arena_doc = rope_new_with_utf8((uint8_t *)"abcdef");
+  text_op_apply(arena_doc, &arena_clone);
+  uint8_t *arena_str = rope_create_cstr(arena_doc);
+  assert(strcmp((char *)arena_str, "abchidf") == 0);
+  
+  free(arena_str);
+  text_op_free(&arena_clone);
+  rope_free(arena_doc);
+  free(expected_str);
+  rope_free(expected);
+  rope_free(doc);
+}
+
+void doc_submit() {
+  srandom(23);
+  ot_text_doc *doc = ot_text_doc_new((uint8_t *)"Hi there!! OMG strings rock.", 1 << 20);
+  
+  // The document's content at every version, so we can make ops against old versions.
+  uint8_t *snapshots[2001];
+  snapshots[0] = rope_create_cstr(doc->content);
+  
+  for (int i = 0; i < 2000; i++) {
+    size_t version = doc->version;
+    size_t base = version - random() % (version < 10 ? version + 1 : 10);
+    
+    rope *client_doc = rope_new_with_utf8(snapshots[base]);
+    text_op op = random_op(client_doc);
+    rope_free(client_doc);
+    
+    text_op applied;
+    assert(ot_text_doc_submit(doc, &op, base, &applied) == version + 1);
+    assert(doc->version == version + 1);
+    assert(ops_equal(&applied, (text_op *)ot_text_doc_op_at(doc, version)));
+    snapshots[version + 1] = rope_create_cstr(doc->content);
+    
+    text_op_free(&op);
+    text_op_free(&applied);
+  }
+  
+  // An op inserting a short slice of a big paste.
+  size_t big_len = 1 << 20;
+  uint8_t *big = malloc(big_len + 1);
+  memset(big, 'a', big_len);
+  big[big_len] = '\0';
+  str big_str, slice;
+  str_init2(&big_str, big);
+  str_init_slice(&slice, &big_str, 0, 100, 100);
+  text_op_component c = {TEXT_OP_INSERT};
+  str_init_with_copy(&c.str, &slice);
+  str_destroy(&big_str);
+  free(big);
+  text_op pinned = text_op_from_components(&c, 1);
+  
+  // An op too big for the budget pushes everything else out of the history, and leaves nothing
+  // charged.
+  size_t version = doc->version;
+  assert(doc->history_len > 100);
+  assert(ot_text_doc_submit(doc, &pinned, version, NULL) == version + 1);
+  assert(doc->history_len == 0 && doc->history_bytes == 0 && doc->num_charges == 0);
+  
+  // Ops from the future are rejected.
+  text_op op = text_op_insert(0, (uint8_t *)"x");
+  assert(ot_text_doc_submit(doc, &op, doc->version + 1, NULL) < 0);
+  // So are invalid ops.
+  text_op del = text_op_delete(0, rope_char_count(doc->content) + 1);
+  assert(ot_text_doc_submit(doc, &del, doc->version, NULL) < 0);
+  ot_text_doc_free(doc);
+  
+  // With a tiny budget, only the last few ops are kept around.
+  doc = ot_text_doc_new(NULL, 10 * sizeof(text_op));
+  for (int i = 0; i < 100; i++) {
+    assert(ot_text_doc_submit(doc, &op, doc->version, NULL) == i + 1);
+  }
+  assert(doc->history_len <= 10);
+  assert(ot_text_doc_oldest_version(doc) > 0);
+  assert(ot_text_doc_op_at(doc, 0) == NULL);
+  assert(ot_text_doc_submit(doc, &op, 0, NULL) < 0);
+  assert(ot_text_doc_submit(doc, &op, ot_text_doc_oldest_version(doc), NULL) == 101);
+  ot_text_doc_free(doc);
+
+  // It's charged for the whole buffer it keeps alive, not the 100 bytes it uses.
+  doc = ot_text_doc_new(NULL, 1 << 16);
+  assert(ot_text_doc_submit(doc, &pinned, 0, NULL) == 1);
+  assert(doc->history_len == 0 && doc->history_bytes == 0);
+  assert(ot_text_doc_submit(doc, &op, 1, NULL) == 2);
+  assert(doc->history_len == 1 && doc->history_bytes == sizeof(text_op));
+  ot_text_doc_free(doc);
+  text_op_free(&pinned);
+
+  text_op_free(&op);
+  text_op_free(&del);
+  for (int i = 0; i <= 2000; i++) {
+    free(snapshots[i]);
+  }
+}
+
+// A message between the test server and a client.
+typedef struct {
+  bool is_ack;
+  text_op op;
+  size_t version;
+} message;
+
+typedef struct {
+  message *items;
+  size_t head, tail;
+} message_queue;
+
+#define NUM_CLIENTS 3
+
+static void push_message(message_queue *q, bool is_ack, const text_op *op, size_t version) {
+  message *m = &q->items[q->tail++];
+  m->is_ack = is_ack;
+  m->version = version;
+  if (!is_ack) {
+    text_op_clone2(&m->op, (text_op *)op);
+  }
+}
+
+void client_server() {
+  srandom(29);
+  ot_text_doc *server = ot_text_doc_new((uint8_t *)"Hi there!! OMG strings rock.", 1 << 24);
+  
+  rope *docs[NUM_CLIENTS];
+  ot_text_client clients[NUM_CLIENTS];
+  message_queue to_server[NUM_CLIENTS], to_client[NUM_CLIENTS];
+  for (int c = 0; c < NUM_CLIENTS; c++) {
+    docs[c] = rope_copy(server->content);
+    ot_text_client_init(&clients[c], server->version);
+    to_server[c] = (message_queue){malloc(sizeof(message) * 20000)};
+    to_client[c] = (message_queue){malloc(sizeof(message) * 20000)};
+  }
+  
+  int local_ops = 0, sent_ops = 0;
+  for (int step = 0; ; step++) {
+    int c = random() % NUM_CLIENTS;
+    int action = random() % 3;
+    
+    if (step >= 5000) {
+      // Let everything settle.
+      int busy = 0;
+      for (busy = 0; busy < NUM_CLIENTS; busy++) {
+        if (to_server[busy].head < to_server[busy].tail
+            || to_client[busy].head < to_client[busy].tail) break;
+      }
+      if (busy == NUM_CLIENTS) break;
+      if (action == 0) continue;
+    }
+    
+    if (action == 0) {
+      // The user types something.
+      text_op op = random_op(docs[c]);
+      text_op_apply(docs[c], &op);
+      local_ops++;
+      const text_op *send = ot_text_client_local_op(&clients[c], &op);
+      if (send) {
+        push_message(&to_server[c], false, send, clients[c].version);
+        sent_ops++;
+      }
+      text_op_free(&op);
+    } else if (action == 1 && to_server[c].head < to_server[c].tail) {
+      // The server gets an op.
+      message *m = &to_server[c].items[to_server[c].head++];
+      text_op applied;
+      assert(ot_text_doc_submit(server, &m->op, m->version, &applied) > 0);
+      for (int other = 0; other < NUM_CLIENTS; other++) {
+        push_message(&to_client[other], other == c, &applied, server->version);
+      }
+      text_op_free(&applied);
+      text_op_free(&m->op);
+    } else if (action == 2 && to_client[c].head < to_client[c].tail) {
+      // The client hears back from the server.
+      message *m = &to_client[c].items[to_client[c].head++];
+      if (m->is_ack) {
+        const text_op *send = ot_text_client_server_ack(&clients[c]);
+        if (send) {
+          push_message(&to_server[c], false, send, clients[c].version);
+          sent_ops++;
+        }
+      } else {
+        text_op to_apply;
+        ot_text_client_server_op(&clients[c], &m->op, &to_apply);
+        assert(text_op_check(docs[c], &to_apply) == 0);
+        text_op_apply(docs[c], &to_apply);
+        text_op_free(&to_apply);
+        text_op_free(&m->op);
+      }
+      assert(clients[c].version == m->version);
+    }
+  }
+  
+  // Edits made while waiting on the server get bundled together.
+  assert(sent_ops < local_ops);
+  
+  uint8_t *expected = rope_create_cstr(server->content);
+  for (int c = 0; c < NUM_CLIENTS; c++) {
+    assert(clients[c].state == OT_CLIENT_SYNCED);
+    assert(clients[c].version == server->version);
+    uint8_t *actual = rope_create_cstr(docs[c]);
+    assert(strcmp((char *)expected, (char *)actual) == 0);
+    free(actual);
+    
+    ot_text_client_destroy(&clients[c]);
+    rope_free(docs[c]);
+    free(to_server[c].items);
+    free(to_client[c].items);
+  }
+  free(expected);
+  ot_text_doc_free(server);
+}
+
+static void test_cursor(text_op *op, bool is_own,
+                    size_t start, size_t end, size_t e_start, size_t e_end) {
+  text_cursor result = text_op_transform_cursor(text_cursor_make(start, end), op, is_own);
+  assert(result.start == e_start);
+  assert(result.end == e_end);
+}
+
+void transform_cursor() {
+  text_op ins = text_op_insert(10, (uint8_t *)"oh hi");
+  text_op del = text_op_delete(25, 20);
+  text_op op = text_op_compose(&ins, &del);
+  // The op skips 10, inserts 5 characters, skips another 10 then deletes 20 characters.
+  
+#define C(s, e) text_cursor_make(s, e)
+  // A cursor at the start of the inserted text shouldn't move.
+  test_cursor(&op, false, 10, 10, 10, 10);
+  test_cursor(&op, false, 10, 11, 10, 16);
+  
+  // Unless its your cursor.
+  test_cursor(&ins, true, 10, 11, 15, 15);
+  
+  // Any character inside the deleted region should move to the start of the region.
+  test_cursor(&del, false, 25, 40, 25, 25);
+  test_cursor(&del, false, 35, 50, 25, 30);
+  test_cursor(&del, false, 45, 60, 25, 40);
+
+  test_cursor(&del, true, 25, 40, 25, 25);
+  test_cursor(&del, true, 35, 50, 25, 25);
+  test_cursor(&del, true, 45, 60, 25, 25);
+
+  // Cursors before the deleted region are uneffected
+  test_cursor(&del, false, 10, 25, 10, 25);
+  
+  // Cursors past the end of the deleted region get pulled back.
+  test_cursor(&del, false, 55, 60, 35, 40);
+  
+  // Your cursor always teleports to the end of the last insert or the deletion site.
+  test_cursor(&ins, true,   0, 50, 15, 15);
+  test_cursor(&ins, true, 100, 50, 15, 15);
+  test_cursor(&del, true,   0, 50, 25, 25);
+  test_cursor(&del, true, 100, 50, 25, 25);
+
+  // More complicated cases
+  test_cursor(&op, false, 0, 5, 0, 5);
+  test_cursor(&op, false, 100, 5, 85, 5);
+  test_cursor(&op, false, 10, 5, 10, 5);
+  test_cursor(&op, false, 11, 5, 16, 5);
+
+  test_cursor(&op, false, 20, 5, 25, 5);
+  test_cursor(&op, false, 30, 5, 25, 5);
+  test_cursor(&op, false, 40, 5, 25, 5);
+  test_cursor(&op, false, 41, 5, 26, 5);
+
+  test_cursor(&op, true, 0, 100, 25, 25);
+#undef C
+
+  text_op_free(&ins);
+  text_op_free(&del);
+  text_op_free(&op);
+}
+
+// Something like a find and replace over a document doclen characters long: every 10th character
+// is replaced.
+static text_op find_and_replace_op(size_t doclen) {
+  size_t n = 0;
+  text_op_component *c = malloc(sizeof(text_op_component) * (doclen / 10 * 3 + 1));
+  for (size_t pos = 0; pos + 10 <= doclen; pos += 10) {
+    c[n++] = (text_op_component){TEXT_OP_SKIP, .num = 9};
+    c[n++] = (text_op_component){TEXT_OP_DELETE, .num = 1};
+    c[n].type = TEXT_OP_INSERT;
+    str_init2(&c[n++].str, (uint8_t *)"xy");
+  }
+  text_op op = text_op_from_components(c, n);
+  free(c);
+  return op;
+}
+
+void indexed_ops() {
+  srandom(53);
+  
+  size_t doclen = 5000;
+  text_op big = find_and_replace_op(doclen);
+  text_op indexed = find_and_replace_op(doclen);
+  text_op_build_index(&indexed);
+  
+  uint8_t *content = malloc(doclen + 1);
+  memset(content, 'a', doclen);
+  content[doclen] = '\0';
+  rope *doc = rope_new_with_utf8(content);
+  free(content);
+  
+  for (int i = 0; i < 1000; i++) {
+    // Transforming by the indexed op gives the same results.
+    text_op op = i % 2 ? random_op(doc) : text_op_insert(random() % (doclen + 1), (uint8_t *)"hi");
+    for (int left = 0; left < 2; left++) {
+      text_op expected = text_op_transform(&op, &big, left);
+      text_op actual = text_op_transform(&op, &indexed, left);
+      assert(ops_equal(&expected, &actual));
+      text_op_free(&expected);
+      text_op_free(&actual);
+    }
+    text_op_free(&op);
+    
+    text_cursor cursor = text_cursor_make(random() % (doclen + 1), random() % (doclen + 1));
+    text_cursor expected = text_op_transform_cursor(cursor, &big, false);
+    text_cursor actual = text_op_transform_cursor(cursor, &indexed, false);
+    assert(expected.start == actual.start && expected.end == actual.end);
+  }
+  
+  // Clones share the index, and making an op mutable drops it.
+  text_op clone = text_op_clone(&indexed);
+  text_op_make_mutable(&clone);
+  text_op_free(&clone);
+  text_op_make_mutable(&indexed);
+  text_op_free(&indexed);
+  
+  text_op_free(&big);
+  rope_free(doc);
+}
+
+static int compare_cursors(const void *a, const void *b) {
+  size_t x = ((const text_cursor *)a)->start, y = ((const text_cursor *)b)->start;
+  return x < y ? -1 : x > y;
+}
+
+void transform_cursors() {
+  srandom(47);
+  
+  for (int i = 0; i < 1000; i++) {
+    rope *doc = rope_new_with_utf8((uint8_t *)"Hi there!! OMG strings rock. Lots and lots of text.");
+    text_op a = random_op(doc);
+    text_op_apply(doc, &a);
+    text_op b = random_op(doc);
+    text_op op = text_op_compose(&a, &b);
+    text_op_free(&a);
+    text_op_free(&b);
+    rope_free(doc);
+    
+    // Cursors all over the original document, including collapsed ones and ones at the very end.
+    size_t len = 51;
+    text_cursor cursors[50], expected[50];
+    size_t n = random() % 50;
+    for (int c = 0; c < n; c++) {
+      size_t start = random() % (len + 1);
+      size_t end = random() % 3 ? start : random() % (len + 1);
+      cursors[c] = text_cursor_make(start, end);
+    }
+    // Most of the time they're sorted, but any order works.
+    if (i % 4) {
+      qsort(cursors, n, sizeof(text_cursor), compare_cursors);
+    }
+    
+    for (int c = 0; c < n; c++) {
+      expected[c] = text_op_transform_cursor(cursors[c], &op, false);
+    }
+    text_op_transform_cursors(cursors, n, &op);
+    for (int c = 0; c < n; c++) {
+      assert(cursors[c].start == expected[c].start && cursors[c].end == expected[c].end);
+    }
+    text_op_free(&op);
+  }
+}
+
+void utf8_scan() {
+  srandom(4321);
+  
+  uint8_t buffer[300];
+  for (int i = 0; i < 500; i++) {
+    // Start the string at different alignments to hit all the edge cases in the vector code.
+    size_t offset = random() % 64;
+    uint8_t *str = buffer + offset;
+    random_string_from(str, random() % (sizeof(buffer) - offset) + 1, MIXED_UCHARS,
+        sizeof(MIXED_UCHARS) / sizeof(MIXED_UCHARS[0]));
+    
+    size_t len = 0;
+    for (uint8_t *p = str; *p; p++) {
+      if ((*p & 0xc0) != 0x80) len++;
+    }
+    assert(strlen_utf8(str) == len);
+    
+    // Counting past the end of the string stops at the \0.
+    uint8_t *p = str;
+    for (size_t n = 0; n <= len + 2; n++) {
+      assert(count_utf8_chars(str, n) == p);
+      if (*p) {
+        do { p++; } while ((*p & 0xc0) == 0x80);
+      }
+    }
+  }
+}
+
+// Convert a character position in doc to UTF-16 units.
+static size_t utf16_pos(rope *doc, size_t pos) {
+  uint8_t *content = rope_create_cstr(doc);
+  str s;
+  str_init2(&s, content);
+  size_t units = str_chars_to_utf16(&s, pos);
+  str_destroy(&s);
+  free(content);
+  return units;
+}
+
+void utf16_positions() {
+  // 𐆐 is outside the BMP, so it takes 2 UTF-16 units.
+  str s;
+  str_init2(&s, (uint8_t *)"a𐆐b");
+  assert(str_num_utf16(&s) == 4);
+  assert(str_chars_to_utf16(&s, 2) == 3);
+  assert(str_chars_to_utf16(&s, 10) == 4);
+  assert(str_utf16_to_chars(&s, 1) == 1);
+  assert(str_utf16_to_chars(&s, 2) == 1); // Rounded down out of the surrogate pair.
+  assert(str_utf16_to_chars(&s, 3) == 2);
+  assert(str_utf16_to_chars(&s, 10) == 3);
+  str_destroy(&s);
+  
+  rope *doc = rope_new_with_utf8((uint8_t *)"a𐆐b");
+  text_op bad = text_op_insert(2, (uint8_t *)"x");
+  text_op converted;
+  assert(text_op_from_utf16(&converted, &bad, doc) != 0);
+  assert(text_op_apply_utf16(doc, &bad) != 0);
+  text_op past_end = text_op_delete(3, 2);
+  assert(text_op_apply_utf16(doc, &past_end) != 0);
+  text_op ins = text_op_insert(3, (uint8_t *)"x");
+  assert(text_op_apply_utf16(doc, &ins) == 0);
+  uint8_t *content = rope_create_cstr(doc);
+  assert(strcmp((char *)content, "a𐆐xb") == 0);
+  free(content);
+  text_op_free(&bad);
+  text_op_free(&past_end);
+  text_op_free(&ins);
+  rope_free(doc);
+  
+  // UTF-16 ops should do the same thing as the character ops they're converted from.
+  const size_t num_uchars = sizeof(MIXED_UCHARS) / sizeof(MIXED_UCHARS[0]);
+  srandom(16);
+  for (int i = 0; i < 2000; i++) {
+    uint8_t buffer[600];
+    // Every few documents is plain ascii, which skips the conversion.
+    random_string_from(buffer, 1 + random() % sizeof(buffer), MIXED_UCHARS,
+        i % 4 ? num_uchars : 5);
+    rope *doc = rope_new_with_utf8(buffer);
+    text_op a = random_op_from(doc, MIXED_UCHARS, num_uchars);
+    text_op b = random_op_from(doc, MIXED_UCHARS, num_uchars);
+    
+    text_op ua, ub, back;
+    assert(text_op_to_utf16(&ua, &a, doc) == 0);
+    assert(text_op_to_utf16(&ub, &b, doc) == 0);
+    assert(text_op_from_utf16(&back, &ua, doc) == 0);
+    assert(ops_equal(&back, &a));
+    text_op_free(&back);
+    
+    size_t cursor = random() % (rope_char_count(doc) + 1);
+    text_cursor uc = text_cursor_make(utf16_pos(doc, cursor), utf16_pos(doc, cursor));
+    
+    rope *doc_b = rope_copy(doc);
+    assert(text_op_apply_utf16(doc_b, &ub) == 0);
+    assert(text_op_apply(doc, &b) == 0);
+    uint8_t *expected = rope_create_cstr(doc), *actual = rope_create_cstr(doc_b);
+    assert(strcmp((char *)expected, (char *)actual) == 0);
+    free(expected);
+    free(actual);
+    rope_free(doc_b);
+    
+    // doc has had b applied. Transforming in UTF-16 and converting afterwards should give the same
+    // op as converting the transformed op.
+    text_op a_ = text_op_transform(&a, &b, i % 2);
+    text_op ua_, expected_ua_;
+    text_op_transform_utf16(&ua_, &ua, &ub, i % 2);
+    assert(text_op_to_utf16(&expected_ua_, &a_, doc) == 0);
+    assert(ops_equal(&ua_, &expected_ua_));
+    
+    text_cursor c = text_op_transform_cursor(text_cursor_make(cursor, cursor), &b, false);
+    uc = text_op_transform_cursor_utf16(uc, &ub, false);
+    assert(uc.start == utf16_pos(doc, c.start) && uc.end == utf16_pos(doc, c.end));
+    c = text_op_transform_cursor(c, &a_, true);
+    uc = text_op_transform_cursor_utf16(uc, &ua_, true);
+    assert(text_op_apply(doc, &a_) == 0);
+    assert(uc.start == utf16_pos(doc, c.start));
+    
+    text_op_free(&a);
+    text_op_free(&b);
+    text_op_free(&ua);
+    text_op_free(&ub);
+    text_op_free(&a_);
+    text_op_free(&ua_);
+    text_op_free(&expected_ua_);
+    rope_free(doc);
+  }
+}
+
+typedef struct {
+  text_snapshot_head *head;
+  bool done;
+} snapshot_job;
+
+// Keep reading snapshots until the writer is done. Each one should hang together.
+static void *read_snapshots(void *job_) {
+  snapshot_job *job = job_;
+  size_t last_version = 0;
+  while (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+    text_snapshot *s = text_snapshot_head_get(job->head);
+    assert(text_snapshot_version(s) >= last_version);
+    last_version = text_snapshot_version(s);
+    uint8_t *content = text_snapshot_create_cstr(s);
+    assert(strlen((char *)content) == text_snapshot_byte_count(s));
+    assert(strlen_utf8(content) == text_snapshot_char_count(s));
+    free(content);
+    text_snapshot_release(s);
+  }
+  return NULL;
+}
+
+void snapshots() {
+  const size_t num_uchars = sizeof(MIXED_UCHARS) / sizeof(MIXED_UCHARS[0]);
+  srandom(25);
+  
+  uint8_t content[3000];
+  random_string_from(content, sizeof(content), MIXED_UCHARS, num_uchars);
+  rope *doc = rope_new_with_utf8(content);
+  text_snapshot *versions[1000];
+  uint8_t *expected[1000];
+  versions[0] = text_snapshot_new(content);
+  expected[0] = rope_create_cstr(doc);
+  
+  for (int v = 1; v < 1000; v++) {
+    text_op op;
+    if (v % 50 == 0) {
+      // Pastes bigger than a chunk.
+      uint8_t paste[2000];
+      random_string_from(paste, sizeof(paste), MIXED_UCHARS, num_uchars);
+      op = text_op_insert(random() % (rope_char_count(doc) + 1), paste);
+    } else {
+      op = random_op_from(doc, MIXED_UCHARS, num_uchars);
+    }
+    assert(text_op_apply(doc, &op) == 0);
+    versions[v] = text_snapshot_apply(versions[v - 1], &op);
+    assert(versions[v] && text_snapshot_version(versions[v]) == v);
+    expected[v] = rope_create_cstr(doc);
+    text_op_free(&op);
+    
+    // Reading part of the document gives the same characters as the rope.
+    buffer buf = {};
+    size_t len = rope_char_count(doc);
+    size_t pos = random() % (len + 1), num = random() % 300;
+    text_snapshot_read(versions[v], pos, num, append, &buf);
+    uint8_t *start = count_utf8_chars(expected[v], pos);
+    uint8_t *end = count_utf8_chars(start, num);
+    assert(buf.num == end - start);
+    assert(buf.num == 0 || memcmp(buf.bytes, start, buf.num) == 0);
+    free(buf.bytes);
+  }
+  
+  // Every version is still there, unchanged.
+  for (int v = 0; v < 1000; v++) {
+    uint8_t *actual = text_snapshot_create_cstr(versions[v]);
+    assert(strcmp((char *)actual, (char *)expected[v]) == 0);
+    assert(text_snapshot_char_count(versions[v]) == strlen_utf8(expected[v]));
+    free(actual);
+    free(expected[v]);
+    text_snapshot_release(versions[v]);
+  }
+  
+  // Invalid ops don't make a new version.
+  text_snapshot *s = text_snapshot_new((uint8_t *)"hi");
+  text_op bad = text_op_delete(1, 5);
+  assert(text_snapshot_apply(s, &bad) == NULL);
+  text_op_free(&bad);
+  text_snapshot_release(s);
+  
+  // Readers take snapshots while another thread edits the document.
+  text_snapshot_head head;
+  text_snapshot_head_init(&head, content);
+  rope_free(doc);
+  doc = rope_new_with_utf8(content);
+  snapshot_job job = {&head, false};
+  pthread_t readers[3];
+  for (int t = 0; t < 3; t++) {
+    pthread_create(&readers[t], NULL, read_snapshots, &job);
+  }
+  for (int i = 0; i < 2000; i++) {
+    text_op op = random_op_from(doc, MIXED_UCHARS, num_uchars);
+    text_op_apply(doc, &op);
+    assert(text_snapshot_head_apply(&head, &op) == 0);
+    text_op_free(&op);
+  }
+  __atomic_store_n(&job.done, true, __ATOMIC_RELEASE);
+  for (int t = 0; t < 3; t++) {
+    pthread_join(readers[t], NULL);
+  }
+  
+  s = text_snapshot_head_get(&head);
+  assert(text_snapshot_version(s) == 2000);
+  uint8_t *actual = text_snapshot_create_cstr(s), *exp = rope_create_cstr(doc);
+  assert(strcmp((char *)actual, (char *)exp) == 0);
+  free(actual);
+  free(exp);
+  text_snapshot_release(s);
+  text_snapshot_head_destroy(&head);
+  rope_free(doc);
+}
+
+void json_apply() {
+  text_op_arena arena;
+  text_op_arena_init(&arena, 0);
+  json_value *root = json_new_object(&arena);
+  json_object_set(&arena, root, (uint8_t *)"title", json_new_string(&arena, (uint8_t *)"hello"));
+  json_object_set(&arena, root, (uint8_t *)"count", json_new_number(&arena, 1));
+  json_value *tags = json_new_array(&arena);
+  json_array_append(&arena, tags, json_new_string(&arena, (uint8_t *)"a"));
+  json_object_set(&arena, root, (uint8_t *)"tags", tags);
+  json_doc *doc = json_doc_new(root);
+  
+  json_op op;
+  json_op_init(&op);
+  json_path_elem title[] = {json_key("title")};
+  text_op edit = text_op_insert(5, (uint8_t *)" world");
+  json_op_text(&op, title, 1, &edit);
+  text_op_free(&edit);
+  json_path_elem count[] = {json_key("count")};
+  json_op_number_add(&op, count, 1, 2.5);
+  json_path_elem tag[] = {json_key("tags"), json_index(0)};
+  json_op_list_insert(&op, tag, 2, json_new_bool(&arena, true));
+  json_path_elem extra[] = {json_key("extra")};
+  json_op_object_insert(&op, extra, 1, json_new_null(&arena));
+  assert(json_op_apply(doc, &op) == 0);
+  
+  json_value *v = json_object_get(doc->root, (uint8_t *)"title");
+  assert(strcmp((char *)str_content(&v->string), "hello world") == 0);
+  assert(json_object_get(doc->root, (uint8_t *)"count")->number == 3.5);
+  v = json_object_get(doc->root, (uint8_t *)"tags");
+  assert(v->num_items == 2 && v->items[0]->type == JSON_BOOL);
+  assert(json_object_get(doc->root, (uint8_t *)"extra")->type == JSON_NULL);
+  json_op_free(&op);
+  
+  // If any component fails, none of the op is applied.
+  json_value *before = json_value_copy(&arena, doc->root);
+  json_op_init(&op);
+  json_op_list_insert(&op, tag, 2, json_new_null(&arena));
+  json_op_list_delete(&op, tag, 2);
+  json_op_list_delete(&op, tag, 2);
+  json_op_object_insert(&op, count, 1, json_new_null(&arena));
+  json_path_elem added[] = {json_key("added")};
+  json_op_object_insert(&op, added, 1, json_new_number(&arena, 1));
+  json_op_number_add(&op, added, 1, 1);
+  edit = text_op_delete(0, 6);
+  json_op_text(&op, title, 1, &edit);
+  text_op_free(&edit);
+  json_op_object_delete(&op, extra, 1);
+  json_op_number_add(&op, title, 1, 1);
+  assert(json_op_apply(doc, &op) != 0);
+  assert(json_value_equal(before, doc->root));
+  json_op_free(&op);
+  
+  json_doc_compact(doc);
+  assert(json_value_equal(before, doc->root));
+  json_doc_free(doc);
+
+  // A text edit which deletes past the end of a string (longer than the stack buffer).
+  uint8_t long_str[301];
+  memset(long_str, 'a', 300);
+  long_str[300] = '\0';
+  root = json_new_object(&arena);
+  json_object_set(&arena, root, (uint8_t *)"s", json_new_string(&arena, long_str));
+  doc = json_doc_new(root);
+  json_op_init(&op);
+  json_path_elem s[] = {json_key("s")};
+  text_op_component wrap[] = {{TEXT_OP_SKIP, .num = 2}, {TEXT_OP_DELETE, .num = SIZE_MAX}};
+  edit = text_op_from_components(wrap, 2);
+  json_op_text(&op, s, 1, &edit);
+  text_op_free(&edit);
+  assert(json_op_apply(doc, &op) != 0);
+  assert(str_num_chars(&json_object_get(doc->root, (uint8_t *)"s")->string) == 300);
+  json_op_free(&op);
+
+  // Typing into the string copies it every time. The old copies get compacted away.
+  for (int i = 0; i < 10000; i++) {
+    json_op_init(&op);
+    edit = i % 2 ? text_op_delete(150, 1) : text_op_insert(150, (uint8_t *)"x");
+    json_op_text(&op, s, 1, &edit);
+    text_op_free(&edit);
+    assert(json_op_apply(doc, &op) == 0);
+    json_op_free(&op);
+    assert(doc->arena.size < 256 * 1024);
+  }
+  json_value *typed = json_object_get(doc->root, (uint8_t *)"s");
+  assert(str_num_chars(&typed->string) == 300 && str_content(&typed->string)[150] == 'a');
+  json_doc_free(doc);
+  text_op_arena_destroy(&arena);
+}
+
+static json_value *random_json_value(text_op_arena *arena, int depth) {
+  uint8_t buffer[20];
+  switch (random() % (depth < 2 ? 6 : 4)) {
+    case 0: return json_new_null(arena);
+    case 1: return json_new_bool(arena, random() % 2);
+    case 2: return json_new_number(arena, random() % 100);
+    case 3:
+      random_string(buffer, 1 + random() % 10);
+      return json_new_string(arena, buffer);
+    case 4: {
+      json_value *v = json_new_array(arena);
+      for (int i = random() % 4; i > 0; i--) {
+        json_array_append(arena, v, random_json_value(arena, depth + 1));
+      }
+      return v;
+    }
+    default: {
+      json_value *v = json_new_object(arena);
+      const char *keys[] = {"a", "b", "c"};
+      for (int i = random() % 4; i > 0; i--) {
+        json_object_set(arena, v, (uint8_t *)keys[random() % 3], random_json_value(arena, depth + 1));
+      }
+      return v;
+    }
+  }
+}
+
+// Make a random op which applies to the document. The document is edited along the way.
+static json_op random_json_op(json_doc *doc) {
+  json_op op;
+  json_op_init(&op);
+  text_op_arena arena;
+  text_op_arena_init(&arena, 0);
+  
+  for (int n = 1 + random() % 3; n > 0; n--) {
+    json_path_elem path[20];
+    size_t path_len = 0;
+    json_value *v = doc->root;
+    while (true) {
+      size_t num = v->type == JSON_ARRAY ? v->num_items : v->type == JSON_OBJECT ? v->num_members : 0;
+      if (num == 0 || path_len == 19 || random() % 5 < 2) break;
+      size_t i = random() % num;
+      if (v->type == JSON_ARRAY) {
+        path[path_len++] = json_index(i);
+        v = v->items[i];
+      } else {
+        path[path_len++] = (json_path_elem){v->members[i].key, v->members[i].key_len, 0};
+        v = v->members[i].value;
+      }
+    }
+    
+    json_op component;
+    json_op_init(&component);
+    if (v->type == JSON_NUMBER) {
+      json_op_number_add(&component, path, path_len, random() % 10);
+    } else if (v->type == JSON_STRING) {
+      rope *r = rope_new_with_utf8(str_content(&v->string));
+      text_op edit = random_op(r);
+      json_op_text(&component, path, path_len, &edit);
+      text_op_free(&edit);
+      rope_free(r);
+    } else if (v->type == JSON_ARRAY) {
+      if (v->num_items && random() % 2) {
+        path[path_len++] = json_index(random() % v->num_items);
+        json_op_list_delete(&component, path, path_len);
+      } else {
+        path[path_len++] = json_index(random() % (v->num_items + 1));
+        json_op_list_insert(&component, path, path_len, random_json_value(&arena, 0));
+      }
+    } else if (v->type == JSON_OBJECT) {
+      if (v->num_members && random() % 3 == 0) {
+        json_member *m = &v->members[random() % v->num_members];
+        path[path_len++] = (json_path_elem){m->key, m->key_len, 0};
+        json_op_object_delete(&component, path, path_len);
+      } else {
+        const char *keys[] = {"a", "b", "c", "d"};
+        path[path_len++] = json_key(keys[random() % 4]);
+        json_op_object_insert(&component, path, path_len, random_json_value(&arena, 0));
+      }
+    }
+    
+    // Nulls and bools can't be edited, so nothing gets added for them.
+    if (component.num_components) {
+      assert(json_op_apply(doc, &component) == 0);
+      json_op composed = json_op_compose(&op, &component);
+      json_op_free(&op);
+      op = composed;
+    }
+    json_op_free(&component);
+  }
+  text_op_arena_destroy(&arena);
+  return op;
+}
+
+void json_ops() {
+  srandom(61);
+  buffer buf = {};
+  
+  for (int i = 0; i < 20000; i++) {
+    text_op_arena arena;
+    text_op_arena_init(&arena, 0);
+    json_value *start = json_new_object(&arena);
+    for (int j = 0; j < 4; j++) {
+      json_object_set(&arena, start, (uint8_t *)(j % 2 ? "x" : "y"), random_json_value(&arena, 0));
+    }
+    json_object_set(&arena, start, (uint8_t *)"s", json_new_string(&arena, (uint8_t *)"Hi there"));
+    json_object_set(&arena, start, (uint8_t *)"n", json_new_number(&arena, 5));
+    
+    json_doc *doc_a = json_doc_new(start);
+    json_doc *doc_b = json_doc_new(start);
+    json_op a = random_json_op(doc_a);
+    json_op b = random_json_op(doc_b);
+    
+    // Transforming either op by the other gets both documents to the same place.
+    json_op a_ = json_op_transform(&a, &b, true);
+    json_op b_ = json_op_transform(&b, &a, false);
+    assert(json_op_apply(doc_a, &b_) == 0);
+    assert(json_op_apply(doc_b, &a_) == 0);
+    assert(json_value_equal(doc_a->root, doc_b->root));
+    
+    // Composing a with b_ does the same as applying them one after the other.
+    json_doc *doc_c = json_doc_new(start);
+    json_op ab = json_op_compose(&a, &b_);
+    assert(json_op_apply(doc_c, &ab) == 0);
+    assert(json_value_equal(doc_a->root, doc_c->root));
+    json_doc_free(doc_c);
+    
+    // And the op survives a trip through bytes.
+    buf.num = 0;
+    json_op_to_bytes(&ab, append, &buf);
+    json_op copy;
+    assert(json_op_from_bytes(&copy, buf.bytes, buf.num) == buf.num);
+    doc_c = json_doc_new(start);
+    assert(json_op_apply(doc_c, &copy) == 0);
+    assert(json_value_equal(doc_a->root, doc_c->root));
+    for (size_t n = 0; n < buf.num; n++) {
+      // Truncated ops never parse.
+      json_op broken;
+      assert(json_op_from_bytes(&broken, buf.bytes, n) < 0);
+    }
+    
+    json_op_free(&copy);
+    json_op_free(&ab);
+    json_op_free(&a);
+    json_op_free(&b);
+    json_op_free(&a_);
+    json_op_free(&b_);
+    json_doc_free(doc_a);
+    json_doc_free(doc_b);
+    json_doc_free(doc_c);
+    text_op_arena_destroy(&arena);
+  }
+
+  // Strings have to be valid utf8 without any \0s, like text inserts.
+  text_op_arena arena;
+  text_op_arena_init(&arena, 0);
+  json_op op;
+  json_op_init(&op);
+  json_path_elem key[] = {json_key("k")};
+  json_op_object_insert(&op, key, 1, json_new_string(&arena, (uint8_t *)"xyz"));
+  buf.num = 0;
+  json_op_to_bytes(&op, append, &buf);
+  uint8_t *s = buf.bytes;
+  while (memcmp(s, "xyz", 3) != 0) s++;
+  const uint8_t bad[] = {0xff, 0x00, 0xc3};
+  for (int i = 0; i < sizeof(bad); i++) {
+    s[1] = bad[i];
+    json_op broken;
+    assert(json_op_from_bytes(&broken, buf.bytes, buf.num) < 0);
+  }
+  s[1] = 'y';
+  json_op copy;
+  assert(json_op_from_bytes(&copy, buf.bytes, buf.num) == buf.num);
+  json_op_free(&copy);
+  json_op_free(&op);
+  text_op_arena_destroy(&arena);
+  free(buf.bytes);
+}
+
+void rich_text() {
+  rich_doc *doc = rich_doc_new((uint8_t *)"Hello world");
+  rich_attr bold[] = {{(uint8_t *)"bold", (uint8_t *)"true"}};
+  rich_attrs bold_attrs = {bold, 1};
+  
+  // Bold "Hello", then the rest. The two runs end up as one span.
+  rich_op op;
+  rich_op_init(&op);
+  rich_op_skip(&op, 5, &bold_attrs);
+  assert(rich_op_apply(doc, &op) == 0);
+  rich_op_free(&op);
+  assert(doc->num_spans == 2);
+  
+  rich_op_init(&op);
+  rich_op_skip(&op, 5, NULL);
+  rich_op_skip(&op, 6, &bold_attrs);
+  assert(op.num_components == 2);
+  assert(rich_op_apply(doc, &op) == 0);
+  rich_op_free(&op);
+  assert(doc->num_spans == 1);
+  
+  // Insert a link (attributes don't need to be sorted), then unbold the end.
+  rich_attr link[] = {{(uint8_t *)"link", (uint8_t *)"example.com"}, {(uint8_t *)"bold", NULL}};
+  rich_attrs link_attrs = {link, 2};
+  rich_op_init(&op);
+  rich_op_skip(&op, 5, NULL);
+  rich_op_insert(&op, (uint8_t *)"!", &link_attrs);
+  assert(rich_op_apply(doc, &op) == 0);
+  rich_op_free(&op);
+  const rich_attrs *attrs = rich_doc_attrs_at(doc, 5);
+  assert(attrs->num_attrs == 1 && strcmp((char *)attrs->attrs[0].key, "link") == 0);
+  
+  rich_attr unbold[] = {{(uint8_t *)"bold", NULL}};
+  rich_attrs unbold_attrs = {unbold, 1};
+  rich_op_init(&op);
+  rich_op_skip(&op, 6, NULL);
+  rich_op_skip(&op, 6, &unbold_attrs);
+  assert(rich_op_apply(doc, &op) == 0);
+  rich_op_free(&op);
+  assert(doc->num_spans == 3);
+  assert(rich_attrs_equal(rich_doc_attrs_at(doc, 0), &bold_attrs));
+  assert(rich_doc_attrs_at(doc, 11)->num_attrs == 0);
+  assert(rich_doc_attrs_at(doc, 12) == NULL);
+  
+  uint8_t *text = rope_create_cstr(doc->text);
+  assert(strcmp((char *)text, "Hello! world") == 0);
+  free(text);
+  
+  // Ops which run off the end are rejected.
+  rich_op_init(&op);
+  rich_op_skip(&op, 12, NULL);
+  rich_op_delete(&op, 1);
+  assert(rich_op_apply(doc, &op) != 0);
+  rich_op_free(&op);
+  assert(rope_char_count(doc->text) == 12);
+
+  // So are ops whose lengths only fit if they wrap around when they're added up.
+  rich_op_init(&op);
+  rich_op_skip(&op, SIZE_MAX, &bold_attrs);
+  rich_op_skip(&op, 2, NULL);
+  assert(rich_op_apply(doc, &op) != 0);
+  rich_op_free(&op);
+  assert(doc->num_spans == 3);
+
+  // Attribute sets which aren't used anymore don't pile up.
+  for (int i = 0; i < 1000; i++) {
+    char url[20];
+    sprintf(url, "%d.com", i);
+    rich_attr changed[] = {{(uint8_t *)"link", (uint8_t *)url}};
+    rich_attrs changed_attrs = {changed, 1};
+    rich_op_init(&op);
+    rich_op_skip(&op, 5, NULL);
+    rich_op_skip(&op, 1, &changed_attrs);
+    assert(rich_op_apply(doc, &op) == 0);
+    rich_op_free(&op);
+    assert(doc->num_formats <= 2 * doc->num_spans + 16);
+  }
+  attrs = rich_doc_attrs_at(doc, 5);
+  assert(strcmp((char *)attrs->attrs[0].value, "999.com") == 0);
+  rich_doc_compact(doc);
+  assert(doc->num_formats == 3);
+  assert(rich_attrs_equal(rich_doc_attrs_at(doc, 0), &bold_attrs));
+
+  rich_doc_free(doc);
+}
+
+// Make a random rich op which applies to a document len characters long.
+static rich_op random_rich_op(size_t len) {
+  static const rich_attr choices[] = {
+    {(uint8_t *)"bold", (uint8_t *)"1"}, {(uint8_t *)"bold", NULL},
+    {(uint8_t *)"color", (uint8_t *)"red"}, {(uint8_t *)"color", (uint8_t *)"blue"},
+    {(uint8_t *)"color", NULL}, {(uint8_t *)"link", (uint8_t *)"x"},
+  };
+  size_t num_choices = sizeof(choices) / sizeof(choices[0]);
+  uint8_t buffer[20];
+  
+  rich_op op;
+  rich_op_init(&op);
+  while (rand_float() < 0.8f) {
+    rich_attr attrs[2];
+    size_t num_attrs = 0;
+    if (random() % 2) {
+      attrs[num_attrs++] = choices[random() % num_choices];
+      rich_attr second = choices[random() % num_choices];
+      if (strcmp((char *)second.key, (char *)attrs[0].key) != 0) {
+        attrs[num_attrs++] = second;
+      }
+    }
+    rich_attrs set = {attrs, num_attrs};
+    
+    int type = random() % 3;
+    if (type == 0 && len) {
+      size_t num = 1 + random() % len;
+      rich_op_skip(&op, num, &set);
+      len -= num;
+    } else if (type == 1 && len) {
+      size_t num = 1 + random() % len;
+      rich_op_delete(&op, num);
+      len -= num;
+    } else {
+      random_string(buffer, 5 + random() % 15);
+      rich_op_insert(&op, buffer, &set);
+    }
+  }
+  return op;
+}
+
+static bool rich_docs_equal(const rich_doc *a, const rich_doc *b) {
+  uint8_t *text_a = rope_create_cstr(a->text), *text_b = rope_create_cstr(b->text);
+  bool equal = strcmp((char *)text_a, (char *)text_b) == 0 && a->num_spans == b->num_spans;
+  for (size_t i = 0; equal && i < a->num_spans; i++) {
+    equal = a->spans[i].num == b->spans[i].num
+        && rich_attrs_equal(a->spans[i].attrs, b->spans[i].attrs);
+  }
+  free(text_a);
+  free(text_b);
+  return equal;
+}
+
+void rich_ops() {
+  srandom(71);
+  const uint8_t *start = (uint8_t *)"Hi there!! OMG strings rock.";
+  
+  for (int i = 0; i < 20000; i++) {
+    // Start with some formatting in place.
+    rich_doc *doc_a = rich_doc_new(start), *doc_b = rich_doc_new(start), *doc_c = rich_doc_new(start);
+    rich_op setup = random_rich_op(rope_char_count(doc_a->text));
+    assert(rich_op_apply(doc_a, &setup) == 0);
+    assert(rich_op_apply(doc_b, &setup) == 0);
+    assert(rich_op_apply(doc_c, &setup) == 0);
+    
+    size_t len = rope_char_count(doc_a->text);
+    rich_op a = random_rich_op(len), b = random_rich_op(len);
+    rich_op a_ = rich_op_transform(&a, &b, true);
+    rich_op b_ = rich_op_transform(&b, &a, false);
+    assert(rich_op_apply(doc_a, &a) == 0);
+    assert(rich_op_apply(doc_a, &b_) == 0);
+    assert(rich_op_apply(doc_b, &b) == 0);
+    assert(rich_op_apply(doc_b, &a_) == 0);
+    assert(rich_docs_equal(doc_a, doc_b));
+    
+    rich_op ab = rich_op_compose(&a, &b_);
+    assert(rich_op_apply(doc_c, &ab) == 0);
+    assert(rich_docs_equal(doc_a, doc_c));
+    
+    rich_op_free(&setup);
+    rich_op_free(&a);
+    rich_op_free(&b);
+    rich_op_free(&a_);
+    rich_op_free(&b_);
+    rich_op_free(&ab);
+    rich_doc_free(doc_a);
+    rich_doc_free(doc_b);
+    rich_doc_free(doc_c);
+  }
+}
+
+void benchmark_string() {
+  printf("Benchmarking strings...\n");
+  
+//  long iterations = 2000000000;
+  long iterations = 20000000;
+  
+  str s1;
+  str_init2(&s1, (uint8_t *)"Hi there this string is longer than 16 bytes");
+  
+  struct timeval start, end;
+  
+  gettimeofday(&start, NULL);
+  
+  for (long i = 0; i < iterations; i++) {
+    str s2;
+    str_init_with_copy(&s2, &s1);
+    str_destroy(&s2);
+  }
+  
+  gettimeofday(&end, NULL);
+  
+  double elapsedTime = end.tv_sec - start.tv_sec;
+  elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+  printf("copy: did %ld iterations in %f ms: %f Miter/sec\n",
+         iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000);
+  str_destroy(&s1);
+  
+  // Transform and compose spend most of their time looking at the length of short inserts and
+  // cutting them up.
+  text_op_component c1[] = {
+    {TEXT_OP_INSERT}, {TEXT_OP_SKIP, .num = 2}, {TEXT_OP_INSERT}, {TEXT_OP_SKIP, .num = 3},
+    {TEXT_OP_INSERT}, {TEXT_OP_DELETE, .num = 4}, {TEXT_OP_INSERT},
+  };
+  str_init2(&c1[0].str, (uint8_t *)"abc");
+  str_init2(&c1[2].str, (uint8_t *)"déjà vu");
+  str_init2(&c1[4].str, (uint8_t *)"xyz");
+  str_init2(&c1[6].str, (uint8_t *)"hello there");
+  text_op op1 = text_op_from_components(c1, sizeof(c1) / sizeof(c1[0]));
+  
+  text_op_component c2[] = {
+    {TEXT_OP_SKIP, .num = 1}, {TEXT_OP_DELETE, .num = 3}, {TEXT_OP_SKIP, .num = 2},
+    {TEXT_OP_INSERT}, {TEXT_OP_SKIP, .num = 3}, {TEXT_OP_DELETE, .num = 6}, {TEXT_OP_SKIP, .num = 4},
+  };
+  str_init2(&c2[3].str, (uint8_t *)"hi");
+  text_op op2 = text_op_from_components(c2, sizeof(c2) / sizeof(c2[0]));
+  
+  // An op which edits the document after op1.
+  text_op_component c3[] = {
+    {TEXT_OP_SKIP, .num = 2}, {TEXT_OP_DELETE, .num = 5}, {TEXT_OP_SKIP, .num = 4},
+    {TEXT_OP_INSERT}, {TEXT_OP_SKIP, .num = 3}, {TEXT_OP_DELETE, .num = 2},
+  };
+  str_init2(&c3[3].str, (uint8_t *)"ok");
+  text_op op3 = text_op_from_components(c3, sizeof(c3) / sizeof(c3[0]));
+  
+  iterations /= 4;
+  for (int mode = 0; mode < 2; mode++) {
+    gettimeofday(&start, NULL);
+    
+    for (long i = 0; i < iterations; i++) {
+      text_op result;
+      if (mode == 0) {
+        text_op_transform2(&result, &op1, &op2, i % 2);
+      } else {
+        text_op_compose2(&result, &op1, &op3);
+      }
+      text_op_free(&result);
+    }
+    
+    gettimeofday(&end, NULL);
+    
+    elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%s: did %ld iterations in %f ms: %f Miter/sec\n", mode == 0 ? "transform" : "compose",
+           iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000);
+  }
+  
+  text_op_free(&op1);
+  text_op_free(&op2);
+  text_op_free(&op3);
+}
+
+void benchmark_apply() {
+  printf("Benchmarking apply...\n");
+  
+  long iterations = 20000000;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  int doclens[] = {100, 1000, 10000, 100000, 1000000};
+  const text_document_type *types[] = {&TEXT_DOCUMENT_ROPE, &TEXT_DOCUMENT_FLAT, &TEXT_DOCUMENT_GAP};
+
+  for (int dl = 0; dl < sizeof(doclens) / sizeof(doclens[0]); dl++) {
+    int doclen = doclens[dl];
+    
+    uint8_t *content = malloc(doclen + 1);
+    memset(content, 'a', doclen);
+    content[doclen] = '\0';
+
+    // Simple ops edit one place in the document. Multi-component ops make 8 edits spread across
+    // it, alternating between inserts and deletes.
+    for (int multi = 0; multi < 2; multi++) {
+      text_op ops[1000];
+      for (int i = 0; i < 1000; i++) {
+        int num_edits = multi ? 8 : 1;
+        text_op_component c[16];
+        size_t n = 0;
+        for (int e = 0; e < num_edits; e++) {
+          c[n].type = TEXT_OP_SKIP;
+          c[n++].num = random() % (doclen / num_edits - 1) + 1;
+          
+          if ((i + e) % 2) {
+            c[n].type = TEXT_OP_INSERT;
+            str_init2(&c[n++].str, (uint8_t *)"x");
+          } else {
+            c[n].type = TEXT_OP_DELETE;
+            c[n++].num = 1;
+          }
+        }
+        text_op_from_components2(&ops[i], c, n);
+      }
+      
+      for (int t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+        text_document *doc = text_document_new(types[t], content);
+        
+        // Edits in the flat and gap buffers move O(doclen) bytes, so they get fewer iterations.
+        long its = multi ? iterations / 8 : iterations;
+        if (types[t] != &TEXT_DOCUMENT_ROPE && doclen > 100) {
+          its = its / (doclen / 100);
+        }
+        printf("doclen %d, %s%s\n", doclen, types[t]->name, multi ? " (8 edits per op)" : "");
+        gettimeofday(&start, NULL);
+        
+        for (long i = 0; i < its; i++) {
+          text_document_apply(doc, &ops[i % 1000]);
+        }
+        
+        gettimeofday(&end, NULL);
+        
+        double elapsedTime = end.tv_sec - start.tv_sec;
+        elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+        printf("%ld iterations in %f ms: %f Miter/sec\n",
+               its, elapsedTime * 1000, its / elapsedTime / 1000000);
+        
+        text_document_free(doc);
+      }
+      
+      for (unsigned int i = 0; i < 1000; i++) {
+        text_op_free(&ops[i]);
+      }
+    }
+    free(content);
+  }
+}
+
+void benchmark_apply_many() {
+  printf("Benchmarking apply_many...\n");
+  
+  long iterations = 100000;
+  size_t doclen = 100000;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  uint8_t *content = malloc(doclen + 1);
+  memset(content, 'a', doclen);
+  content[doclen] = '\0';
+  rope *base = rope_new_with_utf8(content);
+  free(content);
+  
+  for (int shape = 0; shape < 2; shape++) {
+    // Either a history of typing, or single character edits scattered all over the document.
+    text_op *ops;
+    if (shape == 0) {
+      ops = typing_history(iterations, doclen);
+    } else {
+      ops = malloc(sizeof(text_op) * iterations);
+      for (long i = 0; i < iterations; i++) {
+        ops[i] = i % 2 ? text_op_insert(random() % doclen, (uint8_t *)"x")
+            : text_op_delete(random() % (doclen - 1), 1);
+      }
+    }
+    
+    for (int mode = 0; mode < 2; mode++) {
+      rope *doc = rope_copy(base);
+      gettimeofday(&start, NULL);
+      
+      if (mode == 0) {
+        for (long i = 0; i < iterations; i++) {
+          text_op_apply(doc, &ops[i]);
+        }
+      } else {
+        text_op_apply_many(doc, ops, iterations);
+      }
+      
+      gettimeofday(&end, NULL);
+      printf("%s, %s\n", shape == 0 ? "typing" : "scattered edits",
+          mode == 0 ? "one at a time" : "apply_many");
+      
+      double elapsedTime = end.tv_sec - start.tv_sec;
+      elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+      printf("applied %ld ops in %f ms: %f Kops/sec\n",
+             iterations, elapsedTime * 1000, iterations / elapsedTime / 1000);
+      rope_free(doc);
+    }
+    
+    for (long i = 0; i < iterations; i++) {
+      text_op_free(&ops[i]);
+    }
+    free(ops);
+  }
+  
+  rope_free(base);
+}
+
+void benchmark_transform() {
+  printf("Benchmarking transform...\n");
+  
+  long iterations = 200000000;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  int doclen = 10000;
+  
+  text_op ops[1000];
+  for (int i = 0; i < 1000; i++) {
+    text_op_component c[2] = {{TEXT_OP_SKIP}};
+    c[0].num = random() % doclen + 1;
     
     if (i % 2) {
       c[1].type = TEXT_OP_INSERT;
       str_init2(&c[1].str, (uint8_t *)"x");
     } else {
-      c[1].type = TEXT_OP_DELETE;
-      c[1].num = 1;
+      c[1].type = TEXT_OP_DELETE;
+      c[1].num = 1;
+    }
+    text_op_from_components2(&ops[i], c, 2);
+  }
+
+  text_op_component c[2] = {{TEXT_OP_SKIP}, {TEXT_OP_DELETE}};
+  c[0].num = doclen / 2;
+  c[1].num = 1;
+  text_op op = text_op_from_components(c, 2);
+  
+  for (int t = 0; t < 2; t++) {
+    gettimeofday(&start, NULL);
+
+    for (long i = 0; i < iterations; i++) {
+      text_op op_ = text_op_transform(&op, &ops[i % 1000], true);
+      text_op_free(&op);
+      op = op_;
+    }
+  
+    gettimeofday(&end, NULL);
+    printf("run %d\n", t);
+  
+    double elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("dl %d did %ld iterations in %f ms: %f Miter/sec\n",
+           doclen, iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000);
+  }
+
+  // Same again, but build the results in a pair of arenas. Each arena is reset once the op living
+  // in it has been transformed into the other one, so nothing gets malloced per iteration.
+  text_op_arena arenas[2];
+  text_op_arena_init(&arenas[0], 0);
+  text_op_arena_init(&arenas[1], 0);
+  
+  for (int t = 0; t < 2; t++) {
+    text_op cur = op; // Starts out aliasing the heap op, which is freed below as normal.
+    gettimeofday(&start, NULL);
+    
+    for (long i = 0; i < iterations; i++) {
+      text_op_arena *arena = &arenas[i % 2];
+      text_op_arena_reset(arena);
+      text_op next;
+      text_op_transform_arena(&next, &cur, &ops[i % 1000], true, arena);
+      cur = next;
+    }
+    
+    gettimeofday(&end, NULL);
+    printf("arena run %d\n", t);
+    
+    double elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("dl %d did %ld iterations in %f ms: %f Miter/sec\n",
+           doclen, iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000);
+  }
+  
+  // Most of the ops above are small enough to fit inline, so they don't malloc much anyway. Bigger
+  // ops allocate a component list (and long inserts) for every result.
+  rope *doc = rope_new();
+  for (int i = 0; i < doclen; i++) {
+    rope_insert(doc, 0, (uint8_t *)"a");
+  }
+  text_op big_ops[1000];
+  for (int i = 0; i < 1000; i++) {
+    big_ops[i] = random_op(doc);
+  }
+  rope_free(doc);
+  
+  long big_iterations = iterations / 10;
+  for (int use_arena = 0; use_arena < 2; use_arena++) {
+    gettimeofday(&start, NULL);
+    
+    for (long i = 0; i < big_iterations; i++) {
+      text_op *a = &big_ops[i % 1000], *b = &big_ops[(i + 1) % 1000];
+      text_op result;
+      if (use_arena) {
+        text_op_arena *arena = &arenas[0];
+        if (i % 1000 == 0) text_op_arena_reset(arena);
+        text_op_transform_arena(&result, a, b, true, arena);
+      } else {
+        text_op_transform2(&result, a, b, true);
+        text_op_free(&result);
+      }
+    }
+    
+    gettimeofday(&end, NULL);
+    printf("multi-component ops (%s)\n", use_arena ? "arena" : "malloc");
+    
+    double elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("did %ld iterations in %f ms: %f Miter/sec\n",
+           big_iterations, elapsedTime * 1000, big_iterations / elapsedTime / 1000000);
+  }
+  
+  text_op_arena_destroy(&arenas[0]);
+  text_op_arena_destroy(&arenas[1]);
+
+  for (int i = 0; i < 1000; i++) {
+    text_op_free(&ops[i]);
+    text_op_free(&big_ops[i]);
+  }
+  text_op_free(&op);
+}
+
+void benchmark_builder() {
+  printf("Benchmarking op building...\n");
+  
+  long iterations = 1000000;
+  
+  struct timeval start, end;
+  
+  // Like the ops a diff makes: a few edits with inserts too long to store inline.
+  uint8_t *content = (uint8_t *)"The quick brown fox jumps over the lazy dog";
+  
+  for (int use_builder = 0; use_builder < 2; use_builder++) {
+    gettimeofday(&start, NULL);
+    
+    for (long i = 0; i < iterations; i++) {
+      text_op op;
+      if (use_builder) {
+        text_op_builder builder;
+        text_op_builder_init(&builder, 12);
+        for (int e = 0; e < 4; e++) {
+          text_op_builder_skip(&builder, 10);
+          text_op_builder_delete(&builder, 3);
+          str s;
+          str_init2(&s, content);
+          text_op_builder_insert(&builder, &s);
+        }
+        text_op_builder_finish(&builder, &op);
+      } else {
+        text_op_component c[12];
+        for (int e = 0; e < 4; e++) {
+          c[e * 3] = (text_op_component){TEXT_OP_SKIP, .num = 10};
+          c[e * 3 + 1] = (text_op_component){TEXT_OP_DELETE, .num = 3};
+          c[e * 3 + 2].type = TEXT_OP_INSERT;
+          str_init2(&c[e * 3 + 2].str, content);
+        }
+        text_op_from_components2(&op, c, 12);
+      }
+      text_op_free(&op);
+    }
+    
+    gettimeofday(&end, NULL);
+    printf("%s\n", use_builder ? "text_op_builder" : "text_op_from_components");
+    
+    double elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("did %ld iterations in %f ms: %f Miter/sec\n",
+           iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000);
+  }
+}
+
+void benchmark_keystrokes() {
+  printf("Benchmarking keystroke ops...\n");
+  
+  long iterations = 20000000;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  // Single character inserts and deletes, like the ops users send while typing.
+  text_op ops[1000];
+  for (int i = 0; i < 1000; i++) {
+    size_t pos = random() % 1000;
+    ops[i] = random() % 4 ? text_op_insert(pos, (uint8_t *)"x") : text_op_delete(pos, 1);
+  }
+  
+  for (int mode = 0; mode < 2; mode++) {
+    gettimeofday(&start, NULL);
+    
+    for (long i = 0; i < iterations; i++) {
+      text_op *a = &ops[i % 1000];
+      text_op result;
+      if (mode == 0) {
+        text_op_transform2(&result, a, &ops[(i * 7 + 1) % 1000], i & 1);
+      } else {
+        // The next keystroke, right after this one.
+        text_op next = a->content.type == TEXT_OP_INSERT
+            ? (text_op){NULL, .skip = a->skip + 1, .content = a->content}
+            : (text_op){NULL, .skip = a->skip, .content = {TEXT_OP_DELETE, .num = 1}};
+        text_op_compose2(&result, a, &next);
+      }
+      text_op_free(&result);
+    }
+    
+    gettimeofday(&end, NULL);
+    printf("%s\n", mode == 0 ? "transform" : "compose");
+    
+    double elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("did %ld iterations in %f ms: %f Miter/sec\n",
+           iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000);
+  }
+  
+  for (int i = 0; i < 1000; i++) {
+    text_op_free(&ops[i]);
+  }
+}
+
+void benchmark_transform_x() {
+  printf("Benchmarking transform_x...\n");
+  
+  long iterations = 20000000;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  rope *doc = rope_new();
+  for (int i = 0; i < 10000; i++) {
+    rope_insert(doc, 0, (uint8_t *)"a");
+  }
+  
+  text_op ops[1000];
+  for (int i = 0; i < 1000; i++) {
+    ops[i] = random_op(doc);
+  }
+  rope_free(doc);
+  
+  for (int use_x = 0; use_x < 2; use_x++) {
+    gettimeofday(&start, NULL);
+    
+    for (long i = 0; i < iterations; i++) {
+      text_op *a = &ops[i % 1000], *b = &ops[(i * 7 + 1) % 1000];
+      text_op a_, b_;
+      if (use_x) {
+        text_op_transform_x(&a_, &b_, a, b);
+      } else {
+        text_op_transform2(&a_, a, b, true);
+        text_op_transform2(&b_, b, a, false);
+      }
+      text_op_free(&a_);
+      text_op_free(&b_);
+    }
+    
+    gettimeofday(&end, NULL);
+    printf("%s\n", use_x ? "text_op_transform_x" : "2x text_op_transform2");
+    
+    double elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("did %ld iterations in %f ms: %f Miter/sec\n",
+           iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000);
+  }
+  
+  for (int i = 0; i < 1000; i++) {
+    text_op_free(&ops[i]);
+  }
+}
+
+void benchmark_transform_cursors() {
+  printf("Benchmarking cursor transforms...\n");
+  
+  long iterations = 100000;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  // A busy document with lots of people looking at it.
+  size_t doclen = 100000;
+  uint8_t *content = malloc(doclen + 1);
+  memset(content, 'a', doclen);
+  content[doclen] = '\0';
+  rope *doc = rope_new_with_utf8(content);
+  free(content);
+  
+  // Each op edits a few places in the document, like a batch of edits from a busy client.
+  text_op ops[100];
+  for (int i = 0; i < 100; i++) {
+    rope *copy = rope_copy(doc);
+    ops[i] = random_op(copy);
+    text_op_apply(copy, &ops[i]);
+    for (int j = 0; j < 7; j++) {
+      text_op next = random_op(copy);
+      text_op_apply(copy, &next);
+      text_op composed = text_op_compose(&ops[i], &next);
+      text_op_free(&ops[i]);
+      text_op_free(&next);
+      ops[i] = composed;
+    }
+    rope_free(copy);
+  }
+  rope_free(doc);
+  
+  size_t num_cursors = 2000;
+  text_cursor *cursors = malloc(sizeof(text_cursor) * num_cursors);
+  text_cursor *moved = malloc(sizeof(text_cursor) * num_cursors);
+  for (int c = 0; c < num_cursors; c++) {
+    size_t pos = random() % doclen;
+    cursors[c] = text_cursor_make(pos, random() % 4 ? pos : pos + random() % 100);
+  }
+  qsort(cursors, num_cursors, sizeof(text_cursor), compare_cursors);
+  
+  for (int bulk = 0; bulk < 2; bulk++) {
+    long its = bulk ? iterations : iterations / 10;
+    gettimeofday(&start, NULL);
+    
+    for (long i = 0; i < its; i++) {
+      const text_op *op = &ops[i % 100];
+      if (bulk) {
+        memcpy(moved, cursors, sizeof(text_cursor) * num_cursors);
+        text_op_transform_cursors(moved, num_cursors, op);
+      } else {
+        for (int c = 0; c < num_cursors; c++) {
+          moved[c] = text_op_transform_cursor(cursors[c], op, false);
+        }
+      }
+    }
+    
+    gettimeofday(&end, NULL);
+    printf("%s (%zu cursors per op)\n", bulk ? "text_op_transform_cursors" : "text_op_transform_cursor",
+        num_cursors);
+    
+    double elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("did %ld iterations in %f ms: %f Kiter/sec\n",
+           its, elapsedTime * 1000, its / elapsedTime / 1000);
+  }
+  
+  free(cursors);
+  free(moved);
+  for (int i = 0; i < 100; i++) {
+    text_op_free(&ops[i]);
+  }
+}
+
+void benchmark_index() {
+  printf("Benchmarking transforms by an indexed op...\n");
+  
+  long iterations = 200000;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  // A find and replace with 50k edits.
+  size_t doclen = 500000;
+  text_op big = find_and_replace_op(doclen);
+  text_op ops[1000];
+  for (int i = 0; i < 1000; i++) {
+    ops[i] = text_op_insert(random() % doclen, (uint8_t *)"x");
+  }
+  
+  for (int indexed = 0; indexed < 2; indexed++) {
+    long its = indexed ? iterations : iterations / 100;
+    gettimeofday(&start, NULL);
+    
+    if (indexed) {
+      text_op_build_index(&big);
+    }
+    for (long i = 0; i < its; i++) {
+      text_op result = text_op_transform(&ops[i % 1000], &big, false);
+      text_op_free(&result);
+    }
+    
+    gettimeofday(&end, NULL);
+    printf("%s\n", indexed ? "indexed" : "not indexed");
+    
+    double elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("did %ld iterations in %f ms: %f Miter/sec\n",
+           its, elapsedTime * 1000, its / elapsedTime / 1000000);
+  }
+  
+  for (int i = 0; i < 1000; i++) {
+    text_op_free(&ops[i]);
+  }
+  text_op_free(&big);
+}
+
+void benchmark_compose_many() {
+  printf("Benchmarking compose_many...\n");
+  
+  long iterations = 20000;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  text_op *ops = typing_history(iterations, 1000);
+  
+  for (int mode = 0; mode < 3; mode++) {
+    gettimeofday(&start, NULL);
+    
+    text_op result;
+    if (mode == 0) {
+      result = text_op_clone(&ops[0]);
+      for (long i = 1; i < iterations; i++) {
+        text_op next = text_op_compose(&result, &ops[i]);
+        text_op_free(&result);
+        result = next;
+      }
+    } else {
+      text_op_compose_many_threaded(&result, ops, iterations, mode == 1 ? 1 : 4);
     }
-    text_op_from_components2(&ops[i], c, 2);
+    
+    gettimeofday(&end, NULL);
+    printf("%s\n", mode == 0 ? "one at a time" : mode == 1 ? "compose_many" : "compose_many (4 threads)");
+    
+    double elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("composed %ld ops in %f ms: %f Kops/sec\n",
+           iterations, elapsedTime * 1000, iterations / elapsedTime / 1000);
+    text_op_free(&result);
+  }
+  
+  for (long i = 0; i < iterations; i++) {
+    text_op_free(&ops[i]);
   }
+  free(ops);
+}
 
-  text_op_component c[2] = {{TEXT_OP_SKIP}, {TEXT_OP_DELETE}};
-  c[0].num = doclen / 2;
-  c[1].num = 1;
-  text_op op = text_op_from_components(c, 2);
+void benchmark_json() {
+  printf("Benchmarking json transform...\n");
+  
+  long iterations = 2000000;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  text_op_arena arena;
+  text_op_arena_init(&arena, 0);
+  json_value *root = json_new_object(&arena);
+  json_value *list = json_new_array(&arena);
+  for (int i = 0; i < 20; i++) {
+    json_value *item = json_new_object(&arena);
+    json_object_set(&arena, item, (uint8_t *)"a", json_new_string(&arena, (uint8_t *)"Some text"));
+    json_object_set(&arena, item, (uint8_t *)"b", json_new_number(&arena, i));
+    json_array_append(&arena, list, item);
+  }
+  json_object_set(&arena, root, (uint8_t *)"x", list);
+  
+  json_op ops[1000];
+  for (int i = 0; i < 1000; i++) {
+    json_doc *doc = json_doc_new(root);
+    ops[i] = random_json_op(doc);
+    json_doc_free(doc);
+  }
+  
+  gettimeofday(&start, NULL);
+  
+  for (long i = 0; i < iterations; i++) {
+    json_op result = json_op_transform(&ops[i % 1000], &ops[(i * 7 + 1) % 1000], i % 2);
+    json_op_free(&result);
+  }
+  
+  gettimeofday(&end, NULL);
+  
+  double elapsedTime = end.tv_sec - start.tv_sec;
+  elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+  printf("did %ld iterations in %f ms: %f Miter/sec\n",
+         iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000);
+  
+  for (int i = 0; i < 1000; i++) {
+    json_op_free(&ops[i]);
+  }
+  text_op_arena_destroy(&arena);
+}
+
+void benchmark_rich_transform() {
+  printf("Benchmarking rich text transform...\n");
+  
+  long iterations = 20000000;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  int doclen = 10000;
+  rich_attr bold[] = {{(uint8_t *)"bold", (uint8_t *)"true"}};
+  rich_attrs bold_attrs = {bold, 1};
+  
+  // The same edits as benchmark_transform, with some formatting mixed in.
+  rich_op ops[1000];
+  for (int i = 0; i < 1000; i++) {
+    rich_op_init(&ops[i]);
+    rich_op_skip(&ops[i], random() % doclen + 1, NULL);
+    if (i % 3 == 0) {
+      rich_op_insert(&ops[i], (uint8_t *)"x", NULL);
+    } else if (i % 3 == 1) {
+      rich_op_delete(&ops[i], 1);
+    } else {
+      rich_op_skip(&ops[i], 5, &bold_attrs);
+    }
+  }
+  
+  rich_op op;
+  rich_op_init(&op);
+  rich_op_skip(&op, doclen / 2, NULL);
+  rich_op_delete(&op, 1);
   
   for (int t = 0; t < 2; t++) {
     gettimeofday(&start, NULL);
-
+    
     for (long i = 0; i < iterations; i++) {
-      text_op op_ = text_op_transform(&op, &ops[i % 1000], true);
-      text_op_free(&op);
+      rich_op op_ = rich_op_transform(&op, &ops[i % 1000], true);
+      rich_op_free(&op);
       op = op_;
     }
-  
+    
     gettimeofday(&end, NULL);
     printf("run %d\n", t);
-  
+    
     double elapsedTime = end.tv_sec - start.tv_sec;
     elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
     printf("dl %d did %ld iterations in %f ms: %f Miter/sec\n",
            doclen, iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000);
   }
+  
+  for (int i = 0; i < 1000; i++) {
+    rich_op_free(&ops[i]);
+  }
+  rich_op_free(&op);
+}
 
+void benchmark_from_json() {
+  printf("Benchmarking op parsing...\n");
+  
+  long iterations = 5000000;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  rope *doc = rope_new();
+  for (int i = 0; i < 10000; i++) {
+    rope_insert(doc, 0, (uint8_t *)"a");
+  }
+  
+  // The same ops in each encoding, end to end.
+  buffer bufs[3] = {};
+  size_t offsets[3][1000];
   for (int i = 0; i < 1000; i++) {
-    text_op_free(&ops[i]);
+    text_op op = random_op(doc);
+    offsets[0][i] = bufs[0].num;
+    text_op_to_bytes(&op, append, &bufs[0]);
+    offsets[1][i] = bufs[1].num;
+    text_op_to_bytes_v2(&op, append, &bufs[1]);
+    offsets[2][i] = bufs[2].num;
+    text_op_to_json(&op, append, &bufs[2]);
+    text_op_free(&op);
+  }
+  rope_free(doc);
+  
+  const char *names[] = {"text_op_from_bytes (v1)", "text_op_from_bytes (v2)", "text_op_from_json"};
+  for (int e = 0; e < 3; e++) {
+    gettimeofday(&start, NULL);
+    
+    for (long i = 0; i < iterations; i++) {
+      size_t n = i % 1000;
+      size_t len = (n == 999 ? bufs[e].num : offsets[e][n + 1]) - offsets[e][n];
+      text_op op;
+      ssize_t result = e < 2 ? text_op_from_bytes(&op, (uint8_t *)bufs[e].bytes + offsets[e][n], len)
+          : text_op_from_json(&op, (uint8_t *)bufs[e].bytes + offsets[e][n], len);
+      assert(result == len);
+      text_op_free(&op);
+    }
+    
+    gettimeofday(&end, NULL);
+    printf("%s\n", names[e]);
+    
+    double elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("did %ld iterations in %f ms: %f Miter/sec (%zu bytes per 1000 ops)\n",
+           iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000, bufs[e].num);
+  }
+  
+  for (int e = 0; e < 3; e++) {
+    free(bufs[e].bytes);
+  }
+}
+
+void benchmark_utf8() {
+  printf("Benchmarking utf8 scanning...\n");
+  
+  long iterations = 500;
+  size_t size = 1 << 20;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  uint8_t *text = malloc(size);
+  random_string_from(text, size, MIXED_UCHARS, sizeof(MIXED_UCHARS) / sizeof(MIXED_UCHARS[0]));
+  size_t num_bytes = strlen((char *)text);
+  size_t num_chars = strlen_utf8(text);
+  
+  for (int mode = 0; mode < 3; mode++) {
+    size_t total = 0;
+    gettimeofday(&start, NULL);
+    
+    for (long i = 0; i < iterations; i++) {
+      if (mode == 0) {
+        total += strlen_utf8(text);
+      } else if (mode == 1) {
+        total += count_utf8_chars(text, num_chars) - text;
+      } else {
+        // Short hops through the text, like take() does when it splits up inserts.
+        uint8_t *p = text;
+        while (*p) {
+          p = count_utf8_chars(p, 7);
+        }
+        total += p - text;
+      }
+    }
+    
+    gettimeofday(&end, NULL);
+    assert(total == iterations * (mode == 0 ? num_chars : num_bytes));
+    printf("%s\n", mode == 0 ? "strlen_utf8" : mode == 1 ? "count_utf8_chars" : "count_utf8_chars (7 char hops)");
+    
+    double elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("scanned %ld MB in %f ms: %f MB/sec\n",
+           iterations * num_bytes / 1000000, elapsedTime * 1000,
+           iterations * num_bytes / elapsedTime / 1000000);
+  }
+  
+  free(text);
+}
+
+void benchmark_apply_utf16() {
+  printf("Benchmarking UTF-16 apply...\n");
+  
+  long iterations = 200000;
+  size_t doclen = 10000;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  uint8_t *content = malloc(doclen * 4 + 1);
+  // Plain character ops for comparison, then UTF-16 ops on an ascii document (which don't need
+  // converting) and on a document with characters outside the BMP.
+  for (int mode = 0; mode < 3; mode++) {
+    random_string_from(content, mode == 2 ? doclen * 2 : doclen + 1, MIXED_UCHARS,
+        mode == 2 ? sizeof(MIXED_UCHARS) / sizeof(MIXED_UCHARS[0]) : 5);
+    rope *doc = rope_new_with_utf8(content);
+    
+    // Each insert is followed by a delete which takes it out again, so the positions stay valid.
+    text_op ops[1000];
+    for (int i = 0; i < 1000; i += 2) {
+      size_t pos = random() % rope_char_count(doc);
+      if (mode > 0) {
+        pos = utf16_pos(doc, pos);
+      }
+      ops[i] = text_op_insert(pos, (uint8_t *)"x");
+      ops[i + 1] = text_op_delete(pos, 1);
+    }
+    
+    gettimeofday(&start, NULL);
+    
+    for (long i = 0; i < iterations; i++) {
+      if (mode == 0) {
+        assert(text_op_apply(doc, &ops[i % 1000]) == 0);
+      } else {
+        assert(text_op_apply_utf16(doc, &ops[i % 1000]) == 0);
+      }
+    }
+    
+    gettimeofday(&end, NULL);
+    printf("%s, %zu characters\n", mode == 0 ? "text_op_apply"
+        : mode == 1 ? "text_op_apply_utf16 (ascii)" : "text_op_apply_utf16 (mixed)",
+        rope_char_count(doc));
+    
+    double elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%ld iterations in %f ms: %f Miter/sec\n",
+           iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000);
+    
+    for (int i = 0; i < 1000; i++) {
+      text_op_free(&ops[i]);
+    }
+    rope_free(doc);
+  }
+  free(content);
+}
+
+void benchmark_snapshot_apply() {
+  printf("Benchmarking snapshot apply...\n");
+  
+  long iterations = 2000000;
+  
+  struct timeval start, end;
+  
+  // Make the test stable
+  srandom(1234);
+  
+  int doclens[] = {100, 10000, 1000000};
+  for (int dl = 0; dl < sizeof(doclens) / sizeof(doclens[0]); dl++) {
+    int doclen = doclens[dl];
+    uint8_t *content = malloc(doclen + 1);
+    memset(content, 'a', doclen);
+    content[doclen] = '\0';
+    
+    // Inserts and deletes alternate, so the document stays the same size.
+    text_op ops[1000];
+    for (int i = 0; i < 1000; i++) {
+      size_t pos = random() % (doclen - 1);
+      ops[i] = i % 2 ? text_op_insert(pos, (uint8_t *)"x") : text_op_delete(pos, 1);
+    }
+    
+    // Each version is released once the next one is made, like a writer with no readers.
+    text_snapshot *s = text_snapshot_new(content);
+    gettimeofday(&start, NULL);
+    
+    for (long i = 0; i < iterations; i++) {
+      text_snapshot *next = text_snapshot_apply(s, &ops[i % 1000]);
+      text_snapshot_release(s);
+      s = next;
+    }
+    
+    gettimeofday(&end, NULL);
+    printf("doclen %d\n", doclen);
+    
+    double elapsedTime = end.tv_sec - start.tv_sec;
+    elapsedTime += (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%ld iterations in %f ms: %f Miter/sec\n",
+           iterations, elapsedTime * 1000, iterations / elapsedTime / 1000000);
+    
+    text_snapshot_release(s);
+    for (int i = 0; i < 1000; i++) {
+      text_op_free(&ops[i]);
+    }
+    free(content);
   }
-  text_op_free(&op);
 }
 
 int main() {
   sanity();
+  small_strings();
   left_hand_inserts();
   serialize_deserialze();
+  arena_ops();
+  view_ops();
+  serialize_v2();
+  json_text_ops();
+  apply_checks();
+  op_builder();
+  small_ops();
+  transform_x();
+  transform_many();
+  compose_many();
+  apply_many();
+  sliced_paste();
+  document_backends();
+  invert_ops();
+  undo_stack();
+  shared_clones();
+  doc_submit();
+  client_server();
   transform_cursor();
+  transform_cursors();
+  indexed_ops();
+  utf8_scan();
+  utf16_positions();
+  snapshots();
+  json_apply();
+  json_ops();
+  rich_text();
+  rich_ops();
   
   random_op_test();
   
-//  benchmark_string();
+  benchmark_string();
+  benchmark_utf8();
+  benchmark_from_json();
   
   benchmark_apply();
+  benchmark_apply_many();
+  benchmark_apply_utf16();
+  benchmark_snapshot_apply();
   benchmark_transform();
+  benchmark_rich_transform();
+  benchmark_builder();
+  benchmark_keystrokes();
+  benchmark_transform_x();
+  benchmark_transform_cursors();
+  benchmark_index();
+  benchmark_compose_many();
+  benchmark_json();
   return 0;
 }
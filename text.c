@@ -5,14 +5,67 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 #include <assert.h>
+#include <pthread.h>
 #include "text.h"
+#include "varint.h"
+
+// Allocate memory for the op, either from the arena or the heap.
+static void *op_alloc(text_op_arena *arena, size_t bytes) {
+  return arena ? text_op_arena_alloc(arena, bytes) : malloc(bytes);
+}
+
+// Where each component of an op starts, in the document the op applies to (src) and the document
+// it produces (dst). There's an extra entry at the end for the end of the op.
+typedef struct {
+  size_t src;
+  size_t dst;
+} index_entry;
+
+// Big ops keep a header just in front of their components, so clones can share them. It holds a
+// reference count and the op's index, if it has one. Components allocated in an arena have a
+// count of 0 - they're never shared.
+typedef struct {
+  size_t refcount;
+  index_entry *index;
+} components_header;
+
+static inline components_header *components_header_of(const text_op *op) {
+  return (components_header *)op->components - 1;
+}
+
+static inline size_t *components_refcount(const text_op *op) {
+  return &components_header_of(op)->refcount;
+}
+
+static text_op_component *components_alloc(size_t capacity, text_op_arena *arena) {
+  components_header *header = op_alloc(arena,
+      sizeof(components_header) + sizeof(text_op_component) * capacity);
+  header->refcount = arena ? 0 : 1;
+  header->index = NULL;
+  return (text_op_component *)(header + 1);
+}
+
+// Drop a reference to the op's components, freeing them if that was the last one.
+static void components_release(text_op *op) {
+  components_header *header = components_header_of(op);
+  if (__atomic_sub_fetch(&header->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    for (int i = 0; i < op->num_components; i++) {
+      if (op->components[i].type == TEXT_OP_INSERT) {
+        str_destroy(&op->components[i].str);
+      }
+    }
+    free(header->index);
+    free(header);
+  }
+}
 
 // Check that the given op has enough space for an additional op component.
-static void ensure_capacity(text_op *op) {
+static void ensure_capacity(text_op *op, text_op_arena *arena) {
   if (op->components == NULL && op->content.type != TEXT_OP_NONE) {
     // Grow the op into a big op.
-    text_op_component *components = op->components = malloc(sizeof(text_op_component) * 4);
+    text_op_component *components = op->components = components_alloc(4, arena);
     if (op->skip) {
       components[0].type = TEXT_OP_SKIP;
       components[0].num = op->skip;
@@ -24,27 +77,33 @@ static void ensure_capacity(text_op *op) {
     }
     op->capacity = 4;
   } else if (op->components != NULL && op->num_components == op->capacity) {
+    size_t old_size = sizeof(components_header) + op->capacity * sizeof(text_op_component);
     op->capacity *= 2;
-    op->components = realloc(op->components, op->capacity * sizeof(text_op_component));
+    size_t new_size = sizeof(components_header) + op->capacity * sizeof(text_op_component);
+    components_header *header = arena
+        ? text_op_arena_realloc(arena, components_header_of(op), old_size, new_size)
+        : realloc(components_header_of(op), new_size);
+    op->components = (text_op_component *)(header + 1);
   }
 }
 
 // Clone a component. This is only hard because long inserts need allocing.
-static text_op_component copy_component(const text_op_component old) {
+static text_op_component copy_component(const text_op_component old, text_op_arena *arena) {
   if (old.type != TEXT_OP_INSERT) {
     return old;
   } else {
     text_op_component c = {TEXT_OP_INSERT};
-    str_init_with_copy(&c.str, &old.str);
+    str_init_with_copy_arena(&c.str, &old.str, arena);
     return c;
   }
 }
 
-// Append the specified component to the end of the op.
-static void append(text_op *op, const text_op_component c) {
+// Append the specified component to the end of the op. The component is copied, so c can be a
+// view into another op.
+static void append(text_op *op, const text_op_component c, text_op_arena *arena) {
   if (c.type == TEXT_OP_NONE
       || ((c.type == TEXT_OP_SKIP || c.type == TEXT_OP_DELETE) && c.num == 0)
-      || (c.type == TEXT_OP_INSERT && !c.str.mem && c.str.chars[0] == '\0')) {
+      || (c.type == TEXT_OP_INSERT && str_is_empty(&c.str))) {
     // We're not inserting any actual data. Skip.
     return;
   } else if (op->components == NULL) {
@@ -53,7 +112,7 @@ static void append(text_op *op, const text_op_component c) {
       if (c.type == TEXT_OP_SKIP) {
         op->skip += c.num;
       } else {
-        op->content = copy_component(c);
+        op->content = copy_component(c, arena);
       }
       return;
     } else if (op->content.type == c.type) {
@@ -61,20 +120,20 @@ static void append(text_op *op, const text_op_component c) {
         op->content.num += c.num;
         return;
       } else if (c.type == TEXT_OP_INSERT) {
-        str_append(&op->content.str, &c.str);
+        str_append_arena(&op->content.str, &c.str, arena);
         return;
       }
     }
     
     // Fall through here if the small op can't hold the new component. Expand it and append.
-    ensure_capacity(op);
-    op->components[op->num_components++] = copy_component(c);
+    ensure_capacity(op, arena);
+    op->components[op->num_components++] = copy_component(c, arena);
   } else {
     // Big op.
     if (op->num_components == 0) { // This will basically never happen.
       // The list is empty. Create a new node.
-      ensure_capacity(op);
-      op->components[0] = copy_component(c);
+      ensure_capacity(op, arena);
+      op->components[0] = copy_component(c, arena);
       op->num_components++;
     } else {
       text_op_component *lastC = &op->components[op->num_components - 1];
@@ -84,28 +143,52 @@ static void append(text_op *op, const text_op_component c) {
           lastC->num += c.num;
         } else {
           // Extend the insert component.
-          str_append(&lastC->str, &c.str);
+          str_append_arena(&lastC->str, &c.str, arena);
         }
       } else {
-        ensure_capacity(op);
-        op->components[op->num_components++] = copy_component(c);
+        ensure_capacity(op, arena);
+        op->components[op->num_components++] = copy_component(c, arena);
       }
     }
   }
 }
 
+// Copy the components of src into a new array owned by dest.
+static void copy_components(text_op *dest, const text_op *src, text_op_arena *arena) {
+  size_t num = src->num_components;
+  text_op_component *components = components_alloc(num, arena);
+  for (int i = 0; i < num; i++) {
+    components[i] = copy_component(src->components[i], arena);
+  }
+  dest->components = components;
+  dest->capacity = dest->num_components = num;
+}
+
 void text_op_clone2(text_op *dest, text_op *src) {
   if (src->components) {
-    size_t num = src->num_components;
-    dest->components = malloc(sizeof(text_op_component) * num);
-    dest->capacity = dest->num_components = num;
-    for (int i = 0; i < num; i++) {
-      dest->components[i] = copy_component(src->components[i]);
+    if (*components_refcount(src) == 0) {
+      // The op lives in an arena. The clone needs its own copy.
+      copy_components(dest, src, NULL);
+    } else {
+      __atomic_add_fetch(components_refcount(src), 1, __ATOMIC_RELAXED);
+      *dest = *src;
     }
   } else {
     dest->components = NULL;
     dest->skip = src->skip;
-    dest->content = copy_component(src->content);
+    dest->content = copy_component(src->content, NULL);
+  }
+}
+
+void text_op_clone_arena(text_op *dest, text_op *src, text_op_arena *arena) {
+  if (arena == NULL) {
+    text_op_clone2(dest, src);
+  } else if (src->components) {
+    copy_components(dest, src, arena);
+  } else {
+    dest->components = NULL;
+    dest->skip = src->skip;
+    dest->content = copy_component(src->content, arena);
   }
 }
 
@@ -127,14 +210,73 @@ text_op text_op_delete(size_t pos, size_t amt) {
   return op;
 }
 
+void text_op_make_mutable(text_op *op) {
+  if (op->components && __atomic_load_n(components_refcount(op), __ATOMIC_ACQUIRE) > 1) {
+    text_op copy;
+    copy_components(&copy, op, NULL);
+    components_release(op);
+    *op = copy;
+  } else if (op->components) {
+    // The index won't match once the components are changed.
+    components_header *header = components_header_of(op);
+    free(header->index);
+    header->index = NULL;
+  }
+}
+
+// Get the op's index, or NULL if it doesn't have one.
+static inline const index_entry *op_index(const text_op *op) {
+  return op->components
+      ? __atomic_load_n(&components_header_of(op)->index, __ATOMIC_ACQUIRE) : NULL;
+}
+
+void text_op_build_index(text_op *op) {
+  if (op->components == NULL || *components_refcount(op) == 0 || op_index(op)) {
+    // Small ops don't need an index, and arena ops can't own one.
+    return;
+  }
+  
+  size_t n = op->num_components;
+  index_entry *index = malloc(sizeof(index_entry) * (n + 1));
+  size_t src = 0, dst = 0;
+  for (size_t i = 0; i < n; i++) {
+    const text_op_component *c = &op->components[i];
+    index[i] = (index_entry){src, dst};
+    switch (c->type) {
+      case TEXT_OP_SKIP: src += c->num; dst += c->num; break;
+      case TEXT_OP_INSERT: dst += str_num_chars(&c->str); break;
+      case TEXT_OP_DELETE: src += c->num; break;
+      default: break;
+    }
+  }
+  index[n] = (index_entry){src, dst};
+  
+  // Clones share the index too. If another thread beat us to it, use theirs.
+  index_entry *expected = NULL;
+  if (!__atomic_compare_exchange_n(&components_header_of(op)->index, &expected, index, false,
+      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    free(index);
+  }
+}
+
+// Find the first of the n indexed components which doesn't end before pos. Returns n if they all
+// do.
+static size_t index_find(const index_entry *index, size_t n, size_t pos) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index[mid + 1].src >= pos) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
 void text_op_free(text_op *op) {
   if (op->components) {
-    for (int i = 0; i < op->num_components; i++) {
-      if (op->components[i].type == TEXT_OP_INSERT) {
-        str_destroy(&op->components[i].str);
-      }
-    }
-    free(op->components);
+    components_release(op);
   } else if (op->content.type == TEXT_OP_INSERT) {
     str_destroy(&op->content.str);
   }
@@ -165,13 +307,95 @@ void text_op_from_components2(text_op *dest, text_op_component components[], siz
     num--;
   }
   for (int i = 0; i < num; i++) {
-    append(dest, components[i]);
+    append(dest, components[i], NULL);
     if (components[i].type == TEXT_OP_INSERT) {
       str_destroy(&components[i].str);
     }
   }
 }
 
+// The v2 encoding starts with this byte, which isn't a valid v1 component type. After it comes a
+// list of components:
+// - A LEB128 varint holding (length << 2) | type, where type is 1 for skip, 2 for insert and 3
+//   for delete. For inserts the length is the number of characters.
+// - Inserts are then followed by a varint holding the number of bytes, the string itself and a
+//   \0. (The \0 means views can hand inserts straight to rope_insert.)
+// The op ends with a zero byte.
+#define V2_MAGIC 0x82
+
+enum { V2_END = 0, V2_SKIP = 1, V2_INSERT = 2, V2_DELETE = 3 };
+
+// Read one v2 component out of the buffer into c. Inserts are views into the buffer. The end of
+// the op is returned as a component with type TEXT_OP_NONE. Returns the number of bytes used, or
+// -1 if the data is malformed. Inserts are checked to be valid utf8 with the number of characters
+// they claim to have, unless validate is false (for bytes which have been read before).
+//
+// Sending the character count doesn't save counting them after all - the check walks the string
+// anyway. It's the price of not trusting the sender (v1 doesn't check its inserts at all), and
+// makes decoding v2 roughly 10% slower than v1 on the from_bytes benchmark.
+static inline ssize_t read_v2_component(const uint8_t *p, const uint8_t *end, text_op_component *c,
+    bool validate) {
+  const uint8_t *start = p;
+  uint64_t header;
+  size_t n = varint_read(p, end, &header);
+  if (n == 0 || (header >> 2) > SIZE_MAX) {
+    return -1;
+  }
+  p += n;
+  size_t len = (size_t)(header >> 2);
+  
+  switch (header & 3) {
+    case V2_END:
+      if (len) return -1;
+      c->type = TEXT_OP_NONE;
+      break;
+    case V2_SKIP:
+      c->type = TEXT_OP_SKIP;
+      c->num = len;
+      break;
+    case V2_DELETE:
+      c->type = TEXT_OP_DELETE;
+      c->num = len;
+      break;
+    case V2_INSERT: {
+      uint64_t num_bytes;
+      n = varint_read(p, end, &num_bytes);
+      if (n == 0 || num_bytes >= (uint64_t)(end - p - n) || len > num_bytes || num_bytes > len * 4) {
+        return -1;
+      }
+      p += n;
+      // The rope trusts the character count, and stops reading the string at a \0. So the sender's
+      // count has to match the string, and the string can't have a \0 in it.
+      if (p[num_bytes] != '\0'
+          || (validate && utf8_validate(p, (size_t)num_bytes) != (ssize_t)len)) {
+        return -1;
+      }
+      c->type = TEXT_OP_INSERT;
+      str_init_view(&c->str, p, (size_t)num_bytes, len);
+      p += num_bytes + 1;
+      break;
+    }
+  }
+  return p - start;
+}
+
+static ssize_t from_bytes_v2(text_op *dest, const uint8_t *bytes, size_t num_bytes,
+    text_op_arena *arena) {
+  const uint8_t *p = bytes + 1, *end = bytes + num_bytes;
+  while (true) {
+    text_op_component component;
+    ssize_t len = read_v2_component(p, end, &component, true);
+    if (len < 0) {
+      return -1;
+    }
+    p += len;
+    if (component.type == TEXT_OP_NONE) break;
+    
+    append(dest, component, arena);
+  }
+  return p - bytes;
+}
+
 #define CONSUME_BYTES(into, type) if(bytes_remaining < sizeof(type)) return -1; \
   else {\
     (into) = *(type *)bytes;\
@@ -180,6 +404,11 @@ void text_op_from_components2(text_op *dest, text_op_component components[], siz
   }
 
 ssize_t text_op_from_bytes(text_op *dest, void *bytes, size_t num_bytes) {
+  return text_op_from_bytes_arena(dest, bytes, num_bytes, NULL);
+}
+
+ssize_t text_op_from_bytes_arena(text_op *dest, void *bytes, size_t num_bytes,
+    text_op_arena *arena) {
   if (num_bytes == 0 || bytes == NULL)
     return -1;
   
@@ -189,6 +418,10 @@ ssize_t text_op_from_bytes(text_op *dest, void *bytes, size_t num_bytes) {
   dest->skip = 0;
   dest->content.type = TEXT_OP_NONE;
   
+  if (*(uint8_t *)bytes == V2_MAGIC) {
+    return from_bytes_v2(dest, bytes, num_bytes, arena);
+  }
+  
   // Bytes are:
   // - num components of:
   //   - 1 byte for type
@@ -215,9 +448,7 @@ ssize_t text_op_from_bytes(text_op *dest, void *bytes, size_t num_bytes) {
         } else {
           // This is a faked out string - append() will actually copy the string out into
           // the op.
-          component.str.mem = bytes;
-          component.str.num_bytes = len;
-          component.str.num_chars = strlen_utf8(bytes);
+          str_init_view(&component.str, bytes, len, strlen_utf8(bytes));
           
           // Ignore the \0 as well.
           bytes += len + 1;
@@ -230,7 +461,7 @@ ssize_t text_op_from_bytes(text_op *dest, void *bytes, size_t num_bytes) {
         return -1;
     }
     
-    append(dest, component);
+    append(dest, component, arena);
   }
   
   return num_bytes - bytes_remaining;
@@ -238,33 +469,118 @@ ssize_t text_op_from_bytes(text_op *dest, void *bytes, size_t num_bytes) {
 
 #undef CONSUME_BYTES
 
+ssize_t text_op_view_init(text_op_view *view, const void *bytes, size_t num_bytes) {
+  if (num_bytes == 0 || bytes == NULL)
+    return -1;
+  
+  // Walk the components to make sure they're well formed and find the end of the op. Nothing is
+  // decoded here - that happens as the view is read.
+  const uint8_t *p = bytes, *end = p + num_bytes;
+  if (*p == V2_MAGIC) {
+    p++;
+    while (true) {
+      text_op_component c;
+      ssize_t len = read_v2_component(p, end, &c, true);
+      if (len < 0) {
+        return -1;
+      }
+      p += len;
+      if (c.type == TEXT_OP_NONE) break;
+    }
+  } else while (true) {
+    if (p == end) {
+      return -1;
+    }
+    uint8_t type = *p++;
+    if (type == 0) break;
+    
+    switch (type) {
+      case TEXT_OP_SKIP:
+      case TEXT_OP_DELETE:
+        if (end - p < sizeof(uint32_t)) {
+          return -1;
+        }
+        p += sizeof(uint32_t);
+        break;
+      case TEXT_OP_INSERT: {
+        size_t len = strnlen((const char *)p, end - p);
+        if (len == end - p) {
+          // Expected a null character at the end of the string
+          return -1;
+        }
+        p += len + 1;
+        break;
+      }
+      default:
+        // Unknown type.
+        return -1;
+    }
+  }
+  
+  view->bytes = bytes;
+  view->num_bytes = p - (const uint8_t *)bytes;
+  return view->num_bytes;
+}
+
+// Write the string including the \0.
+static void write_str(const str *s, text_write_fn write, void *user) {
+  if (str_is_terminated(s)) {
+    write((void *)str_content(s), str_num_bytes(s) + 1, user);
+  } else {
+    uint8_t zero = 0;
+    write((void *)str_content(s), str_num_bytes(s), user);
+    write((void *)&zero, sizeof(uint8_t), user);
+  }
+}
+
 static void write_component(const text_op_component component, text_write_fn write, void *user) {
   uint8_t type = component.type;
   write((void *)&type, 1, user);
   if (component.type == TEXT_OP_INSERT) {
-    // Write the string including the \0.
-    write((void *)str_content(&component.str), str_num_bytes(&component.str) + 1, user);
+    write_str(&component.str, write, user);
   } else {
     write((void *)&component.num, 4, user);
   }
 }
 
-void text_op_to_bytes(text_op *op, text_write_fn write, void *user) {
+static void write_component_v2(const text_op_component component, text_write_fn write,
+    void *user) {
+  uint8_t header[2 * VARINT_MAX_BYTES];
+  size_t n;
+  if (component.type == TEXT_OP_INSERT) {
+    size_t num_bytes = str_num_bytes(&component.str);
+    n = varint_write(header, (uint64_t)str_num_chars(&component.str) << 2 | V2_INSERT);
+    n += varint_write(&header[n], num_bytes);
+    write(header, n, user);
+    write_str(&component.str, write, user);
+  } else {
+    assert((uint64_t)component.num >> 62 == 0);
+    n = varint_write(header, (uint64_t)component.num << 2
+        | (component.type == TEXT_OP_SKIP ? V2_SKIP : V2_DELETE));
+    write(header, n, user);
+  }
+}
+
+typedef void (*write_component_fn)(const text_op_component component, text_write_fn write,
+    void *user);
+
+static void write_components(text_op *op, write_component_fn write_c, text_write_fn write,
+    void *user) {
   if (op->components) {
     for (int i = 0; i < op->num_components; i++) {
-      write_component(op->components[i], write, user);
+      write_c(op->components[i], write, user);
     }
   } else {
     if (op->skip) {
       text_op_component skip = {TEXT_OP_SKIP};
       skip.num = op->skip;
-      write_component(skip, write, user);
-      write_component(op->content, write, user);
+      write_c(skip, write, user);
+      write_c(op->content, write, user);
     } else {
       if (op->content.type == TEXT_OP_NONE) {
         // Its an empty op. Just say there's 0 components and be done with it.
       } else {
-        write_component(op->content, write, user);
+        write_c(op->content, write, user);
       }
     }
   }
@@ -272,13 +588,355 @@ void text_op_to_bytes(text_op *op, text_write_fn write, void *user) {
   write((void *)&zero, sizeof(uint8_t), user);
 }
 
+void text_op_to_bytes(text_op *op, text_write_fn write, void *user) {
+  write_components(op, write_component, write, user);
+}
+
+void text_op_to_bytes_v2(text_op *op, text_write_fn write, void *user) {
+  uint8_t magic = V2_MAGIC;
+  write((void *)&magic, sizeof(uint8_t), user);
+  write_components(op, write_component_v2, write, user);
+}
+
+// **** JSON encoding
+//
+// This is the format the text type uses in javascript: [3, "hi", {"d":5}]. Numbers are skips,
+// strings are inserts and {"d":N} deletes N characters. The key doesn't need to be quoted.
+
+static inline void init_op(text_op *op);
+static void trim_trailing_skips(text_op *op);
+
+static const uint8_t *skip_whitespace(const uint8_t *p, const uint8_t *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+  return p;
+}
+
+// Read a non-negative integer. Returns NULL if there isn't one, or it's bigger than max.
+static const uint8_t *read_json_size(const uint8_t *p, const uint8_t *end, size_t max,
+    size_t *out) {
+  if (p == end || *p < '0' || *p > '9') return NULL;
+  size_t value = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    size_t digit = *p - '0';
+    if (digit > max || value > (max - digit) / 10) return NULL;
+    value = value * 10 + digit;
+  }
+  *out = value;
+  return p;
+}
+
+// Scan a run of characters which don't need decoding, checking they're valid utf8 and counting
+// them. Returns the end of the run, or NULL if the utf8 is invalid.
+static const uint8_t *scan_json_run(const uint8_t *p, const uint8_t *end, size_t *num_chars) {
+  const uint8_t *start = p;
+  size_t n = 0;
+  // Skip over plain ASCII 8 bytes at a time. A word is plain if none of its bytes are control
+  // characters, quotes, backslashes or have the high bit set.
+  const uint64_t ones = 0x0101010101010101ull, highs = 0x8080808080808080ull;
+  while (end - p >= 8) {
+    uint64_t x;
+    memcpy(&x, p, 8);
+    uint64_t quote = x ^ (ones * '"'), slash = x ^ (ones * '\\');
+    if (((x - ones * 0x20) & ~x & highs) || ((quote - ones) & ~quote & highs)
+        || ((slash - ones) & ~slash & highs) || (x & highs)) {
+      break;
+    }
+    p += 8;
+  }
+  n = p - start;
+  while (p < end) {
+    uint8_t c = *p;
+    if (c < 0x80) {
+      if (c < 0x20 || c == '"' || c == '\\') break;
+      p++;
+    } else {
+      // The same rules as utf8_validate, so inserts from JSON and v2 bytes agree.
+      size_t len = utf8_char_size(p, end);
+      if (len == 0) return NULL;
+      p += len;
+    }
+    n++;
+  }
+  *num_chars = n;
+  return p;
+}
+
+static const uint8_t *read_hex4(const uint8_t *p, const uint8_t *end, uint32_t *out) {
+  if (end - p < 4) return NULL;
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    uint8_t c = p[i];
+    int digit = c >= '0' && c <= '9' ? c - '0'
+        : c >= 'a' && c <= 'f' ? c - 'a' + 10
+        : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+    if (digit < 0) return NULL;
+    value = value << 4 | digit;
+  }
+  *out = value;
+  return p + 4;
+}
+
+// Decode one escape sequence (p points just past the \) into buf. Returns the position after it,
+// or NULL if its malformed. *len is set to the number of bytes written.
+static const uint8_t *read_escape(const uint8_t *p, const uint8_t *end, uint8_t *buf,
+    size_t *len) {
+  if (p == end) return NULL;
+  uint32_t c;
+  switch (*p++) {
+    case '"': c = '"'; break;
+    case '\\': c = '\\'; break;
+    case '/': c = '/'; break;
+    case 'b': c = '\b'; break;
+    case 'f': c = '\f'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    case 'u':
+      if ((p = read_hex4(p, end, &c)) == NULL) return NULL;
+      // The rope stops reading inserts at a \0, so it can't be in one. Low surrogates can only
+      // come after a high surrogate.
+      if (c == 0 || (c >= 0xdc00 && c < 0xe000)) return NULL;
+      if (c >= 0xd800 && c < 0xdc00) {
+        // A surrogate pair. The low half has to come straight after.
+        uint32_t low;
+        if (end - p < 2 || p[0] != '\\' || p[1] != 'u'
+            || (p = read_hex4(p + 2, end, &low)) == NULL || low < 0xdc00 || low >= 0xe000) {
+          return NULL;
+        }
+        c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+      }
+      break;
+    default:
+      return NULL;
+  }
+  
+  if (c < 0x80) {
+    buf[0] = c;
+    *len = 1;
+  } else if (c < 0x800) {
+    buf[0] = 0xc0 | c >> 6;
+    buf[1] = 0x80 | (c & 0x3f);
+    *len = 2;
+  } else if (c < 0x10000) {
+    buf[0] = 0xe0 | c >> 12;
+    buf[1] = 0x80 | (c >> 6 & 0x3f);
+    buf[2] = 0x80 | (c & 0x3f);
+    *len = 3;
+  } else {
+    buf[0] = 0xf0 | c >> 18;
+    buf[1] = 0x80 | (c >> 12 & 0x3f);
+    buf[2] = 0x80 | (c >> 6 & 0x3f);
+    buf[3] = 0x80 | (c & 0x3f);
+    *len = 4;
+  }
+  return p;
+}
+
+static void append_json_insert(text_op *dest, const uint8_t *bytes, size_t num_bytes,
+    size_t num_chars, text_op_arena *arena) {
+  text_op_component c = {TEXT_OP_INSERT};
+  str_init_view(&c.str, bytes, num_bytes, num_chars);
+  append(dest, c, arena);
+}
+
+// Read a string (p points just past the opening quote) straight into the op. The string is
+// decoded into a buffer on the stack and appended to the op a chunk at a time, so nothing is
+// allocated apart from the op itself. Long runs without escapes are appended straight out of the
+// input.
+static const uint8_t *read_json_string(const uint8_t *p, const uint8_t *end, text_op *dest,
+    text_op_arena *arena) {
+  uint8_t buf[256];
+  size_t n = 0, num_chars = 0;
+  while (true) {
+    const uint8_t *run = p;
+    size_t run_chars;
+    if ((p = scan_json_run(p, end, &run_chars)) == NULL) return NULL;
+    if (n == 0 && p < end && *p == '"') {
+      // The common case: there were no escapes, so the string can be copied straight out.
+      append_json_insert(dest, run, p - run, run_chars, arena);
+      return p + 1;
+    }
+    if (n + (p - run) > sizeof(buf)) {
+      append_json_insert(dest, buf, n, num_chars, arena);
+      n = num_chars = 0;
+    }
+    if (p - run > sizeof(buf)) {
+      append_json_insert(dest, run, p - run, run_chars, arena);
+    } else {
+      memcpy(&buf[n], run, p - run);
+      n += p - run;
+      num_chars += run_chars;
+    }
+    
+    if (p == end || *p < 0x20) {
+      return NULL;
+    } else if (*p == '"') {
+      append_json_insert(dest, buf, n, num_chars, arena);
+      return p + 1;
+    }
+    
+    if (n + 4 > sizeof(buf)) {
+      append_json_insert(dest, buf, n, num_chars, arena);
+      n = num_chars = 0;
+    }
+    size_t len;
+    if ((p = read_escape(p + 1, end, &buf[n], &len)) == NULL) return NULL;
+    n += len;
+    num_chars++;
+  }
+}
+
+ssize_t text_op_from_json(text_op *dest, const void *json, size_t num_bytes) {
+  return text_op_from_json_arena(dest, json, num_bytes, NULL);
+}
+
+ssize_t text_op_from_json_arena(text_op *dest, const void *json, size_t num_bytes,
+    text_op_arena *arena) {
+  init_op(dest);
+  const uint8_t *start = json, *end = start + num_bytes;
+  const uint8_t *p = skip_whitespace(start, end);
+  if (p == end || *p++ != '[') goto fail;
+  
+  p = skip_whitespace(p, end);
+  if (p < end && *p == ']') {
+    return p + 1 - start;
+  }
+  
+  // The skips and deletes can add up to at most SSIZE_MAX, so nothing summing them can wrap
+  // around. No real document is that long.
+  size_t max_count = SSIZE_MAX;
+  while (true) {
+    p = skip_whitespace(p, end);
+    if (p == end) goto fail;
+    
+    if (*p == '"') {
+      if ((p = read_json_string(p + 1, end, dest, arena)) == NULL) goto fail;
+    } else if (*p == '{') {
+      // {"d":N} or {d:N}
+      p = skip_whitespace(p + 1, end);
+      if (end - p >= 3 && p[0] == '"' && p[1] == 'd' && p[2] == '"') {
+        p += 3;
+      } else if (p < end && *p == 'd') {
+        p++;
+      } else {
+        goto fail;
+      }
+      p = skip_whitespace(p, end);
+      if (p == end || *p++ != ':') goto fail;
+      
+      text_op_component c = {TEXT_OP_DELETE};
+      p = read_json_size(skip_whitespace(p, end), end, max_count, &c.num);
+      if (p == NULL) goto fail;
+      max_count -= c.num;
+      p = skip_whitespace(p, end);
+      if (p == end || *p++ != '}') goto fail;
+      append(dest, c, arena);
+    } else {
+      text_op_component c = {TEXT_OP_SKIP};
+      if ((p = read_json_size(p, end, max_count, &c.num)) == NULL) goto fail;
+      max_count -= c.num;
+      append(dest, c, arena);
+    }
+    
+    p = skip_whitespace(p, end);
+    if (p == end) goto fail;
+    if (*p == ']') break;
+    if (*p++ != ',') goto fail;
+  }
+  
+  trim_trailing_skips(dest);
+  return p + 1 - start;
+  
+fail:
+  if (arena == NULL) {
+    text_op_free(dest);
+  }
+  init_op(dest);
+  return -1;
+}
+
+static void write_json_string(const str *s, text_write_fn write, void *user) {
+  static const char hex[] = "0123456789abcdef";
+  const uint8_t *p = str_content(s), *end = p + str_num_bytes(s);
+  write("\"", 1, user);
+  while (p < end) {
+    // Write out plain characters in one go.
+    const uint8_t *run = p;
+    while (p < end && *p != '"' && *p != '\\' && *p >= 0x20) p++;
+    if (p > run) {
+      write((void *)run, p - run, user);
+    }
+    if (p == end) break;
+    
+    uint8_t escape[6] = {'\\', *p};
+    size_t len = 2;
+    switch (*p) {
+      case '"': case '\\': break;
+      case '\b': escape[1] = 'b'; break;
+      case '\f': escape[1] = 'f'; break;
+      case '\n': escape[1] = 'n'; break;
+      case '\r': escape[1] = 'r'; break;
+      case '\t': escape[1] = 't'; break;
+      default:
+        escape[1] = 'u';
+        escape[2] = escape[3] = '0';
+        escape[4] = hex[*p >> 4];
+        escape[5] = hex[*p & 0xf];
+        len = 6;
+        break;
+    }
+    write(escape, len, user);
+    p++;
+  }
+  write("\"", 1, user);
+}
+
+static void write_json_component(const text_op_component c, bool first, text_write_fn write,
+    void *user) {
+  char buf[32];
+  if (!first) {
+    write(",", 1, user);
+  }
+  switch (c.type) {
+    case TEXT_OP_SKIP:
+      write(buf, snprintf(buf, sizeof(buf), "%zu", c.num), user);
+      break;
+    case TEXT_OP_INSERT:
+      write_json_string(&c.str, write, user);
+      break;
+    case TEXT_OP_DELETE:
+      write(buf, snprintf(buf, sizeof(buf), "{\"d\":%zu}", c.num), user);
+      break;
+    default:
+      break;
+  }
+}
+
+void text_op_to_json(text_op *op, text_write_fn write, void *user) {
+  write("[", 1, user);
+  if (op->components) {
+    for (size_t i = 0; i < op->num_components; i++) {
+      write_json_component(op->components[i], i == 0, write, user);
+    }
+  } else if (op->content.type != TEXT_OP_NONE) {
+    if (op->skip) {
+      text_op_component skip = {TEXT_OP_SKIP};
+      skip.num = op->skip;
+      write_json_component(skip, true, write, user);
+    }
+    write_json_component(op->content, op->skip == 0, write, user);
+  }
+  write("]", 1, user);
+}
+
 static void component_print(text_op_component component) {
   switch (component.type) {
     case TEXT_OP_SKIP:
       printf("Skip   : %zu", component.num);
       break;
     case TEXT_OP_INSERT:
-      printf("Insert : %zu ('%s')", str_num_chars(&component.str), str_content(&component.str));
+      printf("Insert : %zu ('%.*s')", str_num_chars(&component.str),
+          (int)str_num_bytes(&component.str), str_content(&component.str));
       break;
     case TEXT_OP_DELETE:
       printf("Delete : %zu", component.num);
@@ -306,28 +964,35 @@ void text_op_print(const text_op *op) {
 typedef struct {
   size_t idx;
   size_t offset;
+  size_t byte_offset; // How far offset is into the string, when we're partway through an insert.
 } op_iter;
 
 #define MIN(x,y) ((x) > (y) ? (y) : (x))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
 
-static text_op_component take(text_op *op, op_iter *iter, size_t max_len,
+// Take up to max_len characters from the op at iter. If the next component is longer than that,
+// a piece of it is returned. Pieces of inserts are slices of the op's own string (see
+// str_init_slice), so the result is only valid until op is changed or freed.
+static text_op_component take(const text_op *op, op_iter *iter, size_t max_len,
       text_op_component_type indivisible_type) {
   // Faster or slower with a pointer?
   text_op_component e;
+  // The component we're taking from. NULL for the implicit skip in a small op.
+  const text_op_component *src = NULL;
   
   if (op->components == NULL) {
     // idx will be 0 or 1 for the two components.
-    if (iter->idx == 0) {
-      if (op->skip) {
-        e.type = TEXT_OP_SKIP;
-        e.num = op->skip;
-      } else {
+    if (iter->idx == 0 && op->skip) {
+      e.type = TEXT_OP_SKIP;
+      e.num = op->skip;
+    } else if (iter->idx <= 1) {
+      if (iter->idx == 0) {
         iter->idx++;
         iter->offset = 0;
-        e = op->content;
+        iter->byte_offset = 0;
       }
-    } else if (iter->idx == 1) {
-      e = op->content;
+      src = &op->content;
+      e = *src;
     } else {
       return (text_op_component){};
     }
@@ -336,7 +1001,8 @@ static text_op_component take(text_op *op, op_iter *iter, size_t max_len,
       return (text_op_component){};
     }
 
-    e = op->components[iter->idx];
+    src = &op->components[iter->idx];
+    e = *src;
   }
   
   size_t length = component_length(&e);
@@ -349,7 +1015,19 @@ static text_op_component take(text_op *op, op_iter *iter, size_t max_len,
 
   if (e.type == TEXT_OP_INSERT) {
     if (max_len < length) {
-      str_init_with_substring(&e.str, &op->components[iter->idx].str, iter->offset, max_len);
+      size_t num_bytes;
+      if (str_num_bytes(&src->str) == length) {
+        // ASCII. Characters and bytes line up.
+        num_bytes = max_len;
+      } else if (iter->offset + max_len == length) {
+        // The rest of the string.
+        num_bytes = str_num_bytes(&src->str) - iter->byte_offset;
+      } else {
+        const uint8_t *start = str_content(&src->str) + iter->byte_offset;
+        num_bytes = count_utf8_chars(start, max_len) - start;
+      }
+      str_init_slice(&e.str, &src->str, iter->byte_offset, num_bytes, max_len);
+      iter->byte_offset += num_bytes;
     }
   } else {
     e.num = max_len;
@@ -361,13 +1039,14 @@ static text_op_component take(text_op *op, op_iter *iter, size_t max_len,
 
   if (iter->offset >= length) {
     iter->offset = 0;
+    iter->byte_offset = 0;
     iter->idx++;
   }
 
   return e;
 }
 
-inline static text_op_component_type peek_type(text_op *op, op_iter iter) {
+inline static text_op_component_type peek_type(const text_op *op, op_iter iter) {
   if (op->components) {
     return iter.idx < op->num_components ? op->components[iter.idx].type : TEXT_OP_NONE;
   } else {
@@ -382,52 +1061,387 @@ inline static void init_op(text_op *op) {
   op->content.type = TEXT_OP_NONE;
 }
 
+// Ops never end in a skip. Remove it if there is one.
+static void trim_trailing_skips(text_op *op) {
+  if (op->components) {
+    while (op->num_components && op->components[op->num_components - 1].type == TEXT_OP_SKIP) {
+      op->num_components--;
+    }
+  } else if (op->content.type == TEXT_OP_NONE) {
+    op->skip = 0;
+  }
+}
+
 void text_op_transform2(text_op *result, text_op *op, text_op *other, bool isLefthand) {
-  init_op(result);
-  
-  if (op->components == NULL && op->content.type == TEXT_OP_NONE) {
+  text_op_transform_arena(result, op, other, isLefthand, NULL);
+}
+
+void text_op_builder_init(text_op_builder *builder, size_t capacity) {
+  text_op *op = &builder->op;
+  if (capacity > 2) {
+    op->components = components_alloc(capacity, NULL);
+    op->num_components = 0;
+    op->capacity = capacity;
+  } else {
+    init_op(op);
+  }
+}
+
+void text_op_builder_skip(text_op_builder *builder, size_t num) {
+  append(&builder->op, (text_op_component){TEXT_OP_SKIP, .num = num}, NULL);
+}
+
+void text_op_builder_delete(text_op_builder *builder, size_t num) {
+  append(&builder->op, (text_op_component){TEXT_OP_DELETE, .num = num}, NULL);
+}
+
+void text_op_builder_insert(text_op_builder *builder, str *s) {
+  text_op *op = &builder->op;
+  if (str_is_empty(s)) {
+    str_destroy(s);
     return;
   }
   
-  op_iter iter = {};
-  
-  text_op_component *other_components = other->components;
-  size_t num_other_components;
+  text_op_component *last = NULL;
+  if (op->components) {
+    last = op->num_components ? &op->components[op->num_components - 1] : NULL;
+  } else if (op->content.type != TEXT_OP_NONE) {
+    last = &op->content;
+  }
   
-  text_op_component inline_components[2];
-  if (other_components == NULL) {
-    other_components = inline_components;
-    if (other->content.type == TEXT_OP_NONE) {
-      num_other_components = 0;
-    } else if (other->skip == 0) {
-      num_other_components = 1;
-      inline_components[0] = other->content;
-    } else {
-      num_other_components = 2;
-      inline_components[0].type = TEXT_OP_SKIP;
-      inline_components[0].num = other->skip;
-      inline_components[1] = other->content;
-    }
+  if (last && last->type == TEXT_OP_INSERT) {
+    str_append(&last->str, s);
+    str_destroy(s);
+  } else if (op->components == NULL && op->content.type == TEXT_OP_NONE) {
+    op->content.type = TEXT_OP_INSERT;
+    op->content.str = *s;
   } else {
-    num_other_components = other->num_components;
+    // Move the string straight into the op.
+    ensure_capacity(op, NULL);
+    text_op_component *c = &op->components[op->num_components++];
+    c->type = TEXT_OP_INSERT;
+    c->str = *s;
   }
+}
+
+void text_op_builder_finish(text_op_builder *builder, text_op *dest) {
+  text_op *op = &builder->op;
+  trim_trailing_skips(op);
   
-  for (int i = 0; i < num_other_components; i++) {
-    if (peek_type(op, iter) == TEXT_OP_NONE) {
-      break;
+  if (op->components && op->num_components <= 2
+      && (op->num_components < 2 || op->components[0].type == TEXT_OP_SKIP)) {
+    // The op was allocated big, but it's only a single edit. Store it inline.
+    text_op_component *c = op->components;
+    size_t n = op->num_components;
+    components_header *header = components_header_of(op);
+    init_op(op);
+    if (n == 2) {
+      op->skip = c[0].num;
+      op->content = c[1];
+    } else if (n == 1) {
+      op->content = c[0];
     }
-    
-    switch (other_components[i].type) {
-      case TEXT_OP_SKIP: {
-        size_t num = other_components[i].num;
-        
-        while (num > 0) {
-          text_op_component c = take(op, &iter, num, TEXT_OP_INSERT);
-          if (c.type == TEXT_OP_NONE) {
-            break;
-          }
-          append(result, c);
-          if (c.type != TEXT_OP_INSERT) {
+    free(header);
+  }
+  
+  *dest = *op;
+  init_op(op);
+}
+
+// Reads the components of either an op or an op view, one at a time.
+typedef struct {
+  const text_op_component *components; // NULL when reading a view.
+  size_t num_components;
+  size_t idx;
+  const text_op_view *view;
+  const uint8_t *pos; // The read position when reading a view.
+  const index_entry *index; // NULL unless the op has an index.
+  bool utf16; // Set when positions count UTF-16 code units rather than characters.
+  // Small ops are unpacked into here.
+  text_op_component inline_components[2];
+} component_reader;
+
+static inline void reader_init_op(component_reader *r, const text_op *op) {
+  r->idx = 0;
+  r->view = NULL;
+  r->index = op_index(op);
+  r->utf16 = false;
+  r->num_components = text_op_components(op, r->inline_components, &r->components);
+}
+
+// Where the first component in the view starts.
+static inline const uint8_t *view_start(const text_op_view *view) {
+  return view->bytes[0] == V2_MAGIC ? view->bytes + 1 : view->bytes;
+}
+
+static inline void reader_init_view(component_reader *r, const text_op_view *view) {
+  r->components = NULL;
+  r->index = NULL;
+  r->utf16 = false;
+  r->view = view;
+  r->pos = view_start(view);
+}
+
+// How far an insert read out of r moves the positions after it.
+static inline size_t reader_insert_length(const component_reader *r, const str *s) {
+  return r->utf16 ? str_num_utf16(s) : str_num_chars(s);
+}
+
+// Decode the component at *pos out of the view. The bytes have already been validated. Inserts
+// are views into the buffer.
+static bool view_read(const text_op_view *view, const uint8_t **pos, text_op_component *c) {
+  const uint8_t *p = *pos;
+  if (view->bytes[0] == V2_MAGIC) {
+    ssize_t len = read_v2_component(p, view->bytes + view->num_bytes, c, false);
+    if (c->type == TEXT_OP_NONE) {
+      return false;
+    }
+    *pos = p + len;
+    return true;
+  }
+  
+  if (*p == 0) {
+    return false;
+  }
+  c->type = *p++;
+  if (c->type == TEXT_OP_INSERT) {
+    size_t len = strlen((const char *)p);
+    str_init_view(&c->str, p, len, strlen_utf8(p));
+    p += len + 1;
+  } else {
+    uint32_t num;
+    memcpy(&num, p, sizeof(num));
+    c->num = num;
+    p += sizeof(num);
+  }
+  *pos = p;
+  return true;
+}
+
+// Read the next component into c. Returns false at the end of the op.
+static inline bool read_component(component_reader *r, text_op_component *c) {
+  if (r->components == NULL) {
+    return view_read(r->view, &r->pos, c);
+  } else if (r->idx == r->num_components) {
+    return false;
+  } else {
+    *c = r->components[r->idx++];
+    return true;
+  }
+}
+
+bool text_op_view_next(const text_op_view *view, text_op_view_iter *iter,
+    text_op_component *c) {
+  if (iter->pos == NULL) {
+    iter->pos = view_start(view);
+  }
+  return view_read(view, &iter->pos, c);
+}
+
+void text_op_from_view(text_op *dest, const text_op_view *view) {
+  init_op(dest);
+  component_reader r;
+  reader_init_view(&r, view);
+  text_op_component c;
+  while (read_component(&r, &c)) {
+    append(dest, c, NULL);
+  }
+}
+
+static void transform(text_op *result, text_op *op, component_reader *other, bool isLefthand,
+    text_op_arena *arena);
+
+// Closed form transform and compose for small ops. Nearly every op is a single insert or delete,
+// and working out the result directly is much faster than walking the ops with take(). These
+// return false if the result wouldn't fit in a small op, in which case the general code handles
+// it.
+
+static inline void init_small_op(text_op *op, size_t skip) {
+  op->components = NULL;
+  op->skip = skip;
+}
+
+static bool transform_small(text_op *result, const text_op *op, const text_op *other,
+    bool isLefthand, text_op_arena *arena) {
+  text_op_component_type type = op->content.type, other_type = other->content.type;
+  size_t a = op->skip, b = other->skip;
+  
+  if (type == TEXT_OP_NONE) {
+    init_op(result);
+  } else if (other_type == TEXT_OP_NONE) {
+    init_small_op(result, a);
+    result->content = copy_component(op->content, arena);
+  } else if (type == TEXT_OP_INSERT) {
+    size_t pos;
+    if (other_type == TEXT_OP_INSERT) {
+      pos = a < b || (a == b && isLefthand) ? a : a + str_num_chars(&other->content.str);
+    } else {
+      size_t m = other->content.num;
+      pos = a <= b ? a : a >= b + m ? a - m : b;
+    }
+    init_small_op(result, pos);
+    result->content = copy_component(op->content, arena);
+  } else {
+    size_t n = op->content.num, pos, num;
+    if (other_type == TEXT_OP_INSERT) {
+      if (b > a && b < a + n) {
+        // The insert splits the delete in two.
+        return false;
+      }
+      pos = b <= a ? a + str_num_chars(&other->content.str) : a;
+      num = n;
+    } else {
+      // Don't delete anything other already deleted.
+      size_t m = other->content.num;
+      size_t overlap_start = MAX(a, b), overlap_end = MIN(a + n, b + m);
+      num = n - (overlap_end > overlap_start ? overlap_end - overlap_start : 0);
+      pos = a <= b ? a : a >= b + m ? a - m : b;
+    }
+    
+    if (num == 0) {
+      init_op(result);
+    } else {
+      init_small_op(result, pos);
+      result->content.type = TEXT_OP_DELETE;
+      result->content.num = num;
+    }
+  }
+  return true;
+}
+
+// Initialize dest with a copy of s, with ins (if it isn't NULL) inserted at offset and del
+// characters removed from there.
+static void splice_str(str *dest, const str *s, size_t offset, const str *ins, size_t del,
+    text_op_arena *arena) {
+  const uint8_t *content = str_content(s);
+  size_t num_bytes = str_num_bytes(s), num_chars = str_num_chars(s);
+  bool ascii = num_bytes == num_chars;
+  const uint8_t *start = ascii ? content + offset : count_utf8_chars(content, offset);
+  const uint8_t *end = ascii ? start + del : count_utf8_chars(start, del);
+  
+  str rest;
+  if (ins == NULL && (offset == 0 || end == content + num_bytes)) {
+    // Only one end was cut off. What's left is a slice of s, which can share its buffer.
+    if (offset == 0) {
+      str_init_slice(&rest, s, end - content, num_bytes - (end - content), num_chars - del);
+    } else {
+      str_init_slice(&rest, s, 0, start - content, offset);
+    }
+    str_init_with_copy_arena(dest, &rest, arena);
+    return;
+  }
+  
+  str_init3_arena(dest, content, start - content, offset, arena);
+  if (ins) {
+    str_append_arena(dest, ins, arena);
+  }
+  str_init_slice(&rest, s, end - content, num_bytes - (end - content), num_chars - offset - del);
+  str_append_arena(dest, &rest, arena);
+}
+
+static bool compose_small(text_op *result, const text_op *op1, const text_op *op2,
+    text_op_arena *arena) {
+  text_op_component_type type1 = op1->content.type, type2 = op2->content.type;
+  size_t a = op1->skip, b = op2->skip;
+  
+  if (type1 == TEXT_OP_NONE || type2 == TEXT_OP_NONE) {
+    const text_op *op = type1 == TEXT_OP_NONE ? op2 : op1;
+    init_small_op(result, op->skip);
+    result->content = copy_component(op->content, arena);
+  } else if (type1 == TEXT_OP_INSERT) {
+    // op2 has to stay inside the text op1 inserted.
+    const str *s = &op1->content.str;
+    size_t len = str_num_chars(s);
+    if (type2 == TEXT_OP_INSERT) {
+      if (b < a || b > a + len) {
+        return false;
+      }
+      init_small_op(result, a);
+      result->content.type = TEXT_OP_INSERT;
+      splice_str(&result->content.str, s, b - a, &op2->content.str, 0, arena);
+    } else {
+      size_t m = op2->content.num;
+      if (b < a || b + m > a + len) {
+        return false;
+      }
+      if (m == len) {
+        // Typed and then deleted again.
+        init_op(result);
+      } else {
+        init_small_op(result, a);
+        result->content.type = TEXT_OP_INSERT;
+        splice_str(&result->content.str, s, b - a, NULL, m, arena);
+      }
+    }
+  } else {
+    // Only deletes which touch each other (like holding down backspace) combine.
+    if (type2 == TEXT_OP_INSERT || b > a || b + op2->content.num < a) {
+      return false;
+    }
+    init_small_op(result, b);
+    result->content.type = TEXT_OP_DELETE;
+    result->content.num = op1->content.num + op2->content.num;
+  }
+  return true;
+}
+
+void text_op_transform_arena(text_op *result, text_op *op, text_op *other, bool isLefthand,
+    text_op_arena *arena) {
+  if (op->components == NULL && other->components == NULL
+      && transform_small(result, op, other, isLefthand, arena)) {
+    return;
+  }
+  component_reader r;
+  reader_init_op(&r, other);
+  transform(result, op, &r, isLefthand, arena);
+}
+
+void text_op_transform_view2(text_op *result, text_op *op, const text_op_view *other,
+    bool isLefthand) {
+  component_reader r;
+  reader_init_view(&r, other);
+  transform(result, op, &r, isLefthand, NULL);
+}
+
+static void transform(text_op *result, text_op *op, component_reader *other, bool isLefthand,
+    text_op_arena *arena) {
+  init_op(result);
+  
+  if (op->components == NULL && op->content.type == TEXT_OP_NONE) {
+    return;
+  }
+  
+  op_iter iter = {};
+  text_op_component oc;
+  
+  if (other->index && peek_type(op, iter) == TEXT_OP_SKIP) {
+    // Jump straight past everything in other before op's first edit. All that does is move the
+    // edit along.
+    size_t skip = op->components ? op->components[0].num : op->skip;
+    size_t k = index_find(other->index, other->num_components, skip);
+    if (k) {
+      other->idx = k;
+      iter.offset = other->index[k].src;
+      append(result, (text_op_component){TEXT_OP_SKIP, .num = other->index[k].dst}, arena);
+    }
+  }
+  
+  while (read_component(other, &oc)) {
+    if (peek_type(op, iter) == TEXT_OP_NONE) {
+      break;
+    }
+    
+    switch (oc.type) {
+      case TEXT_OP_SKIP: {
+        size_t num = oc.num;
+        
+        while (num > 0) {
+          text_op_component c = take(op, &iter, num, TEXT_OP_INSERT);
+          if (c.type == TEXT_OP_NONE) {
+            break;
+          }
+          append(result, c, arena);
+          if (c.type != TEXT_OP_INSERT) {
             num -= c.num;
           }
         }
@@ -437,18 +1451,18 @@ void text_op_transform2(text_op *result, text_op *op, text_op *other, bool isLef
         // If isLeftHand and there's an insert next in the current op, the insert should go first.
         if (isLefthand && peek_type(op, iter) == TEXT_OP_INSERT) {
           // The left insert goes first.
-          append(result, take(op, &iter, SIZE_MAX, TEXT_OP_NONE));
+          append(result, take(op, &iter, SIZE_MAX, TEXT_OP_NONE), arena);
         }
         if (peek_type(op, iter) == TEXT_OP_NONE) {
           break;
         }
         text_op_component skip = {TEXT_OP_SKIP};
-        skip.num = str_num_chars(&other_components[i].str);
-        append(result, skip);
+        skip.num = reader_insert_length(other, &oc.str);
+        append(result, skip, arena);
         break;
       }
       case TEXT_OP_DELETE: {
-        size_t num = other_components[i].num;
+        size_t num = oc.num;
         
         while (num > 0) {
           text_op_component c = take(op, &iter, num, TEXT_OP_INSERT);
@@ -461,7 +1475,7 @@ void text_op_transform2(text_op *result, text_op *op, text_op *other, bool isLef
               num -= c.num;
               break;
             case TEXT_OP_INSERT:
-              append(result, c);
+              append(result, c, arena);
               break;
             case TEXT_OP_DELETE:
               // The delete is unnecessary now.
@@ -478,35 +1492,157 @@ void text_op_transform2(text_op *result, text_op *op, text_op *other, bool isLef
   
   while (iter.idx < (op->components ? op->num_components : 2)) {
     // The op doesn't have skips at the end. Just copy everything.
-    append(result, take(op, &iter, SIZE_MAX, TEXT_OP_NONE));
+    append(result, take(op, &iter, SIZE_MAX, TEXT_OP_NONE), arena);
+  }
+  
+  trim_trailing_skips(result);
+}
+
+void text_op_transform_many(text_op *result, text_op *op, const text_op *others, size_t n,
+    bool isLefthand) {
+  if (n == 0) {
+    text_op_clone2(result, op);
+    return;
+  }
+  
+  // Transforming against a composition of others isn't quite the same as transforming against
+  // them one by one (insert ties can come out differently), so walk the list. The intermediate ops
+  // bounce between two arenas, and only the final result gets allocated on the heap.
+  text_op_arena arenas[2];
+  text_op_arena_init(&arenas[0], 0);
+  text_op_arena_init(&arenas[1], 0);
+  
+  text_op cur = *op;
+  for (size_t i = 0; i < n; i++) {
+    text_op_arena *arena = NULL;
+    if (i < n - 1) {
+      arena = &arenas[i % 2];
+      text_op_arena_reset(arena);
+    }
+    
+    text_op next;
+    component_reader r;
+    reader_init_op(&r, &others[i]);
+    transform(&next, &cur, &r, isLefthand, arena);
+    cur = next;
+    
+    if (cur.components == NULL && cur.content.type == TEXT_OP_NONE) {
+      // Nothing left of the op. Transforming it any further won't bring it back.
+      break;
+    }
+  }
+  
+  if (cur.components == NULL && cur.content.type == TEXT_OP_NONE) {
+    init_op(result);
+  } else {
+    // The final transform was done straight onto the heap.
+    *result = cur;
   }
   
-  // Trim any trailing skips from the result.
-  if (result->components) {
-    while (result->num_components && result->components[result->num_components - 1].type
-           == TEXT_OP_SKIP) {
-      result->num_components--;
+  text_op_arena_destroy(&arenas[0]);
+  text_op_arena_destroy(&arenas[1]);
+}
+
+// The component currently being consumed from an op by transform_x.
+typedef struct {
+  component_reader r;
+  text_op_component c; // Type is TEXT_OP_NONE once the op is finished.
+  size_t remaining; // Characters left in c if its a skip or delete.
+} x_cursor;
+
+static inline void x_next(x_cursor *x) {
+  if (read_component(&x->r, &x->c)) {
+    x->remaining = x->c.type == TEXT_OP_INSERT ? 0 : x->c.num;
+  } else {
+    x->c.type = TEXT_OP_NONE;
+  }
+}
+
+// Emit the rest of x's current component into result and move on.
+static inline void x_flush(x_cursor *x, text_op *result) {
+  text_op_component c = x->c;
+  c.num = x->remaining;
+  append(result, c, NULL);
+  x_next(x);
+}
+
+void text_op_transform_x(text_op *result_a, text_op *result_b, text_op *a, text_op *b) {
+  init_op(result_a);
+  init_op(result_b);
+  
+  x_cursor x_a, x_b;
+  reader_init_op(&x_a.r, a);
+  reader_init_op(&x_b.r, b);
+  x_next(&x_a);
+  x_next(&x_b);
+  
+  text_op_component skip = {TEXT_OP_SKIP};
+  
+  while (true) {
+    if (x_a.c.type == TEXT_OP_INSERT) {
+      // Inserts don't consume anything from the other op. a is the left hand op, so if both ops
+      // insert at the same place, a's insert goes first.
+      append(result_a, x_a.c, NULL);
+      skip.num = str_num_chars(&x_a.c.str);
+      append(result_b, skip, NULL);
+      x_next(&x_a);
+    } else if (x_b.c.type == TEXT_OP_INSERT) {
+      append(result_b, x_b.c, NULL);
+      skip.num = str_num_chars(&x_b.c.str);
+      append(result_a, skip, NULL);
+      x_next(&x_b);
+    } else if (x_a.c.type == TEXT_OP_NONE) {
+      // Once one op runs out, the rest of the other op is kept as-is. (It can't have any inserts
+      // left, so this is just skips and deletes.)
+      if (x_b.c.type == TEXT_OP_NONE) break;
+      x_flush(&x_b, result_b);
+    } else if (x_b.c.type == TEXT_OP_NONE) {
+      x_flush(&x_a, result_a);
+    } else {
+      // Both ops skip or delete. Consume the same number of characters from each.
+      size_t len = MIN(x_a.remaining, x_b.remaining);
+      skip.num = len;
+      
+      if (x_a.c.type == TEXT_OP_SKIP) {
+        // If b deletes the characters, they're already gone. Otherwise b skips them too.
+        text_op_component c_b = x_b.c;
+        c_b.num = len;
+        append(result_b, c_b, NULL);
+        if (x_b.c.type == TEXT_OP_SKIP) {
+          append(result_a, skip, NULL);
+        }
+      } else if (x_b.c.type == TEXT_OP_SKIP) {
+        // a deletes, b skips.
+        text_op_component c_a = x_a.c;
+        c_a.num = len;
+        append(result_a, c_a, NULL);
+      }
+      // If they both delete the same characters, neither op needs to do anything.
+      
+      if ((x_a.remaining -= len) == 0) x_next(&x_a);
+      if ((x_b.remaining -= len) == 0) x_next(&x_b);
     }
   }
+  
+  trim_trailing_skips(result_a);
+  trim_trailing_skips(result_b);
 }
 
 void text_op_compose2(text_op *result, text_op *op1, text_op *op2) {
+  text_op_compose_arena(result, op1, op2, NULL);
+}
+
+void text_op_compose_arena(text_op *result, text_op *op1, text_op *op2, text_op_arena *arena) {
+  if (op1->components == NULL && op2->components == NULL
+      && compose_small(result, op1, op2, arena)) {
+    return;
+  }
   init_op(result);
   op_iter iter = {};
   
-  text_op_component *op2_c = op2->components;
-  size_t num_op2_c;
-  
   text_op_component inline_components[2];
-  if (op2_c == NULL) {
-    op2_c = inline_components;
-    num_op2_c = op2->content.type == TEXT_OP_NONE ? 0 : 2;
-    inline_components[0].type = TEXT_OP_SKIP;
-    inline_components[0].num = op2->skip;
-    inline_components[1] = op2->content;
-  } else {
-    num_op2_c = op2->num_components;
-  }
+  const text_op_component *op2_c;
+  size_t num_op2_c = text_op_components(op2, inline_components, &op2_c);
   
   for (int i = 0; i < num_op2_c; i++) {    
     switch (op2_c[i].type) {
@@ -519,7 +1655,7 @@ void text_op_compose2(text_op *result, text_op *op1, text_op *op2) {
             c.type = TEXT_OP_SKIP;
             c.num = num;
           }
-          append(result, c);
+          append(result, c, arena);
           if (c.type != TEXT_OP_DELETE) {
             num -= component_length(&c);
           }
@@ -527,7 +1663,7 @@ void text_op_compose2(text_op *result, text_op *op1, text_op *op2) {
         break;
       }
       case TEXT_OP_INSERT:
-        append(result, op2_c[i]);
+        append(result, op2_c[i], arena);
         break;
       case TEXT_OP_DELETE: {
         size_t offset = 0;
@@ -542,7 +1678,7 @@ void text_op_compose2(text_op *result, text_op *op1, text_op *op2) {
               c.num = clen - offset;
             case TEXT_OP_SKIP: {
               c.type = TEXT_OP_DELETE;
-              append(result, c);
+              append(result, c, arena);
               offset += c.num;
               break;
             }
@@ -551,7 +1687,7 @@ void text_op_compose2(text_op *result, text_op *op1, text_op *op2) {
               offset += str_num_chars(&c.str);
               break;
             case TEXT_OP_DELETE:
-              append(result, c);
+              append(result, c, arena);
               break;
           }
         }
@@ -564,15 +1700,166 @@ void text_op_compose2(text_op *result, text_op *op1, text_op *op2) {
   
   while (iter.idx < (op1->components ? op1->num_components : 2)) {
     // The op doesn't have skips at the end. Just copy everything.
-    append(result, take(op1, &iter, SIZE_MAX, TEXT_OP_NONE));
+    append(result, take(op1, &iter, SIZE_MAX, TEXT_OP_NONE), arena);
   }
 }
 
 
-int text_op_check(const rope *doc, const text_op *op) {
-  size_t doc_length = rope_char_count(doc);
+// Each level of compose_many composes pairs of ops from src into dest. A job covers a range of
+// those pairs.
+typedef struct {
+  text_op *src;
+  text_op *dest;
+  size_t begin, end; // Pair indexes
+  bool free_src; // Set if src is an intermediate level which we own.
+} compose_job;
+
+// Below this many pairs per thread, starting a thread costs more than it saves.
+#define COMPOSE_MIN_PAIRS_PER_THREAD 16
+
+// More threads than this are ignored. The job list lives on the stack.
+#define COMPOSE_MAX_THREADS 64
+
+static void *compose_pairs(void *job_) {
+  compose_job *job = job_;
+  for (size_t i = job->begin; i < job->end; i++) {
+    text_op_compose2(&job->dest[i], &job->src[2 * i], &job->src[2 * i + 1]);
+    if (job->free_src) {
+      text_op_free(&job->src[2 * i]);
+      text_op_free(&job->src[2 * i + 1]);
+    }
+  }
+  return NULL;
+}
+
+void text_op_compose_many(text_op *result, text_op *ops, size_t n) {
+  text_op_compose_many_threaded(result, ops, n, 1);
+}
+
+void text_op_compose_many_threaded(text_op *result, text_op *ops, size_t n, size_t num_threads) {
+  if (n == 0) {
+    init_op(result);
+    return;
+  } else if (n == 1) {
+    text_op_clone2(result, ops);
+    return;
+  }
+  
+  // Composing one op at a time onto an accumulator copies the accumulated op every step. Instead
+  // compose neighbouring pairs, then pairs of those, and so on. Each level only copies everything
+  // once, and the pairs in a level are independent so they can be spread across threads.
+  text_op *src = ops;
+  bool owned = false;
+  
+  while (n > 1) {
+    size_t num_pairs = n / 2;
+    size_t dest_len = num_pairs + n % 2;
+    text_op *dest = malloc(sizeof(text_op) * dest_len);
+    
+    size_t threads = MIN(MIN(num_threads, COMPOSE_MAX_THREADS),
+        num_pairs / COMPOSE_MIN_PAIRS_PER_THREAD);
+    if (threads <= 1) {
+      compose_job job = {src, dest, 0, num_pairs, owned};
+      compose_pairs(&job);
+    } else {
+      compose_job jobs[COMPOSE_MAX_THREADS];
+      pthread_t tids[COMPOSE_MAX_THREADS];
+      bool started[COMPOSE_MAX_THREADS];
+      for (size_t t = 0; t < threads; t++) {
+        jobs[t] = (compose_job){src, dest, num_pairs * t / threads, num_pairs * (t + 1) / threads,
+            owned};
+        // This thread does the last chunk itself. If a thread can't be started (eg, EAGAIN when
+        // the system is out of threads), its chunk is done here too.
+        started[t] = t < threads - 1 && pthread_create(&tids[t], NULL, compose_pairs, &jobs[t]) == 0;
+        if (!started[t]) {
+          compose_pairs(&jobs[t]);
+        }
+      }
+      for (size_t t = 0; t < threads - 1; t++) {
+        if (started[t]) {
+          pthread_join(tids[t], NULL);
+        }
+      }
+    }
+    
+    if (n % 2) {
+      // The odd one out goes straight through to the next level.
+      if (owned) {
+        dest[num_pairs] = src[n - 1];
+      } else {
+        text_op_clone2(&dest[num_pairs], &src[n - 1]);
+      }
+    }
+    
+    if (owned) {
+      free(src);
+    }
+    src = dest;
+    n = dest_len;
+    owned = true;
+  }
+  
+  *result = src[0];
+  free(src);
+}
+
+// Check the components of a big op (or a view) against a document of the given length.
+// Check the components in r can be applied to a document doc_length characters long. On success,
+// doc_length is updated to the length of the document once they're applied.
+static int check_components(size_t *doc_length_, component_reader *r) {
+  size_t doc_length = *doc_length_;
   size_t pos = 0;
+  text_op_component c;
+  text_op_component_type prev_type = TEXT_OP_NONE;
   
+  while (read_component(r, &c)) {
+    // Check the component type is different from the preceeding component.
+    if (c.type == prev_type) {
+      return 1;
+    }
+    switch (c.type) {
+      case TEXT_OP_SKIP: {
+        // pos never passes doc_length, so this can't wrap around.
+        if (c.num == 0 || c.num > doc_length - pos) {
+          return 1;
+        }
+        
+        pos += c.num;
+        break;
+      }
+      case TEXT_OP_INSERT: {
+        size_t slen = str_num_chars(&c.str);
+        if (slen == 0) {
+          return 1;
+        }
+        doc_length += slen;
+        pos += slen;
+        break;
+      }
+      case TEXT_OP_DELETE: {
+        if (c.num == 0 || c.num > doc_length - pos) {
+          return 1;
+        }
+        
+        doc_length -= c.num;
+        break;
+      }
+      default:
+        return 1;
+    }
+    prev_type = c.type;
+  }
+  
+  // Ops can't end with a skip.
+  if (prev_type == TEXT_OP_SKIP) {
+    return 1;
+  }
+  *doc_length_ = doc_length;
+  return 0;
+}
+
+// The same as check_components, but for a whole op.
+static int check_op(const text_op *op, size_t *doc_length) {
   if (op->components == NULL) {
     if (op->content.type == TEXT_OP_NONE) {
       return 0;
@@ -583,93 +1870,370 @@ int text_op_check(const rope *doc, const text_op *op) {
     }
     
     size_t len = op->content.type == TEXT_OP_DELETE ? op->content.num : 0;
-    if (op->skip + len > doc_length) {
+    if (op->skip > *doc_length || len > *doc_length - op->skip) {
       // Can't delete / skip past the end of the document.
       return 1;
     }
+    *doc_length += op->content.type == TEXT_OP_INSERT ? str_num_chars(&op->content.str) : 0;
+    *doc_length -= len;
+    return 0;
   } else {
-    for (int i = 0; i < op->num_components; i++) {
-      if (i >= 1) {
-        // Check the component type is different from the preceeding component.
-        if (op->components[i].type == op->components[i - 1].type) {
-          return 1;
+    component_reader r;
+    reader_init_op(&r, op);
+    return check_components(doc_length, &r);
+  }
+}
+
+int text_op_check(const rope *doc, const text_op *op) {
+  size_t doc_length = rope_char_count(doc);
+  return check_op(op, &doc_length);
+}
+
+int text_op_check_length(size_t doc_length, const text_op *op) {
+  return check_op(op, &doc_length);
+}
+
+int text_op_view_check(const rope *doc, const text_op_view *op) {
+  component_reader r;
+  reader_init_view(&r, op);
+  size_t doc_length = rope_char_count(doc);
+  return check_components(&doc_length, &r);
+}
+
+// rope_insert needs a \0 terminated string, so slices of a longer string are copied out first.
+static void insert_str(rope *doc, size_t pos, const str *s) {
+  if (str_is_terminated(s)) {
+    rope_insert(doc, pos, str_content(s));
+  } else {
+    size_t num_bytes = str_num_bytes(s);
+    uint8_t local[256];
+    uint8_t *cstr = num_bytes < sizeof(local) ? local : malloc(num_bytes + 1);
+    memcpy(cstr, str_content(s), num_bytes);
+    cstr[num_bytes] = '\0';
+    rope_insert(doc, pos, cstr);
+    if (cstr != local) {
+      free(cstr);
+    }
+  }
+}
+
+// Apply a list of components which have already been checked against the document.
+static void apply_checked(rope *doc, const text_op_component *components, size_t num) {
+  size_t pos = 0;
+  for (size_t i = 0; i < num; i++) {
+    const text_op_component *c = &components[i];
+    switch (c->type) {
+      case TEXT_OP_SKIP:
+        pos += c->num;
+        break;
+      case TEXT_OP_INSERT:
+        insert_str(doc, pos, &c->str);
+        pos += str_num_chars(&c->str);
+        break;
+      case TEXT_OP_DELETE:
+        rope_del(doc, pos, c->num);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+// Check the components in r against the document, then apply them. If the op is invalid the
+// document is left alone and this returns nonzero.
+static int apply_components(rope *doc, component_reader *r) {
+  text_op_component local[16];
+  text_op_component *decoded = local;
+  
+  if (r->components == NULL) {
+    // Decode the view up front so we don't have to read its inserts twice.
+    size_t n = 0, capacity = sizeof(local) / sizeof(local[0]);
+    text_op_component c;
+    while (read_component(r, &c)) {
+      if (n == capacity) {
+        capacity *= 2;
+        if (decoded == local) {
+          decoded = malloc(sizeof(text_op_component) * capacity);
+          memcpy(decoded, local, sizeof(local));
+        } else {
+          decoded = realloc(decoded, sizeof(text_op_component) * capacity);
         }
       }
-      switch (op->components[i].type) {
-        case TEXT_OP_SKIP: {
-          size_t num = op->components[i].num;
-          if (num == 0) {
-            return 1;
-          }
-          
-          pos += num;
-          
-          if (pos > doc_length) {
-            return 1;
-          }
-          break;
+      decoded[n++] = c;
+    }
+    r->components = decoded;
+    r->num_components = n;
+  }
+  
+  r->idx = 0;
+  size_t doc_length = rope_char_count(doc);
+  int result = check_components(&doc_length, r);
+  
+  if (result == 0) {
+    apply_checked(doc, r->components, r->num_components);
+  }
+  
+  if (decoded != local) {
+    free(decoded);
+  }
+  return result;
+}
+
+int text_op_apply(rope *doc, text_op *op) {
+  if (op->components) {
+    component_reader r;
+    reader_init_op(&r, op);
+    return apply_components(doc, &r);
+  } else {
+    // Checking a small op is just a bit of arithmetic.
+    size_t doc_length = rope_char_count(doc);
+    if (check_op(op, &doc_length)) {
+      return 1;
+    }
+    if (op->content.type == TEXT_OP_INSERT) {
+      insert_str(doc, op->skip, &op->content.str);
+    } else if (op->content.type == TEXT_OP_DELETE) {
+      rope_del(doc, op->skip, op->content.num);
+    }
+  }
+  return 0;
+}
+
+int text_op_view_apply(rope *doc, const text_op_view *op) {
+  component_reader r;
+  reader_init_view(&r, op);
+  return apply_components(doc, &r);
+}
+
+void text_op_invert2(text_op *result, const text_op *op, const rope *doc) {
+  result->components = NULL;
+  result->skip = 0;
+  result->content.type = TEXT_OP_NONE;
+  
+  // Deleted text is copied out of the rope's nodes into here. The deletes are in document order,
+  // so the nodes only need to be walked once.
+  uint8_t local[256];
+  uint8_t *buf = local;
+  size_t buf_capacity = sizeof(local);
+  rope_node *node = (rope_node *)&doc->head;
+  size_t node_start = 0;
+  
+  component_reader r;
+  reader_init_op(&r, op);
+  text_op_component c;
+  size_t pos = 0;
+  while (read_component(&r, &c)) {
+    switch (c.type) {
+      case TEXT_OP_SKIP:
+        append(result, c, NULL);
+        pos += c.num;
+        break;
+      case TEXT_OP_INSERT:
+        append(result, (text_op_component){TEXT_OP_DELETE, .num = str_num_chars(&c.str)}, NULL);
+        break;
+      case TEXT_OP_DELETE: {
+        while (node && node_start + rope_node_chars(node) <= pos) {
+          node_start += rope_node_chars(node);
+          node = node->nexts[0].node;
         }
-        case TEXT_OP_INSERT: {
-          size_t slen = str_num_chars(&op->components[i].str);
-          if (slen == 0) {
-            return 1;
+        
+        size_t num_bytes = 0;
+        size_t remaining = c.num;
+        while (node && remaining) {
+          uint8_t *data = rope_node_data(node);
+          size_t node_chars = rope_node_chars(node);
+          bool ascii = rope_node_num_bytes(node) == node_chars;
+          size_t offset = pos + c.num - remaining - node_start;
+          size_t len = MIN(node_chars - offset, remaining);
+          uint8_t *start = ascii ? data + offset : count_utf8_chars(data, offset);
+          uint8_t *end;
+          if (offset + len == node_chars) {
+            // The bytes after the end of the node aren't part of the document. Don't count them.
+            end = data + rope_node_num_bytes(node);
+          } else {
+            end = ascii ? start + len : count_utf8_chars(start, len);
           }
-          doc_length += slen;
-          pos += slen;
-          break;
-        }
-        case TEXT_OP_DELETE: {
-          size_t num = op->components[i].num;
-          if (num == 0 || doc_length < pos + num) {
-            return 1;
+          
+          if (num_bytes + (end - start) > buf_capacity) {
+            buf_capacity = MAX(buf_capacity * 2, num_bytes + (end - start));
+            if (buf == local) {
+              buf = malloc(buf_capacity);
+              memcpy(buf, local, num_bytes);
+            } else {
+              buf = realloc(buf, buf_capacity);
+            }
           }
+          memcpy(&buf[num_bytes], start, end - start);
+          num_bytes += end - start;
           
-          doc_length -= num;
-          break;
+          remaining -= len;
+          if (remaining) {
+            node_start += node_chars;
+            node = node->nexts[0].node;
+          }
         }
-        default:
-          return 1;
+        
+        text_op_component ins = {TEXT_OP_INSERT};
+        str_init3(&ins.str, buf, num_bytes, c.num - remaining);
+        append(result, ins, NULL);
+        str_destroy(&ins.str);
+        pos += c.num;
+        break;
       }
+      default:
+        break;
     }
-    if (op->num_components && op->components[op->num_components - 1].type == TEXT_OP_SKIP) {
-      return 1;
-    }
   }
+  trim_trailing_skips(result);
+  
+  if (buf != local) {
+    free(buf);
+  }
+}
+
+int text_op_apply_invertible(rope *doc, text_op *op, text_op *inverse) {
+  size_t doc_length = rope_char_count(doc);
+  if (check_op(op, &doc_length)) {
+    return 1;
+  }
+  text_op_invert2(inverse, op, doc);
+  
+  component_reader r;
+  reader_init_op(&r, op);
+  apply_checked(doc, r.components, r.num_components);
   return 0;
 }
 
-int text_op_apply(rope *doc, text_op *op) {
-#ifdef DEBUG
-  if (text_op_check(doc, op)) {
+int text_op_apply_str(str *dest, const str *s, const text_op *op, text_op_arena *arena) {
+  size_t num_chars = str_num_chars(s);
+  if (check_op(op, &num_chars)) {
     return 1;
   }
-#endif
   
-  if (op->components) {
+  // Work out how long the result is, then copy it together in one pass.
+  component_reader r;
+  reader_init_op(&r, op);
+  size_t max_bytes = str_num_bytes(s);
+  for (size_t i = 0; i < r.num_components; i++) {
+    if (r.components[i].type == TEXT_OP_INSERT) {
+      max_bytes += str_num_bytes(&r.components[i].str);
+    }
+  }
+  
+  const uint8_t *src = str_content(s), *src_end = src + str_num_bytes(s);
+  bool ascii = str_num_bytes(s) == str_num_chars(s);
+  uint8_t local[256];
+  uint8_t *buf = max_bytes <= sizeof(local) ? local : malloc(max_bytes);
+  uint8_t *out = buf;
+  for (size_t i = 0; i < r.num_components; i++) {
+    const text_op_component *c = &r.components[i];
+    switch (c->type) {
+      case TEXT_OP_SKIP:
+      case TEXT_OP_DELETE: {
+        // The op has been checked, but the copy is only safe while src stays inside the string, so
+        // don't trust that on its own. Every character is at least one byte.
+        if (c->num > (size_t)(src_end - src)) {
+          goto fail;
+        }
+        const uint8_t *end = ascii ? src + c->num : count_utf8_chars(src, c->num);
+        if (end > src_end) {
+          goto fail;
+        }
+        if (c->type == TEXT_OP_SKIP) {
+          memcpy(out, src, end - src);
+          out += end - src;
+        }
+        src = end;
+        break;
+      }
+      case TEXT_OP_INSERT:
+        memcpy(out, str_content(&c->str), str_num_bytes(&c->str));
+        out += str_num_bytes(&c->str);
+        break;
+      default:
+        break;
+    }
+  }
+  memcpy(out, src, src_end - src);
+  out += src_end - src;
+  
+  str_init3_arena(dest, buf, out - buf, num_chars, arena);
+  if (buf != local) {
+    free(buf);
+  }
+  return 0;
+  
+fail:
+  if (buf != local) {
+    free(buf);
+  }
+  return 1;
+}
+
+// Find the part of the document an op edits. start is where the first edit happens, and end is
+// just after the last edit, in the document the op produces.
+static void edit_range(const text_op *op, size_t *start, size_t *end) {
+  if (op->components == NULL) {
+    *start = op->skip;
+    *end = op->skip + (op->content.type == TEXT_OP_INSERT ? str_num_chars(&op->content.str) : 0);
+  } else {
+    const text_op_component *c = op->components;
+    *start = op->num_components && c[0].type == TEXT_OP_SKIP ? c[0].num : 0;
     size_t pos = 0;
-    for (int i = 0; i < op->num_components; i++) {
-      switch (op->components[i].type) {
-        case TEXT_OP_SKIP:
-          pos += op->components[i].num;
-          break;
-        case TEXT_OP_INSERT:
-          rope_insert(doc, pos, str_content(&op->components[i].str));
-          pos += str_num_chars(&op->components[i].str);
-          break;
-        case TEXT_OP_DELETE:
-          rope_del(doc, pos, op->components[i].num);
-          break;
-        default:
-          return 1;
+    for (size_t i = 0; i < op->num_components; i++) {
+      if (c[i].type != TEXT_OP_DELETE) {
+        pos += component_length(&c[i]);
       }
     }
+    *end = pos;
+  }
+}
+
+// Ops which edit within this many characters of the previous op are composed together before
+// they're applied.
+#define APPLY_MANY_NEARBY 32
+
+// Apply a run of ops which have already been checked.
+static void apply_run(rope *doc, text_op *ops, size_t n) {
+  if (n == 1) {
+    text_op_apply(doc, ops);
   } else {
-    if (op->content.type == TEXT_OP_INSERT) {
-      rope_insert(doc, op->skip, str_content(&op->content.str));
-    } else if (op->content.type == TEXT_OP_DELETE) {
-      rope_del(doc, op->skip, op->content.num);
+    text_op composed;
+    text_op_compose_many(&composed, ops, n);
+    text_op_apply(doc, &composed);
+    text_op_free(&composed);
+  }
+}
+
+int text_op_apply_many(rope *doc, text_op *ops, size_t n) {
+  // Check everything first, so nothing is applied if any of the ops are bad.
+  size_t doc_length = rope_char_count(doc);
+  for (size_t i = 0; i < n; i++) {
+    if (check_op(&ops[i], &doc_length)) {
+      return 1;
     }
   }
+  
+  // Every op costs a few trips through the rope. Runs of ops editing the same area (like someone
+  // typing) compose down to a handful of edits, so compose them first and apply them all at once.
+  // Ops which jump around the document wouldn't compose into anything smaller, so they're applied
+  // one at a time.
+  size_t run_start = 0;
+  size_t prev_start = 0, prev_end = 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t start, end;
+    edit_range(&ops[i], &start, &end);
+    if (i > run_start
+        && (start + APPLY_MANY_NEARBY < prev_start || start > prev_end + APPLY_MANY_NEARBY)) {
+      apply_run(doc, &ops[run_start], i - run_start);
+      run_start = i;
+    }
+    prev_start = start;
+    prev_end = end;
+  }
+  if (n > run_start) {
+    apply_run(doc, &ops[run_start], n - run_start);
+  }
   return 0;
 }
 
@@ -678,31 +2242,46 @@ int text_cursor_check(const rope *doc, text_cursor cursor) {
   return cursor.start > len || cursor.end > len;
 }
 
-static size_t transform_position(size_t cursor, const text_op *op) {
-  if (op->components) {
-    size_t pos = 0;
-    // I could actually use the op_iter stuff above - but I think its simpler like this.
-    for (int i = 0; i < op->num_components && cursor > pos; i++) {
-      switch (op->components[i].type) {
-        case TEXT_OP_SKIP:
-          if (cursor <= pos + op->components[i].num) {
-            return cursor;
-          }
-          pos += op->components[i].num;
-          break;
-        case TEXT_OP_INSERT: {
-          size_t len = str_num_chars(&op->components[i].str);
-          pos += len;
-          cursor += len;
-          break;
+static size_t transform_position_components(size_t cursor, component_reader *r) {
+  size_t pos = 0;
+  text_op_component c;
+  while (cursor > pos && read_component(r, &c)) {
+    switch (c.type) {
+      case TEXT_OP_SKIP:
+        if (cursor <= pos + c.num) {
+          return cursor;
         }
-        case TEXT_OP_DELETE:
-          cursor -= MIN(op->components[i].num, cursor - pos);
-          break;
-        default: break;
+        pos += c.num;
+        break;
+      case TEXT_OP_INSERT: {
+        size_t len = reader_insert_length(r, &c.str);
+        pos += len;
+        cursor += len;
+        break;
       }
+      case TEXT_OP_DELETE:
+        cursor -= MIN(c.num, cursor - pos);
+        break;
+      default: break;
+    }
+  }
+  return cursor;
+}
+
+static size_t transform_position(size_t cursor, const text_op *op) {
+  const index_entry *index = op_index(op);
+  if (index) {
+    // Find the component the cursor is in. This gives the same result as reading up to it.
+    size_t k = index_find(index, op->num_components, cursor);
+    if (k < op->num_components && cursor > index[k].src
+        && op->components[k].type == TEXT_OP_DELETE) {
+      return index[k].dst;
     }
-    return cursor;
+    return cursor + index[k].dst - index[k].src;
+  } else if (op->components) {
+    component_reader r;
+    reader_init_op(&r, op);
+    return transform_position_components(cursor, &r);
   } else {
     // Tiny op, owned by someone else.
     switch (op->content.type) {
@@ -715,31 +2294,103 @@ static size_t transform_position(size_t cursor, const text_op *op) {
   }
 }
 
+// Maps positions through an op's components. The mapper remembers how far through the op it got
+// last time, so mapping positions in order only walks the op once. It can walk backwards too, so
+// positions which are a little out of order (like the ends of selections) are cheap as well.
+typedef struct {
+  const text_op_component *components;
+  size_t num_components;
+  size_t idx; // The next component.
+  size_t pos; // The position of the next component in the original document.
+  ssize_t delta; // How far positions after pos have moved.
+} position_mapper;
+
+// Would the cursor move past the end of component c, starting at pos?
+static inline bool mapper_passes(const text_op_component *c, size_t pos, size_t cursor) {
+  return c->type == TEXT_OP_INSERT ? cursor > pos : cursor > pos + c->num;
+}
+
+// This gives the same result as transform_position.
+static size_t mapper_map(position_mapper *m, size_t cursor) {
+  const text_op_component *c = m->components;
+  
+  // Back up to the first component the cursor doesn't get past.
+  while (m->idx > 0) {
+    const text_op_component *prev = &c[m->idx - 1];
+    size_t prev_pos = prev->type == TEXT_OP_INSERT ? m->pos : m->pos - prev->num;
+    if (mapper_passes(prev, prev_pos, cursor)) {
+      break;
+    }
+    m->idx--;
+    m->pos = prev_pos;
+    switch (prev->type) {
+      case TEXT_OP_INSERT: m->delta -= str_num_chars(&prev->str); break;
+      case TEXT_OP_DELETE: m->delta += prev->num; break;
+      default: break;
+    }
+  }
+  
+  // Then walk forwards past all the components the cursor does get past.
+  while (m->idx < m->num_components && mapper_passes(&c[m->idx], m->pos, cursor)) {
+    const text_op_component *next = &c[m->idx++];
+    switch (next->type) {
+      case TEXT_OP_SKIP: m->pos += next->num; break;
+      case TEXT_OP_INSERT: m->delta += str_num_chars(&next->str); break;
+      case TEXT_OP_DELETE: m->pos += next->num; m->delta -= next->num; break;
+      default: break;
+    }
+  }
+  
+  if (m->idx < m->num_components && cursor > m->pos && c[m->idx].type == TEXT_OP_DELETE) {
+    // The cursor's text was deleted. It ends up where the deletion happened.
+    return m->pos + m->delta;
+  }
+  return cursor + m->delta;
+}
+
+void text_op_transform_cursors(text_cursor *cursors, size_t n, const text_op *op) {
+  component_reader r;
+  reader_init_op(&r, op);
+  position_mapper m = {r.components, r.num_components, 0, 0, 0};
+  for (size_t i = 0; i < n; i++) {
+    cursors[i].start = mapper_map(&m, cursors[i].start);
+    cursors[i].end = mapper_map(&m, cursors[i].end);
+  }
+}
+
+// Find where the owner's cursor ends up: the end of the last insert or the last deletion site.
+static size_t own_cursor_position(component_reader *r) {
+  size_t pos = 0;
+  text_op_component c;
+  // Just track the position. We'll teleport the cursor to the end anyway.
+  while (read_component(r, &c)) {
+    switch (c.type) {
+        // We're guaranteed that a valid operation won't end in a skip.
+      case TEXT_OP_SKIP:
+        pos += c.num;
+        break;
+      case TEXT_OP_INSERT:
+        pos += reader_insert_length(r, &c.str);
+        break;
+      default: // Just eat deletes.
+        break;
+    }
+  }
+  return pos;
+}
+
 text_cursor text_op_transform_cursor(text_cursor cursor, const text_op *op, bool is_own_op) {
   if (is_own_op) {
     size_t pos = 0;
     if (op->components) {
-      // Just track the position. We'll teleport the cursor to the end anyway.
-      for (int i = 0; i < op->num_components; i++) {
-        switch (op->components[i].type) {
-            // We're guaranteed that a valid operation won't end in a skip.
-          case TEXT_OP_SKIP:
-            pos += op->components[i].num;
-            break;
-          case TEXT_OP_INSERT:
-            pos += str_num_chars(&op->components[i].str);
-            break;
-          default: // Just eat deletes.
-            break;
-        }
-      }
+      component_reader r;
+      reader_init_op(&r, op);
+      pos = own_cursor_position(&r);
     } else {
-      if (is_own_op) {
-        switch (op->content.type) {
-          case TEXT_OP_INSERT: pos = op->skip + str_num_chars(&op->content.str); break;
-          case TEXT_OP_DELETE: pos = op->skip; break;
-          default:     return cursor;
-        }
+      switch (op->content.type) {
+        case TEXT_OP_INSERT: pos = op->skip + str_num_chars(&op->content.str); break;
+        case TEXT_OP_DELETE: pos = op->skip; break;
+        default:     return cursor;
       }
     }
     return text_cursor_make(pos, pos);
@@ -747,3 +2398,208 @@ text_cursor text_op_transform_cursor(text_cursor cursor, const text_op *op, bool
     return text_cursor_make(transform_position(cursor.start, op), transform_position(cursor.end, op));
   }
 }
+
+text_cursor text_op_view_transform_cursor(text_cursor cursor, const text_op_view *op,
+    bool is_own_op) {
+  if (is_own_op) {
+    if (*view_start(op) == 0) {
+      // Empty ops leave the cursor alone.
+      return cursor;
+    }
+    component_reader r;
+    reader_init_view(&r, op);
+    size_t pos = own_cursor_position(&r);
+    return text_cursor_make(pos, pos);
+  } else {
+    component_reader start_r, end_r;
+    reader_init_view(&start_r, op);
+    reader_init_view(&end_r, op);
+    return text_cursor_make(transform_position_components(cursor.start, &start_r),
+        transform_position_components(cursor.end, &end_r));
+  }
+}
+
+// **** UTF-16 positions
+
+// Walks a document finding where UTF-16 positions are in characters, and the other way around.
+typedef struct {
+  const rope *doc;
+  // The node the last position was in, and where it starts. Only used when the rope doesn't track
+  // UTF-16 lengths itself.
+  rope_node *node;
+  size_t chars, units, node_units;
+} utf16_seeker;
+
+static inline size_t lead_byte_size(uint8_t b) {
+  return b < 0x80 ? 1 : b < 0xe0 ? 2 : b < 0xf0 ? 3 : 4;
+}
+
+static inline size_t node_utf16_units(rope_node *node) {
+  size_t num_bytes = rope_node_num_bytes(node), num_chars = rope_node_chars(node);
+  // Nodes without enough extra bytes for a 4 byte character don't need scanning.
+  return num_bytes - num_chars < 3 ? num_chars : count_utf16_units(rope_node_data(node), num_bytes);
+}
+
+static void seeker_init(utf16_seeker *s, const rope *doc) {
+  s->doc = doc;
+  s->node = (rope_node *)&doc->head;
+  s->chars = s->units = 0;
+#if !ROPE_WCHAR
+  s->node_units = node_utf16_units(s->node);
+#endif
+}
+
+// Find pos (in UTF-16 units if from_utf16 is set, otherwise in characters) in the document, and
+// write it out in the other unit. Returns nonzero if pos is past the end of the document, or in
+// the middle of a surrogate pair. Without ROPE_WCHAR, positions must be looked up in order.
+static int seeker_find(utf16_seeker *s, size_t pos, bool from_utf16, size_t *result) {
+#if ROPE_WCHAR
+  // Walk down the skip list from the top, the same way librope finds character positions.
+  rope_node *node = (rope_node *)&s->doc->head;
+  size_t chars = 0, units = 0;
+  for (int height = s->doc->head.height; height-- > 0;) {
+    while (node->nexts[height].node) {
+      const rope_skip_node *next = &node->nexts[height];
+      if ((from_utf16 ? units + next->wchar_size : chars + next->skip_size) >= pos) {
+        break;
+      }
+      chars += next->skip_size;
+      units += next->wchar_size;
+      node = next->node;
+    }
+  }
+#else
+  // The rope only knows how many characters its nodes hold, so walk forwards through them,
+  // counting UTF-16 units as we go. Ops are read from start to end, so converting one walks the
+  // document at most once.
+  rope_node *node = s->node;
+  while (node->nexts[0].node
+      && (from_utf16 ? s->units + s->node_units : s->chars + rope_node_chars(node)) < pos) {
+    s->chars += rope_node_chars(node);
+    s->units += s->node_units;
+    node = node->nexts[0].node;
+    s->node_units = node_utf16_units(node);
+  }
+  s->node = node;
+  size_t chars = s->chars, units = s->units;
+#endif
+  
+  const uint8_t *data = rope_node_data(node);
+  size_t num_bytes = rope_node_num_bytes(node);
+  if (num_bytes == rope_node_chars(node)) {
+    // The node is all ascii, so units and characters are the same.
+    size_t offset = pos - (from_utf16 ? units : chars);
+    if (offset > num_bytes) {
+      return 1;
+    }
+    *result = (from_utf16 ? chars : units) + offset;
+    return 0;
+  }
+  
+  for (size_t i = 0; (from_utf16 ? units : chars) < pos; chars++) {
+    if (i == num_bytes) {
+      return 1;
+    }
+    size_t size = lead_byte_size(data[i]);
+    units += size == 4 ? 2 : 1;
+    i += size;
+  }
+  if (units > pos && from_utf16) {
+    // pos splits a surrogate pair.
+    return 1;
+  }
+  *result = from_utf16 ? chars : units;
+  return 0;
+}
+
+// A document with no characters outside the BMP counts the same in characters and UTF-16 units.
+// Like strings, that's the case whenever it has fewer than 3 extra bytes per 4 byte character.
+static inline bool doc_is_bmp(const rope *doc) {
+  return rope_byte_count(doc) - rope_char_count(doc) < 3;
+}
+
+static int convert_utf16(text_op *dest, const text_op *op, const rope *doc, bool from_utf16) {
+  if (doc_is_bmp(doc)) {
+    // Nothing to convert. The clone shares op's components.
+    if (text_op_check(doc, op)) {
+      return 1;
+    }
+    text_op_clone2(dest, (text_op *)op);
+    return 0;
+  }
+  
+  init_op(dest);
+  utf16_seeker s;
+  seeker_init(&s, doc);
+  component_reader r;
+  reader_init_op(&r, op);
+  text_op_component c;
+  // How far through the document we are, in the op's units and in dest's units.
+  size_t pos = 0, converted = 0;
+  while (read_component(&r, &c)) {
+    if (c.type == TEXT_OP_SKIP || c.type == TEXT_OP_DELETE) {
+      size_t end;
+      if (c.num > SIZE_MAX - pos || seeker_find(&s, pos + c.num, from_utf16, &end)) {
+        text_op_free(dest);
+        init_op(dest);
+        return 1;
+      }
+      pos += c.num;
+      c.num = end - converted;
+      converted = end;
+    }
+    append(dest, c, NULL);
+  }
+  return 0;
+}
+
+int text_op_from_utf16(text_op *dest, const text_op *op, const rope *doc) {
+  return convert_utf16(dest, op, doc, true);
+}
+
+int text_op_to_utf16(text_op *dest, const text_op *op, const rope *doc) {
+  return convert_utf16(dest, op, doc, false);
+}
+
+int text_op_apply_utf16(rope *doc, const text_op *op) {
+  if (doc_is_bmp(doc)) {
+    return text_op_apply(doc, (text_op *)op);
+  }
+  text_op converted;
+  if (text_op_from_utf16(&converted, op, doc)) {
+    return 1;
+  }
+  int result = text_op_apply(doc, &converted);
+  text_op_free(&converted);
+  return result;
+}
+
+void text_op_transform_utf16(text_op *result, text_op *op, text_op *other, bool isLefthand) {
+  component_reader r;
+  reader_init_op(&r, other);
+  // The index counts characters, so it's no use here.
+  r.index = NULL;
+  r.utf16 = true;
+  transform(result, op, &r, isLefthand, NULL);
+}
+
+text_cursor text_op_transform_cursor_utf16(text_cursor cursor, const text_op *op,
+    bool is_own_op) {
+  if (is_own_op) {
+    if (op->components == NULL && op->content.type == TEXT_OP_NONE) {
+      return cursor;
+    }
+    component_reader r;
+    reader_init_op(&r, op);
+    r.utf16 = true;
+    size_t pos = own_cursor_position(&r);
+    return text_cursor_make(pos, pos);
+  } else {
+    component_reader start_r, end_r;
+    reader_init_op(&start_r, op);
+    reader_init_op(&end_r, op);
+    start_r.utf16 = end_r.utf16 = true;
+    return text_cursor_make(transform_position_components(cursor.start, &start_r),
+        transform_position_components(cursor.end, &end_r));
+  }
+}
@@ -16,8 +16,10 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 #include "str.h"
+#include "arena.h"
 #include "rope.h"
 
 typedef enum {
@@ -66,18 +68,109 @@ typedef struct {
   size_t end;
 } text_cursor;
 
+// A read-only op which reads its components straight out of the bytes written by
+// text_op_to_bytes or text_op_to_bytes_v2. Nothing is copied - inserts point into the buffer, so the buffer must stay
+// alive (and unchanged) as long as the view is in use. Views are useful when an op only needs
+// to be inspected, applied or forwarded.
+typedef struct {
+  const uint8_t *bytes;
+  size_t num_bytes;
+} text_op_view;
+
+// Iterator for reading the components out of a view. Zero-initialize it to start at the front.
+typedef struct {
+  const uint8_t *pos;
+} text_op_view_iter;
+
 void text_op_from_components2(text_op *dest, text_op_component components[], size_t num);
 
+// Builds an op one component at a time, without an array of components in between. Adjacent
+// components of the same type are merged and empty ones are dropped, so the result is the same as
+// text_op_from_components would make.
+typedef struct {
+  text_op op;
+} text_op_builder;
+
+// Start building an op. If you know roughly how many components it'll have, pass that as
+// capacity and they'll be allocated up front.
+void text_op_builder_init(text_op_builder *builder, size_t capacity);
+void text_op_builder_skip(text_op_builder *builder, size_t num);
+void text_op_builder_delete(text_op_builder *builder, size_t num);
+
+// Insert a string. The builder takes ownership of s (so don't destroy it), which saves copying
+// it. s must own its content - it can't be a view or a slice.
+void text_op_builder_insert(text_op_builder *builder, str *s);
+
+// Write the finished op into dest. The builder is empty afterwards.
+void text_op_builder_finish(text_op_builder *builder, text_op *dest);
+
 // Returns bytes read on success, negative on failure.
 ssize_t text_op_from_bytes(text_op *dest, void *bytes, size_t num_bytes);
 
+// Point a view at the op encoded in bytes. The op is checked to be well formed, but not decoded.
+// Returns bytes used on success (this might be less than num_bytes), negative on failure.
+ssize_t text_op_view_init(text_op_view *view, const void *bytes, size_t num_bytes);
+
+// Read the next component out of the view into c. Returns false when there are no more
+// components. Inserts are views into the buffer (see str_init_view).
+bool text_op_view_next(const text_op_view *view, text_op_view_iter *iter, text_op_component *c);
+
+// Copy a view into a normal op.
+void text_op_from_view(text_op *dest, const text_op_view *view);
+
 typedef void (*text_write_fn)(void *bytes, size_t num, void *user);
+
+// Write the op out using the original (v1) encoding. Skips and deletes are stored in 32 bits, so
+// longer lengths are truncated.
 void text_op_to_bytes(text_op *op, text_write_fn write, void *user);
 
+// Write the op out using the compact v2 encoding. Lengths are varints (so small edits only take a
+// few bytes) and inserts carry their own character count, which makes them faster to read.
+// text_op_from_bytes and text_op_view_init accept either encoding.
+void text_op_to_bytes_v2(text_op *op, text_write_fn write, void *user);
+
+// Read an op written as JSON, the way the javascript text type does: [3, "hi", {"d":5}]. Nothing
+// is allocated apart from the op itself. Returns bytes read on success, negative on failure.
+ssize_t text_op_from_json(text_op *dest, const void *json, size_t num_bytes);
+
+// Write the op out as JSON. Text is written as utf8, escaping only what JSON requires.
+void text_op_to_json(text_op *op, text_write_fn write, void *user);
+
+// Ops are immutable once they've been made, so cloning one is cheap - the clone shares the
+// original's components (and strings) using a reference count. The last one freed cleans up.
+// Clones can be freed from any thread.
 void text_op_clone2(text_op *dest, text_op *src);
+
+// Give op its own copy of its components if they're shared with a clone. Call this before
+// changing op->components directly.
+void text_op_make_mutable(text_op *op);
+
+// Index the positions of a big op's components. Transforming ops and cursors by an indexed op
+// binary searches straight to the place they edit, instead of reading through every component
+// in front of it. This is worth doing for huge ops (like a big find and replace) which lots of
+// small ops get transformed by. Building the index reads the whole op once. Clones share the
+// index. Small ops and ops in an arena are never indexed.
+void text_op_build_index(text_op *op);
+
 void text_op_transform2(text_op *result, text_op *op, text_op *other, bool isLefthand);
 void text_op_compose2(text_op *result, text_op *op1, text_op *op2);
 
+// Transform op by an op view.
+void text_op_transform_view2(text_op *result, text_op *op, const text_op_view *other,
+    bool isLefthand);
+
+// Variants of the functions above which build the resulting op in an arena. The op shares the
+// arena's lifetime - don't pass it to text_op_free. Instead reset the arena once you're done with
+// everything in it. If arena is NULL, these behave exactly like the normal versions.
+void text_op_transform_arena(text_op *result, text_op *op, text_op *other, bool isLefthand,
+    text_op_arena *arena);
+void text_op_compose_arena(text_op *result, text_op *op1, text_op *op2, text_op_arena *arena);
+ssize_t text_op_from_bytes_arena(text_op *dest, void *bytes, size_t num_bytes,
+    text_op_arena *arena);
+void text_op_clone_arena(text_op *dest, text_op *src, text_op_arena *arena);
+ssize_t text_op_from_json_arena(text_op *dest, const void *json, size_t num_bytes,
+    text_op_arena *arena);
+
 
 // Create and return a new text op which inserts the specified string at pos.
 text_op text_op_insert(size_t pos, const uint8_t *str);
@@ -94,6 +187,28 @@ static inline text_op text_op_from_components(text_op_component components[], si
   return result;
 }
 
+// Get an op's list of components. Small ops store their edit inline rather than in a list, so
+// their components are unpacked into local. Returns the number of components.
+static inline size_t text_op_components(const text_op *op, text_op_component local[2],
+    const text_op_component **components) {
+  if (op->components) {
+    *components = op->components;
+    return op->num_components;
+  }
+  
+  *components = local;
+  if (op->content.type == TEXT_OP_NONE) {
+    return 0;
+  } else if (op->skip == 0) {
+    local[0] = op->content;
+    return 1;
+  }
+  local[0].type = TEXT_OP_SKIP;
+  local[0].num = op->skip;
+  local[1] = op->content;
+  return 2;
+}
+
 // Make a copy of an op.
 static inline text_op text_op_clone(text_op *src) {
   text_op result;
@@ -104,7 +219,8 @@ static inline text_op text_op_clone(text_op *src) {
 // Write the op out to standard out.
 void text_op_print(const text_op *op);
 
-// Apply an operation to the specified document.
+// Apply an operation to the specified document. The op is checked as it goes, so there's no need
+// to call text_op_check first. If the op can't be applied the document is left unchanged.
 // returns 0 on success, nonzero on failure.
 int text_op_apply(rope *doc, text_op *op);
 
@@ -112,6 +228,40 @@ int text_op_apply(rope *doc, text_op *op);
 // nonzero on failure.
 int text_op_check(const rope *doc, const text_op *op);
 
+// The same as text_op_check, but against any document doc_length characters long.
+int text_op_check_length(size_t doc_length, const text_op *op);
+
+// Apply a list of ops to the document, one after the other. This is much faster than calling
+// text_op_apply in a loop when the ops are clustered together (like when replaying a history of
+// typing). The ops are all checked first - if any of them are invalid, nothing is applied.
+// returns 0 on success, nonzero on failure.
+int text_op_apply_many(rope *doc, text_op *ops, size_t n);
+
+// Ops don't remember the text they delete, so they can only be inverted with the document they
+// apply to in hand. The inverse inserts the text op deletes (copied out of doc) and deletes the
+// text op inserts. op must be valid for doc.
+void text_op_invert2(text_op *result, const text_op *op, const rope *doc);
+
+static inline text_op text_op_invert(const text_op *op, const rope *doc) {
+  text_op result;
+  text_op_invert2(&result, op, doc);
+  return result;
+}
+
+// Apply an op like text_op_apply, and write the op which undoes it into inverse. The deleted text
+// is captured on the way through. returns 0 on success, nonzero on failure (in which case inverse
+// is left alone).
+int text_op_apply_invertible(rope *doc, text_op *op, text_op *inverse);
+
+// Apply an op to a string rather than a rope, writing the edited string into dest. This is handy
+// for short strings which don't need a whole rope. dest is allocated in the arena if there is
+// one. returns 0 on success, nonzero (leaving dest alone) if the op doesn't fit the string.
+int text_op_apply_str(str *dest, const str *s, const text_op *op, text_op_arena *arena);
+
+// The same as text_op_apply and text_op_check, but reading the op out of a view.
+int text_op_view_apply(rope *doc, const text_op_view *op);
+int text_op_view_check(const rope *doc, const text_op_view *op);
+
 // Transform an op by another op.
 // isLeftHand is used to break ties when both ops insert at the same position in the document.
 static inline text_op text_op_transform(text_op *op, text_op *other, bool isLefthand) {
@@ -120,6 +270,19 @@ static inline text_op text_op_transform(text_op *op, text_op *other, bool isLeft
   return result;
 }
 
+// Transform a and b by each other at the same time. This produces the same result as
+//   text_op_transform2(result_a, a, b, true);
+//   text_op_transform2(result_b, b, a, false);
+// but only walks the ops once. a is the left hand op.
+void text_op_transform_x(text_op *result_a, text_op *result_b, text_op *a, text_op *b);
+
+// Transform op by a list of ops, one after the other. This is what a server does when a client
+// submits an op a few versions behind: others are the ops the client hasn't seen yet, in order.
+// It gives the same result as calling text_op_transform n times, but only the result is
+// allocated on the heap.
+void text_op_transform_many(text_op *result, text_op *op, const text_op *others, size_t n,
+    bool isLefthand);
+
 // Compose 2 ops together to produce a single operation. When the result is applied to a document,
 // it has the same effect as applying op1 followed by op2.
 static inline text_op text_op_compose(text_op *op1, text_op *op2) {
@@ -128,6 +291,14 @@ static inline text_op text_op_compose(text_op *op1, text_op *op2) {
   return result;
 }
 
+// Compose a list of ops together. The result has the same effect as applying each op in turn.
+// This is much faster than composing them one at a time for long lists.
+void text_op_compose_many(text_op *result, text_op *ops, size_t n);
+
+// The same as text_op_compose_many, but spreading the work across up to num_threads threads (at
+// most 64). If threads can't be started, the work is done on the calling thread instead.
+void text_op_compose_many_threaded(text_op *result, text_op *ops, size_t n, size_t num_threads);
+
 static inline text_cursor text_cursor_make(size_t start, size_t end) {
   return (text_cursor){start, end};
 }
@@ -138,5 +309,35 @@ int text_cursor_check(const rope *doc, text_cursor cursor);
 // Transform a cursor by an operation. is_own_op is set if the operation was sent by the cursor's
 // owner.
 text_cursor text_op_transform_cursor(text_cursor cursor, const text_op *op, bool is_own_op);
+// Transform lots of cursors (owned by other people) by an op in one pass over the op. Any order
+// works, but sorting the cursors by their start position makes this much faster than calling
+// text_op_transform_cursor for each of them. The cursors are updated in place.
+void text_op_transform_cursors(text_cursor *cursors, size_t n, const text_op *op);
+
+text_cursor text_op_view_transform_cursor(text_cursor cursor, const text_op_view *op,
+    bool is_own_op);
+
+// UTF-16 positions. Javascript strings count UTF-16 code units, so every character outside the
+// BMP (like most emoji) shifts a browser's positions by one. In a UTF-16 op, skips and deletes
+// count UTF-16 code units instead of characters. Inserts are still utf8.
+
+// Convert an op between UTF-16 and character positions, using the document it applies to. returns
+// 0 on success, nonzero if the op doesn't fit the document or a UTF-16 position falls between the
+// two halves of a surrogate pair. Ops on documents without any characters outside the BMP are
+// just cloned. Otherwise when librope is built with ROPE_WCHAR (so it counts UTF-16 units too),
+// each position is found in O(log n) time. Without it the document is walked once, up to the
+// op's last edit.
+int text_op_from_utf16(text_op *dest, const text_op *op, const rope *doc);
+int text_op_to_utf16(text_op *dest, const text_op *op, const rope *doc);
+
+// Apply a UTF-16 op. Like text_op_apply, the document is left alone if the op doesn't fit.
+int text_op_apply_utf16(rope *doc, const text_op *op);
+
+// Transform UTF-16 ops and cursors. These work like the normal versions, but measure inserts in
+// UTF-16 units, so they don't need the document. There's no UTF-16 compose - convert the ops to
+// characters first.
+void text_op_transform_utf16(text_op *result, text_op *op, text_op *other, bool isLefthand);
+text_cursor text_op_transform_cursor_utf16(text_cursor cursor, const text_op *op,
+    bool is_own_op);
 
 #endif
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+#include "undo.h"
+
+static inline bool is_noop(const text_op *op) {
+  return op->components ? op->num_components == 0 : op->content.type == TEXT_OP_NONE;
+}
+
+void ot_text_undo_init(ot_text_undo *undo, size_t max_entries) {
+  undo->undo = malloc(sizeof(text_op) * max_entries);
+  undo->redo = malloc(sizeof(text_op) * max_entries);
+  undo->num_undo = undo->num_redo = 0;
+  undo->max_entries = max_entries;
+}
+
+static void clear(text_op *ops, size_t *num) {
+  for (size_t i = 0; i < *num; i++) {
+    text_op_free(&ops[i]);
+  }
+  *num = 0;
+}
+
+void ot_text_undo_destroy(ot_text_undo *undo) {
+  clear(undo->undo, &undo->num_undo);
+  clear(undo->redo, &undo->num_redo);
+  free(undo->undo);
+  free(undo->redo);
+}
+
+// Push op onto a stack, taking ownership of it.
+static void push(ot_text_undo *undo, text_op *ops, size_t *num, text_op *op) {
+  if (*num == undo->max_entries) {
+    if (*num == 1) {
+      // There's only room for one entry, so it undoes everything.
+      text_op composed;
+      text_op_compose2(&composed, op, &ops[0]);
+      text_op_free(&ops[0]);
+      text_op_free(op);
+      ops[0] = composed;
+      return;
+    } else {
+      // The second oldest op is undone before the oldest one, so compose them in that order.
+      text_op composed;
+      text_op_compose2(&composed, &ops[1], &ops[0]);
+      text_op_free(&ops[0]);
+      text_op_free(&ops[1]);
+      ops[0] = composed;
+      memmove(&ops[1], &ops[2], sizeof(text_op) * (*num - 2));
+      (*num)--;
+    }
+  }
+  ops[(*num)++] = *op;
+}
+
+void ot_text_undo_push(ot_text_undo *undo, text_op *inverse) {
+  if (is_noop(inverse)) {
+    text_op_free(inverse);
+    return;
+  }
+  clear(undo->redo, &undo->num_redo);
+  push(undo, undo->undo, &undo->num_undo, inverse);
+}
+
+// Transform a stack by op, which applies to the current document. Starting at the top, each entry
+// is transformed by op and op is moved back past the entry, ready for the one below it.
+static void transform_stack(text_op *ops, size_t num, const text_op *op) {
+  text_op other;
+  text_op_clone2(&other, (text_op *)op);
+  for (size_t i = num; i-- > 0;) {
+    text_op entry, next;
+    text_op_transform_x(&next, &entry, &other, &ops[i]);
+    text_op_free(&ops[i]);
+    text_op_free(&other);
+    ops[i] = entry;
+    other = next;
+  }
+  text_op_free(&other);
+}
+
+void ot_text_undo_remote_op(ot_text_undo *undo, const text_op *op) {
+  transform_stack(undo->undo, undo->num_undo, op);
+  transform_stack(undo->redo, undo->num_redo, op);
+}
+
+// Pop the top op off from and apply it, pushing its inverse onto to. Entries which remote edits
+// have reduced to nothing are skipped. If the op doesn't apply, it stays on the stack.
+static int pop_and_apply(ot_text_undo *undo, text_op *from, size_t *num_from, text_op *to,
+    size_t *num_to, rope *doc, text_op *applied) {
+  while (*num_from) {
+    text_op *op = &from[*num_from - 1];
+    if (is_noop(op)) {
+      text_op_free(op);
+      (*num_from)--;
+      continue;
+    }
+    
+    text_op inverse;
+    if (text_op_apply_invertible(doc, op, &inverse)) {
+      return -1;
+    }
+    *applied = *op;
+    (*num_from)--;
+    push(undo, to, num_to, &inverse);
+    return 0;
+  }
+  return 1;
+}
+
+int ot_text_undo_undo(ot_text_undo *undo, rope *doc, text_op *applied) {
+  return pop_and_apply(undo, undo->undo, &undo->num_undo, undo->redo, &undo->num_redo, doc,
+      applied);
+}
+
+int ot_text_undo_redo(ot_text_undo *undo, rope *doc, text_op *applied) {
+  return pop_and_apply(undo, undo->redo, &undo->num_redo, undo->undo, &undo->num_undo, doc,
+      applied);
+}
@@ -0,0 +1,52 @@
+// Undo and redo for a collaboratively edited text document.
+//
+// Apply the user's edits with text_op_apply_invertible and push the inverse onto the undo stack.
+// Edits from other users are applied straight to the document, and the stacks are transformed
+// past them - so undoing only ever reverts the user's own edits, wherever they've moved to.
+//
+// The stacks hold at most max_entries ops each. Once a stack is full, its two oldest entries are
+// composed together to make room, so the oldest edits end up being undone in one go.
+
+#ifndef OT_undo_h
+#define OT_undo_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "text.h"
+
+typedef struct {
+  // Ops which undo the user's edits, oldest first. The last op applies to the current document,
+  // and each op before it applies to the document once everything after it has been undone.
+  text_op *undo;
+  size_t num_undo;
+
+  // Ops which redo undone edits, in the same order.
+  text_op *redo;
+  size_t num_redo;
+
+  size_t max_entries;
+} ot_text_undo;
+
+// max_entries must be at least 1.
+void ot_text_undo_init(ot_text_undo *undo, size_t max_entries);
+void ot_text_undo_destroy(ot_text_undo *undo);
+
+// Record an edit the user made. inverse is the op which undoes it (from text_op_apply_invertible).
+// The undo stack takes ownership of it. This clears the redo stack.
+void ot_text_undo_push(ot_text_undo *undo, text_op *inverse);
+
+// An op from someone else has been applied to the document. Transform both stacks past it.
+void ot_text_undo_remote_op(ot_text_undo *undo, const text_op *op);
+
+// Undo the user's most recent edit. The op which was applied to the document is written into
+// applied, so it can be sent to the server. The caller frees it. Returns 0 on success, 1 if there
+// was nothing to undo, or -1 if the edit doesn't fit the document. That happens if the document
+// was changed without telling the stacks (see ot_text_undo_remote_op); the edit is left on the
+// stack and the document is unchanged.
+int ot_text_undo_undo(ot_text_undo *undo, rope *doc, text_op *applied);
+
+// Redo the most recently undone edit. Works the same way as ot_text_undo_undo.
+int ot_text_undo_redo(ot_text_undo *undo, rope *doc, text_op *applied);
+
+#endif
@@ -5,12 +5,26 @@
 //  Created by Joseph Gentle on 2/09/12.
 //  Copyright (c) 2012 Joseph Gentle. All rights reserved.
 //
+#include <string.h>
 #include "utf8.h"
 
 #define ONEMASK ((size_t)(-1) / 0xFF)
 
+// The scanning functions read whole aligned words (or vectors) at a time, which can run past
+// the end of the string. That's safe, but it upsets AddressSanitizer and ThreadSanitizer.
+#ifdef __GNUC__
+#define NO_SANITIZE __attribute__((no_sanitize_address, no_sanitize_thread))
+#else
+#define NO_SANITIZE
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define UTF8_SIMD 1
+#include <immintrin.h>
+#endif
+
 // From http://www.daemonology.net/blog/2008-06-05-faster-utf8-strlen.html
-size_t strlen_utf8(const uint8_t *_s) {
+NO_SANITIZE static size_t strlen_utf8_scalar(const uint8_t *_s) {
   const uint8_t *s;
   size_t count = 0;
   size_t u;
@@ -61,24 +75,190 @@ done:
   return ((s - _s) - count);
 }
 
-static inline size_t codepoint_size(uint8_t byte) {
-  if (byte <= 0x7f) { return 1; } // 0x74 = 0111 1111
-  else if (byte <= 0xbf) { return SIZE_MAX; } // 1011 1111. Invalid for a starting byte.
-  else if (byte <= 0xdf) { return 2; } // 1101 1111
-  else if (byte <= 0xef) { return 3; } // 1110 1111
-  else if (byte <= 0xf7) { return 4; } // 1111 0111
-  else if (byte <= 0xfb) { return 5; } // 1111 1011
-  else if (byte <= 0xfd) { return 6; } // 1111 1101
-  else { return SIZE_MAX; }
-}
-
-// This little function counts how many bytes a certain number of characters take up.
-// Obviously, not optimized like the function above is.
-uint8_t *count_utf8_chars(const uint8_t *str, size_t num_chars) {
+// Like the vector kernels below, this counts lead bytes (anything but 10xxxxxx) rather than
+// trusting the length the first byte claims, so it can't step over the terminating zero when a
+// character is cut off.
+static uint8_t *count_utf8_chars_scalar(const uint8_t *str, size_t num_chars) {
   // Const is kinda gross. Discard qualifiers.
   uint8_t *p = (uint8_t *)str;
-  for (unsigned int i = 0; i < num_chars && *p; i++) {
-    p += codepoint_size(*p);
+  for (size_t i = 0; i < num_chars && *p; i++) {
+    p++;
+    while ((*p & 0xc0) == 0x80) {
+      p++;
+    }
   }
   return p;
 }
+
+#ifdef UTF8_SIMD
+
+// The vector kernels look at the string one aligned block at a time. For each block they make
+// two bitmasks - which bytes are zero, and which bytes start a character (anything but 10xxxxxx).
+// Aligned loads never cross a page boundary, so reading past the terminating zero (or before the
+// start of the string) is safe in the same way the word-at-a-time loop above is.
+//
+// Both functions are written once here and stamped out for each instruction set.
+// Starting from lead byte #0 (str itself), count_utf8_chars returns the position of lead byte
+// #num_chars, or the terminating zero if the string runs out first.
+#define UTF8_KERNELS(NAME, TARGET, WIDTH, MASKS) \
+  __attribute__((target(TARGET))) NO_SANITIZE \
+  static size_t strlen_utf8_##NAME(const uint8_t *s) { \
+    const uint8_t *p = (const uint8_t *)((uintptr_t)s & ~(uintptr_t)(WIDTH - 1)); \
+    uint64_t zero, lead; \
+    MASKS(p, zero, lead); \
+    uint64_t valid = ~(uint64_t)0 << (s - p); \
+    zero &= valid; \
+    lead &= valid; \
+    size_t count = 0; \
+    while (!zero) { \
+      count += __builtin_popcountll(lead); \
+      p += WIDTH; \
+      MASKS(p, zero, lead); \
+    } \
+    return count + __builtin_popcountll(lead & ((zero & -zero) - 1)); \
+  } \
+  __attribute__((target(TARGET))) NO_SANITIZE \
+  static uint8_t *count_utf8_chars_##NAME(const uint8_t *str, size_t num_chars) { \
+    const uint8_t *p = (const uint8_t *)((uintptr_t)str & ~(uintptr_t)(WIDTH - 1)); \
+    uint64_t zero, lead; \
+    MASKS(p, zero, lead); \
+    uint64_t valid = ~(uint64_t)0 << (str - p); \
+    zero &= valid; \
+    lead &= valid; \
+    for (;;) { \
+      if (zero) { \
+        lead &= (zero & -zero) - 1; \
+      } \
+      size_t count = __builtin_popcountll(lead); \
+      if (count > num_chars) { \
+        for (size_t i = 0; i < num_chars; i++) { \
+          lead &= lead - 1; \
+        } \
+        return (uint8_t *)p + __builtin_ctzll(lead); \
+      } \
+      if (zero) { \
+        return (uint8_t *)p + __builtin_ctzll(zero); \
+      } \
+      num_chars -= count; \
+      p += WIDTH; \
+      MASKS(p, zero, lead); \
+    } \
+  }
+
+// Continuation bytes are 0x80-0xbf, which is -128 to -65 as a signed byte. Everything else is
+// greater than (int8_t)0xbf.
+#define SSE2_MASKS(p, zero, lead) do { \
+    __m128i v = _mm_load_si128((const __m128i *)(p)); \
+    zero = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())); \
+    lead = (uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_set1_epi8((char)0xbf))); \
+  } while (0)
+
+#define AVX2_MASKS(p, zero, lead) do { \
+    __m256i v = _mm256_load_si256((const __m256i *)(p)); \
+    zero = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256())); \
+    lead = (uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((char)0xbf))); \
+  } while (0)
+
+#define AVX512_MASKS(p, zero, lead) do { \
+    __m512i v = _mm512_load_si512((const void *)(p)); \
+    zero = _mm512_cmpeq_epi8_mask(v, _mm512_setzero_si512()); \
+    lead = _mm512_cmpgt_epi8_mask(v, _mm512_set1_epi8((char)0xbf)); \
+  } while (0)
+
+UTF8_KERNELS(sse2, "sse2", 16, SSE2_MASKS)
+UTF8_KERNELS(avx2, "avx2,popcnt", 32, AVX2_MASKS)
+UTF8_KERNELS(avx512, "avx512bw,popcnt", 64, AVX512_MASKS)
+
+#endif
+
+// The implementations are picked the first time either function is called, based on what the
+// CPU supports.
+static size_t strlen_utf8_init(const uint8_t *s);
+static uint8_t *count_utf8_chars_init(const uint8_t *str, size_t num_chars);
+
+static size_t (*strlen_utf8_impl)(const uint8_t *) = strlen_utf8_init;
+static uint8_t *(*count_utf8_chars_impl)(const uint8_t *, size_t) = count_utf8_chars_init;
+
+static void utf8_pick_impl() {
+  size_t (*strlen_fn)(const uint8_t *) = strlen_utf8_scalar;
+  uint8_t *(*count_fn)(const uint8_t *, size_t) = count_utf8_chars_scalar;
+  
+#ifdef UTF8_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt")) {
+    strlen_fn = strlen_utf8_avx512;
+    count_fn = count_utf8_chars_avx512;
+  } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    strlen_fn = strlen_utf8_avx2;
+    count_fn = count_utf8_chars_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    strlen_fn = strlen_utf8_sse2;
+    count_fn = count_utf8_chars_sse2;
+  }
+#endif
+  
+  // If two threads race to get here they'll both store the same thing. The pointers are accessed
+  // atomically so that race is well defined; relaxed is enough because nothing else is published.
+  __atomic_store_n(&strlen_utf8_impl, strlen_fn, __ATOMIC_RELAXED);
+  __atomic_store_n(&count_utf8_chars_impl, count_fn, __ATOMIC_RELAXED);
+}
+
+static size_t strlen_utf8_init(const uint8_t *s) {
+  utf8_pick_impl();
+  return strlen_utf8(s);
+}
+
+static uint8_t *count_utf8_chars_init(const uint8_t *str, size_t num_chars) {
+  utf8_pick_impl();
+  return count_utf8_chars(str, num_chars);
+}
+
+size_t strlen_utf8(const uint8_t *s) {
+  return __atomic_load_n(&strlen_utf8_impl, __ATOMIC_RELAXED)(s);
+}
+
+uint8_t *count_utf8_chars(const uint8_t *str, size_t num_chars) {
+  return __atomic_load_n(&count_utf8_chars_impl, __ATOMIC_RELAXED)(str, num_chars);
+}
+
+size_t count_utf16_units(const uint8_t *str, size_t num_bytes) {
+  // Every byte but a continuation byte starts a character, and 4 byte lead bytes (0xf0 and up)
+  // start a pair. Simple enough for the compiler to vectorize.
+  size_t count = 0;
+  for (size_t i = 0; i < num_bytes; i++) {
+    count += (str[i] & 0xc0) != 0x80;
+    count += str[i] >= 0xf0;
+  }
+  return count;
+}
+
+ssize_t utf8_validate(const uint8_t *str, size_t num_bytes) {
+  const uint8_t *p = str, *end = str + num_bytes;
+  size_t count = 0;
+  while (p < end) {
+    // Skip over 8 ascii characters at a time. A word is plain ascii if none of its bytes have the
+    // high bit set or are zero.
+    while (end - p >= 8) {
+      uint64_t x;
+      memcpy(&x, p, 8);
+      if ((x & 0x8080808080808080ull) || ((x - 0x0101010101010101ull) & ~x & 0x8080808080808080ull)) {
+        break;
+      }
+      p += 8;
+      count += 8;
+    }
+    if (p == end) {
+      break;
+    }
+    if (*p == 0) {
+      return -1;
+    }
+    size_t size = utf8_char_size(p, end);
+    if (size == 0) {
+      return -1;
+    }
+    p += size;
+    count++;
+  }
+  return count;
+}
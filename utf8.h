@@ -11,6 +11,10 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
+
+// Both of these functions use SSE2 / AVX2 / AVX-512 when the CPU supports them. Like strlen,
+// they may read a few bytes past the end of the string (but never across a page boundary).
 
 // Count the characters in a utf8 string.
 size_t strlen_utf8(const uint8_t *_s);
@@ -18,4 +22,38 @@ size_t strlen_utf8(const uint8_t *_s);
 // This little function counts how many bytes a certain number of characters take up.
 uint8_t *count_utf8_chars(const uint8_t *str, size_t num_chars);
 
+// Count how many UTF-16 code units num_bytes of utf8 take up. Characters outside the BMP (4 byte
+// sequences) are surrogate pairs in UTF-16, so they count twice. Unlike the functions above this
+// never reads past the end.
+size_t count_utf16_units(const uint8_t *str, size_t num_bytes);
+
+// The size of the utf8 character at p, or 0 if it isn't valid: cut off by end, overlong, a
+// surrogate (U+D800 to U+DFFF) or past U+10FFFF. The range the second byte can be in depends on
+// the first byte (see the table in RFC 3629).
+static inline size_t utf8_char_size(const uint8_t *p, const uint8_t *end) {
+  uint8_t c = p[0];
+  if (c < 0x80) {
+    return 1;
+  }
+  size_t len = c < 0xc2 ? 0 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : c < 0xf5 ? 4 : 0;
+  if (len == 0 || len > (size_t)(end - p)) {
+    return 0;
+  }
+  uint8_t lo = c == 0xe0 ? 0xa0 : c == 0xf0 ? 0x90 : 0x80;
+  uint8_t hi = c == 0xed ? 0x9f : c == 0xf4 ? 0x8f : 0xbf;
+  if (p[1] < lo || p[1] > hi) {
+    return 0;
+  }
+  for (size_t i = 2; i < len; i++) {
+    if ((p[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+  }
+  return len;
+}
+
+// Check num_bytes of untrusted text is valid utf8 without any \0 bytes in it. Returns the number
+// of characters, or -1 if it isn't valid. Never reads past the end.
+ssize_t utf8_validate(const uint8_t *str, size_t num_bytes);
+
 #endif
@@ -0,0 +1,53 @@
+// LEB128 varints, shared by the v2 text op encoding (text.c) and the json op encoding (json.c) so
+// the two wire formats can't drift apart. Each byte holds 7 bits of the value, lowest first, with
+// the high bit set on every byte but the last.
+
+#ifndef OT_varint_h
+#define OT_varint_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A uint64_t never takes more than this many bytes.
+#define VARINT_MAX_BYTES 10
+
+// Read a varint from p. Returns the number of bytes read, or 0 if the varint is malformed (too
+// long, or too big for a uint64_t) or runs off the end of the buffer.
+static inline size_t varint_read(const uint8_t *p, const uint8_t *end, uint64_t *out) {
+  // Most lengths fit in one or two bytes.
+  if (end - p >= 2 && p[1] < 0x80) {
+    if (p[0] < 0x80) {
+      *out = p[0];
+      return 1;
+    }
+    *out = (p[0] & 0x7f) | (uint64_t)p[1] << 7;
+    return 2;
+  }
+  uint64_t value = 0;
+  for (int i = 0; i < VARINT_MAX_BYTES && p + i < end; i++) {
+    // The 10th byte only has room for the top bit of the value.
+    if (i == VARINT_MAX_BYTES - 1 && p[i] > 1) {
+      return 0;
+    }
+    value |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+    if ((p[i] & 0x80) == 0) {
+      *out = value;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// Write a varint into buf, which needs room for VARINT_MAX_BYTES. Returns the number of bytes
+// written.
+static inline size_t varint_write(uint8_t *buf, uint64_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    buf[n++] = (uint8_t)value | 0x80;
+    value >>= 7;
+  }
+  buf[n++] = (uint8_t)value;
+  return n;
+}
+
+#endif